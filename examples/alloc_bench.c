@@ -0,0 +1,314 @@
+/*********************************************************************
+ *
+ * Filename:      alloc_bench.c
+ * Description:   Compares the entry allocators under a steady-state
+ *                insert/remove churn on the lockless table: system
+ *                malloc, the chunked bitmask freelist of
+ *                alloc_example.c and the bitmap pool of memory_mng.c.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+
+#include <stdlib.h>    /* atoi, qsort */
+#include <stdio.h>     /* printf */
+#include <stdint.h>    /* uint64_t */
+#include <string.h>    /* memmove */
+#include <time.h>      /* clock_gettime */
+#include <unistd.h>    /* fork, sysconf */
+#include <pthread.h>
+#include <sys/wait.h>     /* waitpid */
+#include <sys/resource.h> /* getrusage */
+
+#include "ght_hash_table.h"
+#include "memory_mng.h"
+
+/* Every thread times one operation out of SAMPLE_EVERY */
+#define SAMPLE_EVERY     8
+#define MAX_THREADS      64
+
+/* The keys are 64 bit, so all entries have the same size */
+#define KEY_SIZE         sizeof(uint64_t)
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The bitmask freelist of alloc_example.c, with 64 entries per chunk
+ * and a lock, since the entries are allocated and freed by several
+ * threads. Each entry is followed by its number in the chunk, so the
+ * chunk is found from the entry.
+ */
+#define CHUNK_ELEMS 64
+
+typedef struct
+{
+  ght_hash_entry_t entry;              /* The table keeps marks in the low */
+  uint64_t key;                        /* bits of entry pointers, so the */
+  int nr;                              /* entries must be 8 byte aligned */
+} elem_t;
+
+typedef struct s_chunk
+{
+  elem_t elems[CHUNK_ELEMS];
+  uint64_t used;
+  struct s_chunk *p_next;
+  struct s_chunk *p_prev;
+} chunk_t;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  chunk_t *p_freelist;                 /* The chunks with free entries */
+} chunk_pool_t;
+
+static void freelist_unlink(chunk_pool_t *p_pool, chunk_t *p_chunk)
+{
+  if (p_chunk->p_prev)
+    p_chunk->p_prev->p_next = p_chunk->p_next;
+  else
+    p_pool->p_freelist = p_chunk->p_next;
+  if (p_chunk->p_next)
+    p_chunk->p_next->p_prev = p_chunk->p_prev;
+}
+
+static void freelist_push(chunk_pool_t *p_pool, chunk_t *p_chunk)
+{
+  p_chunk->p_prev = NULL;
+  p_chunk->p_next = p_pool->p_freelist;
+  if (p_chunk->p_next)
+    p_chunk->p_next->p_prev = p_chunk;
+  p_pool->p_freelist = p_chunk;
+}
+
+static void *chunk_alloc(void *p_ctx, size_t size, unsigned int i_key_size)
+{
+  chunk_pool_t *p_pool = (chunk_pool_t *)p_ctx;
+  chunk_t *p_chunk;
+  int i;
+
+  pthread_mutex_lock(&p_pool->lock);
+  if (!(p_chunk = p_pool->p_freelist))
+    {
+      if (!(p_chunk = (chunk_t *)calloc(1, sizeof(chunk_t))))
+        {
+          pthread_mutex_unlock(&p_pool->lock);
+          return NULL;
+        }
+      freelist_push(p_pool, p_chunk);
+    }
+  i = __builtin_ctzll(~p_chunk->used);
+  p_chunk->used |= 1ULL << i;
+  p_chunk->elems[i].nr = i;
+  if (p_chunk->used == ~0ULL)
+    freelist_unlink(p_pool, p_chunk);     /* This chunk is full */
+  pthread_mutex_unlock(&p_pool->lock);
+
+  return &p_chunk->elems[i].entry;
+}
+
+static void chunk_free(void *p_ctx, void *p, size_t size)
+{
+  chunk_pool_t *p_pool = (chunk_pool_t *)p_ctx;
+  elem_t *p_elem = (elem_t *)p;
+  chunk_t *p_chunk = (chunk_t *)(p_elem - p_elem->nr);
+
+  pthread_mutex_lock(&p_pool->lock);
+  if (p_chunk->used == ~0ULL)
+    freelist_push(p_pool, p_chunk);
+  p_chunk->used &= ~(1ULL << p_elem->nr);
+  if (p_chunk->used == 0)
+    {
+      freelist_unlink(p_pool, p_chunk);
+      free(p_chunk);
+    }
+  pthread_mutex_unlock(&p_pool->lock);
+}
+
+static const ght_allocator_t chunk_allocator = { chunk_alloc, chunk_free, NULL, NULL };
+
+/* --- the benchmark --- */
+
+typedef struct
+{
+  ght_hash_table_t *p_table;
+  unsigned int i_thread;
+  unsigned int n_threads;
+  unsigned int n_keys;
+  unsigned int n_ops;
+  uint64_t *p_samples;
+  unsigned int n_samples;
+} worker_t;
+
+static void *worker(void *p_arg)
+{
+  worker_t *p_w = (worker_t *)p_arg;
+  unsigned int seed = p_w->i_thread * 7919 + 1;
+  uint64_t key;
+  uint64_t start;
+  int value = 1;
+  unsigned int i;
+
+  /* Each thread churns its own share of the keys: half of them are in
+   * the table, so an insert and a remove at random keep it half full */
+  for (i = 0; i < p_w->n_ops; i++)
+    {
+      key = (uint64_t)(rand_r(&seed) % (p_w->n_keys / p_w->n_threads)) * p_w->n_threads + p_w->i_thread;
+      start = (i % SAMPLE_EVERY == 0) ? now_ns() : 0;
+      if (i & 1)
+        lockless_ght_remove(p_w->p_table, KEY_SIZE, &key);
+      else
+        lockless_ght_insert(p_w->p_table, &value, KEY_SIZE, &key);
+      if (start)
+        p_w->p_samples[p_w->n_samples++] = now_ns() - start;
+    }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static long rss_kb(void)
+{
+  long pages = 0;
+  long resident = 0;
+  FILE *p_file;
+
+  if ((p_file = fopen("/proc/self/statm", "r")))
+    {
+      if (fscanf(p_file, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+      fclose(p_file);
+    }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Run one allocator with n_threads threads, in its own process so the
+ * memory numbers are its own */
+static void run(const char *name, int i_alloc, unsigned int n_threads, unsigned int n_keys, unsigned int n_ops)
+{
+  ght_hash_table_t *p_table;
+  LOCKLESS_ENTRY_POOL_ST pool;
+  chunk_pool_t chunks = { PTHREAD_MUTEX_INITIALIZER, NULL };
+  pthread_t threads[MAX_THREADS];
+  worker_t workers[MAX_THREADS];
+  struct rusage usage;
+  uint64_t *p_all;
+  uint64_t start, elapsed;
+  unsigned int n_all = 0;
+  unsigned int i;
+  uint64_t key;
+  int value = 1;
+
+  p_table = ght_create(n_keys);
+  if (i_alloc == 1)
+    ght_set_allocator(p_table, &chunk_allocator, &chunks);
+  else if (i_alloc == 2)
+    {
+      if (init_entry_pool(&pool, 1, n_threads) < 0)
+        exit(1);
+      ght_set_allocator(p_table, &lockless_pool_allocator, &pool);
+    }
+
+  /* Half of the keys are in the table from the start */
+  for (key = 0; key < n_keys; key += 2)
+    lockless_ght_insert(p_table, &value, KEY_SIZE, &key);
+
+  p_all = (uint64_t *)malloc(((size_t)n_ops / SAMPLE_EVERY + 1) * n_threads * sizeof(uint64_t));
+  for (i = 0; i < n_threads; i++)
+    {
+      workers[i].p_table = p_table;
+      workers[i].i_thread = i;
+      workers[i].n_threads = n_threads;
+      workers[i].n_keys = n_keys;
+      workers[i].n_ops = n_ops;
+      workers[i].p_samples = p_all + (size_t)i * (n_ops / SAMPLE_EVERY + 1);
+      workers[i].n_samples = 0;
+    }
+
+  start = now_ns();
+  for (i = 0; i < n_threads; i++)
+    pthread_create(&threads[i], NULL, worker, &workers[i]);
+  for (i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+  elapsed = now_ns() - start;
+
+  /* Gather the samples of all threads to the front */
+  for (i = 0; i < n_threads; i++)
+    {
+      memmove(p_all + n_all, workers[i].p_samples, workers[i].n_samples * sizeof(uint64_t));
+      n_all += workers[i].n_samples;
+    }
+  qsort(p_all, n_all, sizeof(uint64_t), cmp_u64);
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%-10s %7u %10.2f %8llu %8llu %8llu %10ld %10ld\n", name, n_threads,
+         (double)n_ops * n_threads / (elapsed / 1000.0),
+         (unsigned long long)p_all[n_all / 2],
+         (unsigned long long)p_all[(size_t)n_all * 99 / 100],
+         (unsigned long long)p_all[(size_t)n_all * 999 / 1000],
+         rss_kb(), usage.ru_maxrss);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *names[] = { "malloc", "chunks", "memory_mng" };
+  unsigned int max_threads = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int n_keys = 1 << 20;
+  unsigned int n_ops = 1000000;
+  unsigned int n;
+  int i_alloc;
+  pid_t pid;
+
+  if (argc > 1)
+    max_threads = atoi(argv[1]);
+  if (argc > 2)
+    n_keys = atoi(argv[2]);
+  if (argc > 3)
+    n_ops = atoi(argv[3]);
+  if (max_threads < 1)
+    max_threads = 1;
+  if (max_threads > MAX_THREADS)
+    max_threads = MAX_THREADS;
+
+  printf("%u keys, %u operations per thread, every %dth operation timed\n", n_keys, n_ops, SAMPLE_EVERY);
+  printf("%-10s %7s %10s %8s %8s %8s %10s %10s\n", "allocator", "threads", "Mops/s",
+         "p50 ns", "p99 ns", "p99.9 ns", "RSS kB", "peak kB");
+  /* The children would print what is still buffered again */
+  fflush(stdout);
+
+  /* Double the threads up to max_threads, which is always run */
+  for (n = 1; n <= max_threads; n = (n < max_threads && n * 2 > max_threads) ? max_threads : n * 2)
+    {
+      for (i_alloc = 0; i_alloc < 3; i_alloc++)
+        {
+          if ((pid = fork()) == 0)
+            {
+              run(names[i_alloc], i_alloc, n, n_keys, n_ops);
+              _exit(0);
+            }
+          waitpid(pid, NULL, 0);
+        }
+    }
+
+  return 0;
+}
@@ -81,15 +81,21 @@ typedef struct s_alloc
   struct s_alloc *p_prev;
 } alloc_t;
 
-alloc_t *p_freelist=NULL;
+/* The allocator state of one table, given to the functions as context */
+typedef struct
+{
+  alloc_t *p_freelist;
+} pool_t;
 
 
 /* The allocate function to use */
-void *my_alloc(size_t size)
+void *my_alloc(void *p_ctx, size_t size, unsigned int i_key_size)
 {
+  pool_t *p_pool = (pool_t*)p_ctx;
+  alloc_t *p_freelist = p_pool->p_freelist;
   int i;
 
-  assert(size == ELEM_SIZE);
+  assert(size == ELEM_SIZE && i_key_size == sizeof(int));
 
   /* No free chunks, allocate a new one */
   if ( !p_freelist )
@@ -97,6 +103,7 @@ void *my_alloc(size_t size)
       if ( !(p_freelist = (alloc_t*)malloc(sizeof(alloc_t))) )
 	return (void*)NULL;
       memset(p_freelist, 0, sizeof(alloc_t));
+      p_pool->p_freelist = p_freelist;
     }
 
   /* Find a free entry */
@@ -111,7 +118,7 @@ void *my_alloc(size_t size)
 	  p_freelist->elems[i].nr = i;
 
 	  if ( p_freelist->bitmask == (1<<NR_ELEMS)-1 )
-	    p_freelist = p_freelist->p_next; /* This entry is full */
+	    p_pool->p_freelist = p_freelist->p_next; /* This entry is full */
 
 	  return p_ret;
 	}
@@ -122,8 +129,10 @@ void *my_alloc(size_t size)
 }
 
 /* The free function to use */
-void my_free(void *p)
+void my_free(void *p_ctx, void *p, size_t size)
 {
+  pool_t *p_pool = (pool_t*)p_ctx;
+  alloc_t *p_freelist = p_pool->p_freelist;
   elem_t *p_elem = (elem_t *)p;
   alloc_t *p_alloc = (alloc_t*) (p_elem-p_elem->nr);
 
@@ -132,8 +141,9 @@ void my_free(void *p)
       /* There were no free elements here before, insert first into freelist */
       p_alloc->p_next = p_freelist;
       p_alloc->p_prev = NULL;
-      p_freelist->p_prev = p_alloc;
-      p_freelist = p_alloc;
+      if (p_freelist)
+	p_freelist->p_prev = p_alloc;
+      p_pool->p_freelist = p_alloc;
     }
   else if ( p_alloc->bitmask == ((unsigned int)1<<p_elem->nr) )
     {
@@ -144,7 +154,7 @@ void my_free(void *p)
       if (p_prev)
 	p_prev->p_next = p_next;
       else
-	p_freelist = p_next; /* First in list */
+	p_pool->p_freelist = p_next; /* First in list */
 
       if (p_next)
 	p_next->p_prev = p_prev;
@@ -179,6 +189,8 @@ int main(int argc, char *argv[])
   char *p_tok;
   const void *p_key;
   void *p_e;
+  ght_allocator_t allocator = { my_alloc, my_free, NULL, NULL };
+  pool_t pool = { NULL };
 
   /* Create a new hash table */
   if ( !(p_table = ght_create(1000)) )
@@ -210,7 +222,7 @@ int main(int argc, char *argv[])
   /* Set the allocation/deallocation functions for the table */
   if (!i_std_malloc)
     {
-      ght_set_alloc(p_table, my_alloc, my_free);
+      ght_set_allocator(p_table, &allocator, &pool);
     }
 
   /* Open the dictionary file (first check its size) */
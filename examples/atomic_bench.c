@@ -0,0 +1,262 @@
+/*********************************************************************
+ *
+ * Filename:      atomic_bench.c
+ * Description:   Measures the per-operation cost (in cycles) of the
+ *                lockless primitives and of the lockless table
+ *                operations built on them. On x86-64 the primitives
+ *                are also timed in the out-of-line lock cmpxchg8b
+ *                form hash_table.c used before ght_atomic.h.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+
+#include <stdlib.h>    /* atoi */
+#include <stdio.h>     /* printf */
+#include <stdint.h>    /* uint64_t */
+#include <time.h>      /* clock_gettime */
+
+#include "ght_hash_table.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define CYCLES() __rdtsc()
+# define UNIT "cycles"
+#else
+static uint64_t CYCLES(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+# define UNIT "ns"
+#endif
+
+#define N_PRIMITIVE_LOOPS 10000000
+
+#if defined(__x86_64__)
+/*
+ * Copies of the primitives as hash_table.c had them, noinline
+ * functions around lock cmpxchg8b, to time them against the inlined
+ * ones. The copies of the mark functions take ght_hash_entry_t **
+ * throughout, the originals disagreed with their own prototypes.
+ */
+# define HAVE_LEGACY 1
+
+static int __attribute__((noinline)) legacy_CAS1(ght_hash_entry_t **addr, ght_hash_entry_t **old, ght_hash_entry_t **new)
+{
+  asm volatile goto ("movq %[old], %%RDX\n\t"
+                     "movl %%EDX, %%EAX\n\t"
+                     "shr $32, %%RDX\n\t"
+                     "movq %[new], %%RCX\n\t"
+                     "movl %%ECX, %%EBX\n\t"
+                     "shr $32, %%RCX\n\t"
+                     "lock\n\t"
+                     "cmpxchg8b %[addr]\n\t"
+                     "jz %l[done]"
+                     :
+                     :[old] "m" (*old), [new] "m" (*new), [addr] "m" (*addr)
+                     :"rax", "rbx", "rcx", "rdx"
+                     :done);
+  return 0;
+ done:
+  return 1;
+}
+
+static int __attribute__((noinline)) legacy_Mark_delete(ght_hash_entry_t **addr)
+{
+  asm volatile goto ("movq %[addr], %%RDX\n\t"
+                     "movl %%EDX, %%EAX\n\t"
+                     "shr $32, %%RDX\n\t"
+                     "movl %%EDX, %%ECX\n\t"
+                     "movl %%EAX, %%EBX\n\t"
+                     "andl $0xfffffff8, %%EAX\n\t"
+                     "orl $0x1, %%EBX\n\t"
+                     "andl $0xfffffffd, %%EBX\n\t"
+                     "lock\n\t"
+                     "cmpxchg8b %[addr]\n\t"
+                     "jz %l[success]"
+                     :
+                     :[addr] "m" (*addr)
+                     :"rax", "rbx", "rcx", "rdx"
+                     :success);
+  return 0;
+ success:
+  return 1;
+}
+
+static int __attribute__((noinline)) legacy_Unmark_delete(ght_hash_entry_t **addr)
+{
+  asm volatile goto ("movq %[addr], %%RDX\n\t"
+                     "movl %%EDX, %%EAX\n\t"
+                     "shr $32, %%RDX\n\t"
+                     "movl %%EAX, %%EBX\n\t"
+                     "movl %%EDX, %%ECX\n\t"
+                     "andl $0xfffffffe, %%EBX\n\t"
+                     "lock\n\t"
+                     "cmpxchg8b %[addr]\n\t"
+                     "jz %l[success]"
+                     :
+                     :[addr] "m" (*addr)
+                     :"rax", "rbx", "rcx", "rdx"
+                     :success);
+  return 0;
+ success:
+  return 1;
+}
+
+static int __attribute__((noinline)) legacy_Has_Delete_Mark(ght_hash_entry_t **addr)
+{
+  asm volatile goto ("movq %[addr], %%RDX\n\t"
+                     "andl $0x1, %%EDX\n\t"
+                     "test %%EDX, %%EDX\n\t"
+                     "jz %l[fail]"
+                     :
+                     :[addr] "m" (*addr)
+                     :"rdx"
+                     :fail);
+  return 1;
+ fail:
+  return 0;
+}
+
+static inline void legacy_FAA(unsigned int *address, signed int value)
+{
+  asm volatile ("movl %[val], %%eax\n\t"
+                "lock\n\t"
+                "XADD %%eax, %[addr]"
+                :
+                :[val] "m" (value), [addr] "m" (*address)
+                :"eax", "memory");
+}
+#endif
+
+/* Print the cost per op of the legacy form, if it was timed, and of
+ * the current one */
+static void report(const char *name, double legacy, uint64_t start, uint64_t end, unsigned int n)
+{
+  if (legacy < 0)
+    printf("%-28s %10s %10.2f\n", name, "-", (double)(end - start) / n);
+  else
+    printf("%-28s %10.2f %10.2f\n", name, legacy, (double)(end - start) / n);
+}
+
+static double per_op(uint64_t start, uint64_t end, unsigned int n)
+{
+  return (double)(end - start) / n;
+}
+
+int main(int argc, char *argv[])
+{
+  ght_hash_table_t *p_table;
+  ght_hash_entry_t entry;
+  ght_hash_entry_t *p_link = NULL;
+  ght_hash_entry_t *p_old;
+  ght_hash_entry_t *p_new;
+  unsigned int counter = 0;
+  unsigned int n_keys = 1000000;
+  unsigned int i;
+  int found = 0;
+  int value = 1;
+  uint64_t start;
+  double legacy;
+
+  if (argc > 1)
+    n_keys = atoi(argv[1]);
+
+  printf("%-28s %10s %10s  (%s/op)\n", "", "legacy", "inline", UNIT);
+
+  /* The primitives on an uncontended link word */
+  legacy = -1;
+#ifdef HAVE_LEGACY
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    found += legacy_Has_Delete_Mark(&p_link);
+  legacy = per_op(start, CYCLES(), N_PRIMITIVE_LOOPS);
+#endif
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    found += Has_Delete_Mark(&p_link);
+  report("Has_Delete_Mark", legacy, start, CYCLES(), N_PRIMITIVE_LOOPS);
+
+#ifdef HAVE_LEGACY
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    {
+      legacy_Mark_delete(&p_link);
+      legacy_Unmark_delete(&p_link);
+    }
+  legacy = per_op(start, CYCLES(), N_PRIMITIVE_LOOPS);
+#endif
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    {
+      Mark_delete(&p_link);
+      Unmark_delete(&p_link);
+    }
+  report("Mark_delete+Unmark_delete", legacy, start, CYCLES(), N_PRIMITIVE_LOOPS);
+
+#ifdef HAVE_LEGACY
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    {
+      p_old = (i & 1) ? &entry : NULL;
+      p_new = (i & 1) ? NULL : &entry;
+      found += legacy_CAS1(&p_link, &p_old, &p_new);
+    }
+  legacy = per_op(start, CYCLES(), N_PRIMITIVE_LOOPS);
+#endif
+  p_link = NULL;
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    {
+      p_old = (i & 1) ? &entry : NULL;
+      p_new = (i & 1) ? NULL : &entry;
+      found += CAS1(&p_link, &p_old, &p_new);
+    }
+  report("CAS1", legacy, start, CYCLES(), N_PRIMITIVE_LOOPS);
+
+#ifdef HAVE_LEGACY
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    legacy_FAA(&counter, 1);
+  legacy = per_op(start, CYCLES(), N_PRIMITIVE_LOOPS);
+#endif
+  start = CYCLES();
+  for (i = 0; i < N_PRIMITIVE_LOOPS; i++)
+    FAA(&counter, 1);
+  report("FAA", legacy, start, CYCLES(), N_PRIMITIVE_LOOPS);
+
+  /* The lockless table operations. The old table code is gone, so
+   * they have no legacy column. */
+  p_table = ght_create(n_keys);
+
+  start = CYCLES();
+  for (i = 0; i < n_keys; i++)
+    lockless_ght_insert(p_table, &value, sizeof(i), &i);
+  report("lockless_ght_insert", -1, start, CYCLES(), n_keys);
+
+  start = CYCLES();
+  for (i = 0; i < n_keys; i++)
+    found += lockless_ght_get(p_table, sizeof(i), &i) != NULL;
+  report("lockless_ght_get", -1, start, CYCLES(), n_keys);
+
+  start = CYCLES();
+  for (i = 0; i < n_keys; i++)
+    found += lockless_ght_remove(p_table, sizeof(i), &i) != NULL;
+  report("lockless_ght_remove", -1, start, CYCLES(), n_keys);
+
+  ght_finalize(p_table);
+
+  /* Keep the compiler from dropping the loops */
+  return (found + counter) == 0;
+}
@@ -51,30 +51,17 @@ struct hash_data {
 
 HASH_MEM_ACCESS_LAYER_ST hash;
 
-void *my_alloc(size_t size) {
-	int index = lockless_alloc_memory(&hash.memory_manager);
-	ght_hash_entry_t *static_memory =  (ght_hash_entry_t *) hash.static_memory;
-	if(index != -1){
-		return &static_memory[index];
-	}
-	return NULL;
-}
-
-void my_free(void *p) {
-	int index =  ((ght_hash_entry_t *) p ) - ( (ght_hash_entry_t *) hash.static_memory );
-	lockless_dealloc_memory(&hash.memory_manager, index);
-}
-
 void* insert(void* unused) {
 	int threadid = unused;
 	int i=0;
 	struct hash_data *data = NULL;
+	lockless_ght_pin_t pin;
 	int *key = calloc(1, sizeof(int));
 	struct hash_data *org_data = calloc(1, sizeof(struct hash_data));
 	for(i=1; i <= MAX_INSERT; i++) {
 		*key = i + (threadid * MAX_INSERT);
 		// *key = i;
-		data = (struct hash_data *)lockless_ght_get(hash.p_table, sizeof(int), key );
+		data = (struct hash_data *)lockless_ght_get_pinned(hash.p_table, sizeof(int), key, &pin);
 		if(data == NULL) {
 			//data = calloc(1, sizeof(struct hash_data));
 			org_data->last_timestamp = time(NULL);
@@ -82,6 +69,7 @@ void* insert(void* unused) {
 		}
 		else {
 			data->last_timestamp = time(NULL);
+			lockless_ght_unpin(hash.p_table, &pin);
 			FAA(&update_count, 1);
 		}
 	}
@@ -165,20 +153,12 @@ void debug_delete() {
 
 }
 int main() {
-	hash.p_table = ght_create(MAX_BUCKETS);
-
-//	 init_array_lookup_table( &hash.memory_manager, 12, 10, &hash.static_memory, sizeof(int));
-//	 ght_set_alloc(hash.p_table, my_alloc, my_free);
+	LOCKLESS_MEMORY_STATS_ST stats;
+	/* The table owns an entry pool, the entries never go to malloc */
+	hash.p_table = ght_create_concurrent(MAX_BUCKETS, sizeof(int), ITHREAD_NUM + ITTHREAD_NUM + DTHREAD_NUM);
 
 
-	ght_hash_entry_t *p_e = (ght_hash_entry_t *)hash.static_memory;
 	int i=0;
-	for(i=0;i<hash.memory_manager.limit_size;i++){
-		if(p_e[i].key.p_key == NULL){
-			printf("Can Not Allocated Static Memory For Key index:%d \n", i);
-			exit(0);
-		}
-	}
 
 
 	// if(hash.static_memory == NULL)
@@ -197,7 +177,10 @@ int main() {
 		ght_size(hash.p_table);
 		//printf("num of item in hash_table: %d hash_bucket_items:%d\n", hash.p_table->i_items, hash.memory_manager.cur_allocated_num);
 		printf("items in hash_table: %d\n", ght_size(hash.p_table));
-		printf("items in memory_mng: %d\n", hash.memory_manager.cur_allocated_num);
+		lockless_memory_stats(hash.p_table->p_pool, &stats);
+		printf("items in memory_mng: %u (high water %u)\n", stats.allocated, stats.high_water);
+		printf("allocs/frees in memory_mng: %llu/%llu, cas retries: %llu\n", (unsigned long long) stats.allocs,
+				(unsigned long long) stats.frees, (unsigned long long) stats.cas_retries);
 		printf("deleted items by iterator: %d\n", iterator_count);
 		printf("delete count: %d\n", delete_count);
 		// printf("del count1: %d\n", del1_count);
@@ -0,0 +1,196 @@
+/*********************************************************************
+ *
+ * Filename:      save_load.c
+ * Description:   Saves a hash table to a file with ght_save(), loads
+ *                it into a new table with ght_load(), brings the copy
+ *                up to date with a delta from ght_checkpoint() and
+ *                checks it by iterating over it and removing every
+ *                entry.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+
+#include <stdlib.h>    /* malloc, atoi */
+#include <stdio.h>     /* printf, tmpfile */
+#include <string.h>    /* memcpy */
+#include <unistd.h>    /* lseek, ftruncate */
+
+#include "ght_hash_table.h"
+
+/* Serialize the integer data of an entry */
+static size_t save_int(void *p_data, void *p_buf, size_t i_size, void *p_ctx)
+{
+  if (i_size >= sizeof(int))
+    memcpy(p_buf, p_data, sizeof(int));
+  return sizeof(int);
+}
+
+/* Recreate the integer data of an entry, called from the loading threads */
+static void *load_int(const void *p_buf, size_t i_size, void *p_ctx)
+{
+  int *p_data;
+
+  if (i_size != sizeof(int) || !(p_data = (int*)malloc(sizeof(int))))
+    return NULL;
+  memcpy(p_data, p_buf, sizeof(int));
+  return p_data;
+}
+
+/* Free the data of an entry that a replayed delta replaces */
+static void free_int(void *p_data, const void *p_key)
+{
+  free(p_data);
+}
+
+/* Start the file over */
+static int rewind_fd(int fd)
+{
+  lseek(fd, 0, SEEK_SET);
+  return ftruncate(fd, 0);
+}
+
+int main(int argc, char *argv[])
+{
+  ght_hash_table_t *p_table;
+  ght_hash_table_t *p_loaded;
+  ght_iterator_t iterator;
+  const void *p_key;
+  int i_items = 100000;
+  int i_threads = 4;
+  int i_seen = 0;
+  int i_delta;
+  FILE *p_file;
+  int *p_data;
+  int fd;
+  int i;
+
+  if (argc > 1)
+    i_items = atoi(argv[1]);
+  if (argc > 2)
+    i_threads = atoi(argv[2]);
+
+  /* Fill a small table, it is rehashed as it grows */
+  p_table = ght_create(64);
+  ght_set_rehash(p_table, TRUE);
+  for (i = 0; i < i_items; i++)
+    {
+      if ( !(p_data = (int*)malloc(sizeof(int))) )
+	{
+	  perror("malloc");
+	  return -1;
+	}
+      *p_data = i_items - i;
+      if (ght_insert(p_table, p_data, sizeof(int), &i) < 0)
+	fprintf(stderr, "ERROR: Could not insert into table\n");
+    }
+
+  if ( !(p_file = tmpfile()) )
+    {
+      perror("tmpfile");
+      return -1;
+    }
+  fd = fileno(p_file);
+
+  if (ght_save(p_table, fd, save_int, NULL) != i_items)
+    {
+      fprintf(stderr, "ERROR: Could not save the table\n");
+      return -1;
+    }
+  printf("Saved %d elements.\n", i_items);
+
+  /* Load the image into a new table, which is not created at the saved size */
+  lseek(fd, 0, SEEK_SET);
+  p_loaded = ght_create(64);
+  if (ght_load(p_loaded, fd, i_threads, load_int, NULL) != i_items ||
+      ght_size(p_loaded) != (unsigned int)i_items)
+    {
+      fprintf(stderr, "ERROR: Could not load the table\n");
+      return -1;
+    }
+  printf("Loaded %d elements with %d threads into %u buckets.\n",
+	 i_items, i_threads, ght_table_size(p_loaded));
+
+  /* Track the changes to the original table. The first checkpoint
+   * holds every bucket, which the loaded table has already. */
+  if (ght_set_dirty_tracking(p_table, TRUE) < 0 || rewind_fd(fd) < 0 ||
+      ght_checkpoint(p_table, fd, TRUE, save_int, NULL) != i_items)
+    {
+      fprintf(stderr, "ERROR: Could not checkpoint the table\n");
+      return -1;
+    }
+
+  /* Remove every tenth element, then replay the changed buckets */
+  for (i = 0; i < i_items; i += 10)
+    free(ght_remove(p_table, sizeof(int), &i));
+  if (rewind_fd(fd) < 0 ||
+      (i_delta = ght_checkpoint(p_table, fd, FALSE, save_int, NULL)) < 0)
+    {
+      fprintf(stderr, "ERROR: Could not checkpoint the table\n");
+      return -1;
+    }
+  lseek(fd, 0, SEEK_SET);
+  if (ght_replay(p_loaded, fd, i_threads, load_int, free_int, NULL) != i_delta ||
+      ght_size(p_loaded) != ght_size(p_table))
+    {
+      fprintf(stderr, "ERROR: Could not replay the delta\n");
+      return -1;
+    }
+  printf("Replayed a delta of %d elements, %u are left.\n", i_delta, ght_size(p_loaded));
+  fclose(p_file);
+
+  /* Every loaded entry is visited, with the data it was saved with */
+  for (p_data = (int*)ght_first(p_loaded, &iterator, &p_key); p_data;
+       p_data = (int*)ght_next(p_loaded, &iterator, &p_key))
+    {
+      if (*p_data != i_items - *(const int*)p_key ||
+	  ght_get(p_table, sizeof(int), p_key) == NULL)
+	{
+	  printf("Found %d for key %d. WRONG!\n", *p_data, *(const int*)p_key);
+	  return -1;
+	}
+      i_seen++;
+    }
+  if (i_seen != (int)ght_size(p_table))
+    {
+      printf("Iterated over %d of %u elements. WRONG!\n", i_seen, ght_size(p_table));
+      return -1;
+    }
+  printf("Iterated over %d elements. All tested OK\n", i_seen);
+
+  /* Remove everything from the loaded table */
+  for (i = 0; i < i_items; i++)
+    {
+      p_data = (int*)ght_remove(p_loaded, sizeof(int), &i);
+      if (i % 10 == 0 && !p_data)
+	continue;
+      if (!p_data || i % 10 == 0 || *p_data != i_items - i)
+	{
+	  printf("Could not remove key %d. WRONG!\n", i);
+	  return -1;
+	}
+      free(p_data);
+    }
+  if (ght_size(p_loaded) != 0)
+    {
+      printf("%u elements left after the removals. WRONG!\n", ght_size(p_loaded));
+      return -1;
+    }
+  printf("Removed %d elements. All tested OK\n", i_seen);
+
+  for (p_data = (int*)ght_first(p_table, &iterator, &p_key); p_data;
+       p_data = (int*)ght_next(p_table, &iterator, &p_key))
+    free(p_data);
+  ght_finalize(p_table);
+  ght_finalize(p_loaded);
+
+  return 0;
+}
@@ -0,0 +1,115 @@
+/*********************************************************************
+ *
+ * Filename:      backoff.c
+ * Description:   Contention backoff policies for the lockless
+ *                algorithms.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+#include <sched.h>  /* sched_yield */
+#include <time.h>   /* nanosleep */
+#include <stdint.h>
+
+#ifdef __linux__
+#include <unistd.h>       /* syscall */
+#include <sys/syscall.h>  /* SYS_futex */
+#include <linux/futex.h>  /* FUTEX_WAIT_PRIVATE */
+#endif
+
+#include "ght_hash_table.h"
+#include "ght_private.h"
+
+/* The number of rounds spent in each phase of ght_backoff_exponential() */
+#define BACKOFF_SPIN_ROUNDS   10 /* Up to 2^10 pause instructions */
+#define BACKOFF_YIELD_ROUNDS   4
+#define BACKOFF_SLEEP_NS      (100 * 1000)
+
+/* The number of threads currently sleeping in a wait channel. Wakers
+ * only make a system call when this is non-zero. */
+unsigned int ght_backoff_sleepers = 0;
+
+/* xorshift, gives every waiter its own jitter */
+static inline unsigned int next_random(ght_backoff_t *p_backoff)
+{
+  unsigned int x = p_backoff->i_seed;
+
+  if (x == 0)
+    x = (unsigned int) (uintptr_t) p_backoff | 1;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  p_backoff->i_seed = x;
+
+  return x;
+}
+
+/* The futex is the 32 bit half of the word holding the mark bits */
+static inline int *futex_word(void *p_word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (int *) p_word + (sizeof(void *) / sizeof(int) - 1);
+#else
+  return (int *) p_word;
+#endif
+}
+
+static void wait_on_word(void *p_word)
+{
+  struct timespec ts = { 0, BACKOFF_SLEEP_NS };
+
+#ifdef __linux__
+  if (p_word)
+    {
+      int *p_futex = futex_word(p_word);
+
+      __atomic_add_fetch(&ght_backoff_sleepers, 1, __ATOMIC_SEQ_CST);
+      /* Returns at once if the word already changed */
+      syscall(SYS_futex, p_futex, FUTEX_WAIT_PRIVATE,
+              __atomic_load_n(p_futex, __ATOMIC_SEQ_CST), &ts, NULL, 0);
+      __atomic_sub_fetch(&ght_backoff_sleepers, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+#endif
+  nanosleep(&ts, NULL);
+}
+
+void ght_backoff_exponential(ght_backoff_t *p_backoff, void *p_word)
+{
+  unsigned int i_attempt = p_backoff->i_attempt++;
+
+  if (i_attempt < BACKOFF_SPIN_ROUNDS)
+    {
+      /* Pause for a random time in [2^(n-1), 2^n) */
+      unsigned int i_limit = 1u << i_attempt;
+      unsigned int i_spins = (i_limit >> 1) + (next_random(p_backoff) & ((i_limit - 1) >> 1));
+
+      while (i_spins-- > 0)
+        ght_cpu_relax();
+    }
+  else if (i_attempt < BACKOFF_SPIN_ROUNDS + BACKOFF_YIELD_ROUNDS)
+    sched_yield();
+  else
+    wait_on_word(p_word);
+}
+
+void ght_backoff_spin(ght_backoff_t *p_backoff, void *p_word)
+{
+  p_backoff->i_attempt++;
+  ght_cpu_relax();
+}
+
+void ght_backoff_wake_channel(void *p_word)
+{
+#ifdef __linux__
+  syscall(SYS_futex, futex_word(p_word), FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
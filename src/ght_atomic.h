@@ -0,0 +1,263 @@
+/*-*-c-*- ************************************************************
+ *
+ * Filename:      ght_atomic.h
+ * Description:   Inlined atomic primitives used by the lockless
+ *                hash table and the static memory manager.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+
+/**
+ * @file
+ * The atomic layer of the lockless hash table. Every primitive is a
+ * <TT>static inline</TT> function built on the GCC <TT>__atomic</TT>
+ * builtins, so mark tests and CAS operations on the hot path compile
+ * down to a single locked instruction (or a plain load) at the call
+ * site instead of a call to an out-of-line asm helper.
+ *
+ * Link pointers (<TT>p_next</TT>, <TT>p_prev</TT> and the bucket heads)
+ * carry two mark bits in their lowest bits:
+ *
+ * - <TT>GHT_MARK_DELETE</TT> (bit 0) is set while an entry is being
+ *   linked in or unlinked.
+ * - <TT>GHT_MARK_ITERATION</TT> (bit 1) is set while an iterator
+ *   stands on an entry.
+ *
+ * Bit 2 is reserved and must be clear for a mark to be acquired.
+ */
+#ifndef GHT_ATOMIC_H
+#define GHT_ATOMIC_H
+
+#include <stdint.h>		       /* uintptr_t, uint64_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GHT_MARK_DELETE               0x1
+#define GHT_MARK_ITERATION            0x2
+#define GHT_MARK_MASK                 0x3
+#define GHT_MARK_RESERVED             0x7
+
+struct s_hash_entry;
+
+/* --- generic primitives --- */
+
+/** Hint to the CPU that we are in a spin-wait loop. */
+static inline void ght_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline struct s_hash_entry *ght_atomic_load_ptr(struct s_hash_entry **addr)
+{
+  return __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+}
+
+static inline void ght_atomic_store_ptr(struct s_hash_entry **addr, struct s_hash_entry *value)
+{
+  __atomic_store_n(addr, value, __ATOMIC_RELEASE);
+}
+
+/** Compare-and-swap a link word given by value. */
+static inline int ght_atomic_cas_word(struct s_hash_entry **addr, uintptr_t old, uintptr_t new_value)
+{
+  return __atomic_compare_exchange_n((uintptr_t *)addr, &old, new_value, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline int ght_atomic_cas_u64(uint64_t *addr, uint64_t old, uint64_t new_value)
+{
+  return __atomic_compare_exchange_n(addr, &old, new_value, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline int ght_atomic_cas_int(int *addr, int old, int new_value)
+{
+  return __atomic_compare_exchange_n(addr, &old, new_value, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline int ght_atomic_cas_uint(unsigned int *addr, unsigned int old, unsigned int new_value)
+{
+  return __atomic_compare_exchange_n(addr, &old, new_value, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/** Atomically add @a value to @a addr and return the previous value. */
+static inline unsigned int ght_atomic_fetch_add(unsigned int *addr, int value)
+{
+  return __atomic_fetch_add(addr, (unsigned int) value, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Add @a value to the signed counter at @a addr atomically, as FAA()
+ * does for unsigned words. The entry reference counts are signed.
+ */
+static inline void ght_atomic_add_int(int *addr, int value)
+{
+  __atomic_fetch_add(addr, value, __ATOMIC_ACQ_REL);
+}
+
+/** Strip both marks from a pointer value. */
+static inline struct s_hash_entry *ght_ptr_unmark(struct s_hash_entry *p)
+{
+  return (struct s_hash_entry *) ((uintptr_t) p & ~(uintptr_t) GHT_MARK_MASK);
+}
+
+/* --- the lockless hash table primitives --- */
+
+static inline int CAS(uint64_t *addr, uint64_t old, uint64_t new_value)
+{
+  return ght_atomic_cas_u64(addr, old, new_value);
+}
+
+static inline int CAS1(struct s_hash_entry **addr, struct s_hash_entry **old, struct s_hash_entry **new_value)
+{
+  return ght_atomic_cas_word(addr, (uintptr_t) *old, (uintptr_t) *new_value);
+}
+
+/**
+ * This CAS is for when our old value is not a valid address
+ * and it have 0x0 value.
+ */
+static inline int CAS2(struct s_hash_entry **addr, struct s_hash_entry *old, struct s_hash_entry **new_value)
+{
+  return ght_atomic_cas_word(addr, (uintptr_t) old, (uintptr_t) *new_value);
+}
+
+/**
+ * Set the lowest 2 bits of the word at @a addr to zero and return true
+ * if the memory location was not changed meanwhile. In other words,
+ * this removes both the deletion and the iteration mark.
+ */
+static inline int UnMark(struct s_hash_entry **addr)
+{
+  uintptr_t old = (uintptr_t) ght_atomic_load_ptr(addr);
+
+  return ght_atomic_cas_word(addr, old, old & ~(uintptr_t) GHT_MARK_MASK);
+}
+
+/** Remove only the iteration mark. */
+static inline int UnMark_iteration(struct s_hash_entry **addr)
+{
+  uintptr_t old = (uintptr_t) ght_atomic_load_ptr(addr);
+
+  return ght_atomic_cas_word(addr, old, old & ~(uintptr_t) GHT_MARK_ITERATION);
+}
+
+/** Remove only the deletion mark. */
+static inline int Unmark_delete(struct s_hash_entry **addr)
+{
+  uintptr_t old = (uintptr_t) ght_atomic_load_ptr(addr);
+
+  return ght_atomic_cas_word(addr, old, old & ~(uintptr_t) GHT_MARK_DELETE);
+}
+#define UnMark_delete Unmark_delete
+
+/**
+ * Add @a value to the word at @a address atomically. The value can be
+ * a negative number.
+ */
+static inline void FAA(unsigned int *address, int value)
+{
+  __atomic_fetch_add(address, (unsigned int) value, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Set the deletion mark of @a addr if it had no mark before and return
+ * true. If it has been marked, don't change it and return false.
+ */
+static inline int Mark_delete(struct s_hash_entry **addr)
+{
+  uintptr_t old = (uintptr_t) ght_atomic_load_ptr(addr) & ~(uintptr_t) GHT_MARK_RESERVED;
+
+  return ght_atomic_cas_word(addr, old, old | GHT_MARK_DELETE);
+}
+
+/** Set the deletion mark even if the iteration mark is present. */
+static inline int Force_Mark_Delete(struct s_hash_entry **addr)
+{
+  uintptr_t old = (uintptr_t) ght_atomic_load_ptr(addr) & ~(uintptr_t) (GHT_MARK_RESERVED & ~GHT_MARK_ITERATION);
+
+  return ght_atomic_cas_word(addr, old, old | GHT_MARK_DELETE);
+}
+
+/** Set the iteration mark if and only if the address has no mark. */
+static inline int Mark_iteration(struct s_hash_entry **addr)
+{
+  uintptr_t old = (uintptr_t) ght_atomic_load_ptr(addr) & ~(uintptr_t) GHT_MARK_RESERVED;
+
+  return ght_atomic_cas_word(addr, old, old | GHT_MARK_ITERATION);
+}
+
+static inline int Has_Delete_Mark(struct s_hash_entry **addr)
+{
+  return ((uintptr_t) ght_atomic_load_ptr(addr) & GHT_MARK_DELETE) != 0;
+}
+
+static inline int Has_Iteration_Mark(struct s_hash_entry **addr)
+{
+  return ((uintptr_t) ght_atomic_load_ptr(addr) & GHT_MARK_ITERATION) != 0;
+}
+
+static inline int Has_Mark(struct s_hash_entry **addr)
+{
+  return ((uintptr_t) ght_atomic_load_ptr(addr) & GHT_MARK_MASK) != 0;
+}
+
+/**
+ * Drop one reference (2) from the counter at @a addr. A counter that
+ * reaches zero is parked at 1. Returns false if the counter already
+ * was 1.
+ */
+static inline int Release(uint64_t *addr)
+{
+  uint64_t old;
+  uint64_t new_value;
+
+  do {
+    old = __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+    if (old == 1)
+      return 0;
+    new_value = (old == 0 || old == 2) ? 1 : old - 2;
+  } while (!ght_atomic_cas_u64(addr, old, new_value));
+  return 1;
+}
+
+/**
+ * Add a reference (2) to the counter at @a addr unless the counter is
+ * parked at an odd value, in which case false is returned.
+ */
+static inline int safeRead(uint64_t *addr)
+{
+  uint64_t old;
+
+  do {
+    old = __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+    if (old & 1)
+      return 0;
+  } while (!ght_atomic_cas_u64(addr, old, old + 2));
+  return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GHT_ATOMIC_H */
@@ -0,0 +1,40 @@
+/*********************************************************************
+ *
+ * Filename:      ght_private.h
+ * Description:   Declarations shared by the sources of the library,
+ *                which are not part of its interface.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+#ifndef GHT_PRIVATE_H
+#define GHT_PRIVATE_H
+
+#include <stddef.h>   /* size_t */
+
+#include "ght_hash_table.h"
+
+/* backoff.c */
+extern unsigned int ght_backoff_sleepers;
+void ght_backoff_wake_channel(void *p_word);
+
+/* hash_table.c */
+int ght_insert_listed(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_size, const void *p_key_data);
+
+/* pages.c */
+void *ght_pages_alloc(size_t size, int i_flags);
+void *ght_pages_alloc_node(size_t size, int i_flags, int i_node);
+void ght_pages_free(void *p);
+void ght_pages_zero(void *p, size_t size);
+int ght_numa_nodes(void);
+int ght_numa_node(void);
+
+#endif /* GHT_PRIVATE_H */
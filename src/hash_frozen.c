@@ -0,0 +1,332 @@
+/*********************************************************************
+ *
+ * Filename:      hash_frozen.c
+ * Description:   Immutable tables in a file, which are mapped and
+ *                queried in place by any number of processes.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+#include <stdlib.h>     /* malloc */
+#include <string.h>     /* memcmp */
+#include <stdint.h>     /* uint64_t */
+#include <errno.h>      /* errno */
+#include <assert.h>     /* assert */
+#include <unistd.h>     /* write */
+#include <sys/stat.h>   /* fstat */
+#include <sys/mman.h>   /* mmap */
+
+#include "ght_hash_table.h"
+
+/*
+ * A frozen table is a header, an open addressing slot array and the
+ * records. A slot holds the hash of its key and the offset of its
+ * record from the start of the file, in units of 8 bytes, so the
+ * layout works wherever it is mapped. Empty slots have offset 0. A
+ * record is the key size, the key and the value, each part aligned to
+ * 8 bytes, and the records lie in slot order.
+ *
+ * The keys are hashed with ght_one_at_a_time_hash(), whatever hash the
+ * frozen table used, since a function pointer cannot be stored.
+ */
+#define FROZEN_MAGIC    0x46544847  /* "GHTF" on a little endian machine */
+#define FROZEN_VERSION  1
+#define FROZEN_ALIGN(size) (((size) + 7) & ~(uint64_t) 7)
+
+/* The records are written through a buffer of this size */
+#define FROZEN_BUFFER   ((size_t) 1 << 20)
+
+typedef struct
+{
+  ght_uint32_t i_magic;
+  ght_uint32_t i_version;
+  ght_uint32_t i_items;
+  ght_uint32_t i_slots;         /* A power of two */
+  uint64_t i_value_size;
+  uint64_t i_file_size;
+} frozen_header_t;
+
+typedef struct
+{
+  ght_uint32_t i_hash;
+  ght_uint32_t i_record;        /* The offset of the record / 8 */
+} frozen_slot_t;
+
+struct s_ght_frozen
+{
+  const char *p_base;
+  size_t size;
+  const frozen_header_t *p_header;
+  const frozen_slot_t *p_slots;
+  ght_uint32_t i_mask;
+};
+
+/* An entry of the table being frozen */
+typedef struct
+{
+  const void *p_key;
+  unsigned int i_key_size;
+  void *p_data;
+} frozen_entry_t;
+
+static int write_all(int fd, const void *p_buf, size_t size)
+{
+  const char *p = (const char *) p_buf;
+  ssize_t n;
+
+  while (size > 0)
+    {
+      if ((n = write(fd, p, size)) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      p += n;
+      size -= n;
+    }
+  return 0;
+}
+
+static ght_uint32_t frozen_hash(const void *p_key, unsigned int i_key_size)
+{
+  ght_hash_key_t key;
+
+  key.i_size = i_key_size;
+  key.p_key = p_key;
+  return ght_one_at_a_time_hash(&key);
+}
+
+static uint64_t record_size(unsigned int i_key_size, size_t i_value_size)
+{
+  return FROZEN_ALIGN(sizeof(ght_uint32_t) + (uint64_t) i_key_size) + FROZEN_ALIGN(i_value_size);
+}
+
+/* Write the records of the entries in p_order */
+static int write_records(int fd, frozen_entry_t *p_entries, ght_uint32_t *p_order, unsigned int i_items,
+                         size_t i_value_size, ght_fn_save_t fn_save, void *p_ctx)
+{
+  frozen_entry_t *p_e;
+  ght_uint32_t i_key_size;
+  char *p_buf;
+  char *p_new;
+  size_t i_cap = FROZEN_BUFFER;
+  size_t i_used = 0;
+  uint64_t size;
+  unsigned int i;
+
+  if (!(p_buf = (char *) malloc(i_cap)))
+    return -1;
+
+  for (i = 0; i < i_items; i++)
+    {
+      p_e = &p_entries[p_order[i]];
+      size = record_size(p_e->i_key_size, i_value_size);
+      if (i_used + size > i_cap)
+        {
+          if (write_all(fd, p_buf, i_used) < 0)
+            goto fail;
+          i_used = 0;
+        }
+      /* A record larger than the buffer is written on its own */
+      if (size > i_cap)
+        {
+          if (!(p_new = (char *) realloc(p_buf, size)))
+            goto fail;
+          p_buf = p_new;
+          i_cap = size;
+        }
+
+      memset(p_buf + i_used, 0, size);
+      i_key_size = p_e->i_key_size;
+      memcpy(p_buf + i_used, &i_key_size, sizeof(i_key_size));
+      memcpy(p_buf + i_used + sizeof(i_key_size), p_e->p_key, i_key_size);
+      if (fn_save(p_e->p_data, p_buf + i_used + FROZEN_ALIGN(sizeof(i_key_size) + i_key_size),
+                  i_value_size, p_ctx) > i_value_size)
+        goto fail;
+      i_used += size;
+    }
+  if (write_all(fd, p_buf, i_used) < 0)
+    goto fail;
+  free(p_buf);
+  return 0;
+
+ fail:
+  free(p_buf);
+  return -1;
+}
+
+int ght_freeze(ght_hash_table_t *p_ht, int fd, size_t i_value_size, ght_fn_save_t fn_save, void *p_ctx)
+{
+  lockless_ght_snapshot_t snapshot;
+  frozen_header_t header;
+  frozen_entry_t *p_entries = NULL;
+  frozen_entry_t *p_new;
+  frozen_slot_t *p_slots = NULL;
+  ght_uint32_t *p_order = NULL;
+  const void *p_key;
+  unsigned int i_key_size;
+  void *p_data;
+  unsigned int i_items = 0;
+  unsigned int i_cap = 0;
+  unsigned int n = 0;
+  ght_uint32_t i_slots = 1;
+  ght_uint32_t i_hash;
+  ght_uint32_t i;
+  ght_uint32_t j;
+  uint64_t offset;
+  int i_ret = -1;
+
+  assert(p_ht && fn_save);
+
+  /* The snapshot keeps the keys and data valid until the file is written */
+  lockless_ght_snapshot_open(p_ht, &snapshot);
+  while ((p_data = lockless_ght_snapshot_next(p_ht, &snapshot, &p_key, &i_key_size)) || p_key)
+    {
+      if (i_items == i_cap)
+        {
+          i_cap = i_cap ? 2 * i_cap : 1024;
+          if (!(p_new = (frozen_entry_t *) realloc(p_entries, i_cap * sizeof(frozen_entry_t))))
+            goto out;
+          p_entries = p_new;
+        }
+      p_entries[i_items].p_key = p_key;
+      p_entries[i_items].i_key_size = i_key_size;
+      p_entries[i_items].p_data = p_data;
+      i_items++;
+    }
+
+  /* At most half of the slots are used, so probes stay short */
+  while (i_slots < 2 * (uint64_t) i_items)
+    {
+      if (i_slots > UINT32_MAX / 2)
+        goto out;
+      i_slots *= 2;
+    }
+  if (!(p_slots = (frozen_slot_t *) calloc(i_slots, sizeof(frozen_slot_t))) ||
+      !(p_order = (ght_uint32_t *) malloc((i_items + 1) * sizeof(ght_uint32_t))))
+    goto out;
+  for (i = 0; i < i_items; i++)
+    {
+      i_hash = frozen_hash(p_entries[i].p_key, p_entries[i].i_key_size);
+      for (j = i_hash & (i_slots - 1); p_slots[j].i_record != 0; j = (j + 1) & (i_slots - 1))
+        ;
+      p_slots[j].i_hash = i_hash;
+      p_slots[j].i_record = i + 1;
+    }
+
+  /* Lay the records out in slot order, the slots get their offsets */
+  offset = sizeof(frozen_header_t) + (uint64_t) i_slots * sizeof(frozen_slot_t);
+  for (i = 0; i < i_slots; i++)
+    {
+      if (p_slots[i].i_record == 0)
+        continue;
+      if (offset / 8 > UINT32_MAX)
+        goto out;
+      p_order[n] = p_slots[i].i_record - 1;
+      p_slots[i].i_record = offset / 8;
+      offset += record_size(p_entries[p_order[n++]].i_key_size, i_value_size);
+    }
+
+  header.i_magic = FROZEN_MAGIC;
+  header.i_version = FROZEN_VERSION;
+  header.i_items = i_items;
+  header.i_slots = i_slots;
+  header.i_value_size = i_value_size;
+  header.i_file_size = offset;
+  if (write_all(fd, &header, sizeof(header)) == 0 &&
+      write_all(fd, p_slots, (size_t) i_slots * sizeof(frozen_slot_t)) == 0 &&
+      write_records(fd, p_entries, p_order, i_items, i_value_size, fn_save, p_ctx) == 0)
+    i_ret = i_items;
+
+ out:
+  lockless_ght_snapshot_close(p_ht, &snapshot);
+  free(p_order);
+  free(p_slots);
+  free(p_entries);
+  return i_ret;
+}
+
+ght_frozen_t *ght_frozen_open(int fd)
+{
+  ght_frozen_t *p_fz;
+  const frozen_header_t *p_header;
+  struct stat st;
+  void *p;
+
+  if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(frozen_header_t))
+    return NULL;
+  if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    return NULL;
+
+  /* Only the sizes are checked, the records are trusted */
+  p_header = (const frozen_header_t *) p;
+  if (p_header->i_magic != FROZEN_MAGIC || p_header->i_version != FROZEN_VERSION ||
+      p_header->i_file_size != (uint64_t) st.st_size || p_header->i_slots == 0 ||
+      (p_header->i_slots & (p_header->i_slots - 1)) != 0 ||
+      sizeof(frozen_header_t) + (uint64_t) p_header->i_slots * sizeof(frozen_slot_t) > (uint64_t) st.st_size ||
+      !(p_fz = (ght_frozen_t *) malloc(sizeof(ght_frozen_t))))
+    {
+      munmap(p, st.st_size);
+      return NULL;
+    }
+
+  p_fz->p_base = (const char *) p;
+  p_fz->size = st.st_size;
+  p_fz->p_header = p_header;
+  p_fz->p_slots = (const frozen_slot_t *) (p_header + 1);
+  p_fz->i_mask = p_header->i_slots - 1;
+  return p_fz;
+}
+
+const void *ght_frozen_get(const ght_frozen_t *p_fz, unsigned int i_key_size, const void *p_key_data)
+{
+  const frozen_slot_t *p_slot;
+  const char *p_record;
+  ght_uint32_t i_hash;
+  ght_uint32_t i_size;
+  ght_uint32_t i;
+
+  assert(p_fz && p_key_data);
+
+  i_hash = frozen_hash(p_key_data, i_key_size);
+  for (i = i_hash & p_fz->i_mask;; i = (i + 1) & p_fz->i_mask)
+    {
+      p_slot = &p_fz->p_slots[i];
+      if (p_slot->i_record == 0)
+        return NULL;
+      if (p_slot->i_hash != i_hash)
+        continue;
+
+      p_record = p_fz->p_base + (size_t) p_slot->i_record * 8;
+      memcpy(&i_size, p_record, sizeof(i_size));
+      if (i_size == i_key_size && memcmp(p_record + sizeof(i_size), p_key_data, i_key_size) == 0)
+        return p_record + FROZEN_ALIGN(sizeof(i_size) + i_key_size);
+    }
+}
+
+unsigned int ght_frozen_size(const ght_frozen_t *p_fz)
+{
+  return p_fz->p_header->i_items;
+}
+
+size_t ght_frozen_value_size(const ght_frozen_t *p_fz)
+{
+  return p_fz->p_header->i_value_size;
+}
+
+void ght_frozen_close(ght_frozen_t *p_fz)
+{
+  if (!p_fz)
+    return;
+  munmap((void *) p_fz->p_base, p_fz->size);
+  free(p_fz);
+}
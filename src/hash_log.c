@@ -0,0 +1,764 @@
+/*********************************************************************
+ *
+ * Filename:      hash_log.c
+ * Description:   A write-ahead log of the changes to a table, with
+ *                per-thread buffers and group commit, so a durable
+ *                table survives crashes.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+#include <stdlib.h>     /* malloc */
+#include <string.h>     /* memcpy */
+#include <stdint.h>     /* uint64_t */
+#include <errno.h>      /* errno */
+#include <assert.h>     /* assert */
+#include <unistd.h>     /* write, fdatasync */
+#include <pthread.h>
+
+#include "ght_hash_table.h"
+#include "ght_private.h"
+
+/*
+ * A log is a header and a sequence of blocks. Each block is what one
+ * group commit wrote: a block header with a checksum, then records
+ * which are each 8 byte aligned. A crash can leave a torn block at the
+ * end, which replay detects by its size or checksum and drops.
+ *
+ * A writer holds the stripe lock of its key while it changes the table
+ * and takes a sequence number, so the numbers of the changes to one key
+ * are in the order the changes were made. The records of a key can
+ * still land in consecutive blocks out of order, since the threads
+ * append to their own buffers, so replay keeps the change with the
+ * highest number for each key.
+ */
+#define LOG_MAGIC       0x4c544847  /* "GHTL" on a little endian machine */
+#define LOG_VERSION     1
+#define LOG_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+#define LOG_INSERT      1
+#define LOG_REMOVE      2
+
+#define LOG_STRIPES     256         /* A power of two */
+#define LOG_BUFFERS     64
+#define LOG_BLOCK       ((size_t) 1 << 20)
+
+typedef struct
+{
+  ght_uint32_t i_magic;
+  ght_uint32_t i_version;
+  uint64_t i_seq;               /* The number of the records which compaction wrote */
+} log_header_t;
+
+typedef struct
+{
+  ght_uint32_t i_bytes;         /* The size of the records */
+  ght_uint32_t i_records;
+  uint64_t i_check;
+} log_block_t;
+
+typedef struct
+{
+  uint64_t i_seq;
+  ght_uint32_t i_op;
+  ght_uint32_t i_key_size;
+  ght_uint32_t i_data_size;
+  ght_uint32_t i_reserved;
+} log_record_t;
+
+/* Records gathered for a block. p_buf starts with room for the block
+ * header, so a block is written with one call. */
+typedef struct
+{
+  pthread_mutex_t lock;
+  char *p_buf;
+  size_t i_cap;
+  size_t i_used;
+  unsigned int i_records;
+} __attribute__((aligned(64))) log_buffer_t;
+
+struct s_ght_log
+{
+  ght_hash_table_t *p_ht;
+  int fd;
+  unsigned int i_latency_us;
+  ght_fn_save_t fn_save;
+  void *p_ctx;
+  uint64_t i_seq;               /* The last sequence number given out */
+  uint64_t i_open;              /* The batch the buffers are filling */
+
+  pthread_mutex_t lock;         /* Protects the fields below */
+  pthread_cond_t work;
+  pthread_cond_t done;
+  uint64_t i_requested;         /* The last batch a writer waits for */
+  uint64_t i_durable;           /* The last batch which is on disk */
+  uint64_t i_failed;            /* The first batch which could not be written */
+  int b_stop;
+
+  pthread_mutex_t io;           /* Serializes the writes to fd */
+  pthread_t flusher;
+  log_buffer_t batch;           /* Only used by the flusher */
+  pthread_mutex_t stripes[LOG_STRIPES];
+  log_buffer_t buffers[LOG_BUFFERS];
+};
+
+/* The latest change to a key during replay */
+typedef struct
+{
+  uint64_t i_seq;
+  ght_uint32_t i_op;
+  void *p_data;
+} log_latest_t;
+
+static __thread int log_thread = -1;
+static unsigned int log_threads = 0;
+
+static int write_all(int fd, const void *p_buf, size_t size)
+{
+  const char *p = (const char *) p_buf;
+  ssize_t n;
+
+  while (size > 0)
+    {
+      if ((n = write(fd, p, size)) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      p += n;
+      size -= n;
+    }
+  return 0;
+}
+
+/* Returns the number of bytes read, which is only less than size at
+ * the end of the file, or -1 */
+static ssize_t read_all(int fd, void *p_buf, size_t size)
+{
+  char *p = (char *) p_buf;
+  size_t i_read = 0;
+  ssize_t n;
+
+  while (i_read < size)
+    {
+      if ((n = read(fd, p + i_read, size - i_read)) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      if (n == 0)
+        break;
+      i_read += n;
+    }
+  return i_read;
+}
+
+/* A checksum of the records of a block, 8 bytes at a time */
+static uint64_t log_check(const char *p_buf, ght_uint32_t i_bytes, ght_uint32_t i_records)
+{
+  uint64_t h = ((uint64_t) i_records << 32 | i_bytes) ^ 0x9e3779b97f4a7c15ULL;
+  uint64_t w;
+  size_t i;
+
+  for (i = 0; i < i_bytes; i += 8)
+    {
+      memcpy(&w, p_buf + i, sizeof(w));
+      h = (h ^ w) * 0x100000001b3ULL;
+      h ^= h >> 29;
+    }
+  return h;
+}
+
+static ght_uint32_t key_stripe(ght_log_t *p_log, unsigned int i_key_size, const void *p_key_data)
+{
+  ght_hash_key_t key;
+
+  key.i_size = i_key_size;
+  key.p_key = p_key_data;
+  return p_log->p_ht->fn_hash(&key) & (LOG_STRIPES - 1);
+}
+
+/* Add a record to p_b. The data of an insert is serialized by fn_save,
+ * a removal has none. */
+static int buffer_add(log_buffer_t *p_b, uint64_t i_seq, ght_uint32_t i_op, const void *p_key,
+                      unsigned int i_key_size, void *p_data, ght_fn_save_t fn_save, void *p_ctx)
+{
+  log_record_t record;
+  size_t i_need = sizeof(log_record_t) + LOG_ALIGN(i_key_size);
+  size_t i_data_size = 0;
+  size_t i_cap;
+  char *p_rec;
+  char *p_new;
+
+  for (;;)
+    {
+      if (p_b->p_buf && i_need <= p_b->i_cap - p_b->i_used)
+        {
+          p_rec = p_b->p_buf + sizeof(log_block_t) + p_b->i_used;
+          if (i_op == LOG_REMOVE)
+            break;
+          i_data_size = fn_save(p_data, p_rec + i_need, p_b->i_cap - p_b->i_used - i_need, p_ctx);
+          if (LOG_ALIGN(i_data_size) <= p_b->i_cap - p_b->i_used - i_need)
+            break;
+        }
+      i_cap = p_b->i_cap ? 2 * p_b->i_cap : 64 * 1024;
+      if (i_cap < p_b->i_used + i_need + LOG_ALIGN(i_data_size))
+        i_cap = p_b->i_used + i_need + LOG_ALIGN(i_data_size);
+      if (i_cap > UINT32_MAX ||
+          !(p_new = (char *) realloc(p_b->p_buf, sizeof(log_block_t) + i_cap)))
+        return -1;
+      p_b->p_buf = p_new;
+      p_b->i_cap = i_cap;
+    }
+
+  record.i_seq = i_seq;
+  record.i_op = i_op;
+  record.i_key_size = i_key_size;
+  record.i_data_size = i_data_size;
+  record.i_reserved = 0;
+  memcpy(p_rec, &record, sizeof(record));
+  memcpy(p_rec + sizeof(record), p_key, i_key_size);
+  memset(p_rec + sizeof(record) + i_key_size, 0, LOG_ALIGN(i_key_size) - i_key_size);
+  memset(p_rec + i_need + i_data_size, 0, LOG_ALIGN(i_data_size) - i_data_size);
+  p_b->i_used += i_need + LOG_ALIGN(i_data_size);
+  p_b->i_records++;
+  return 0;
+}
+
+/* Write the records of p_b as one block to the log */
+static int buffer_write(ght_log_t *p_log, log_buffer_t *p_b)
+{
+  log_block_t block;
+  int i_ret;
+
+  block.i_bytes = p_b->i_used;
+  block.i_records = p_b->i_records;
+  block.i_check = log_check(p_b->p_buf + sizeof(log_block_t), block.i_bytes, block.i_records);
+  memcpy(p_b->p_buf, &block, sizeof(block));
+  p_b->i_used = 0;
+  p_b->i_records = 0;
+
+  pthread_mutex_lock(&p_log->io);
+  i_ret = write_all(p_log->fd, p_b->p_buf, sizeof(block) + block.i_bytes);
+  pthread_mutex_unlock(&p_log->io);
+  return i_ret;
+}
+
+/* Gather the buffers of all threads into one block, write it and wait
+ * until it is on disk */
+static int log_commit(ght_log_t *p_log)
+{
+  log_buffer_t *p_batch = &p_log->batch;
+  log_buffer_t *p_b;
+  size_t i_cap;
+  char *p_new;
+  int i_ret = 0;
+  int i;
+
+  for (i = 0; i < LOG_BUFFERS; i++)
+    {
+      p_b = &p_log->buffers[i];
+      pthread_mutex_lock(&p_b->lock);
+      if (p_b->i_records > 0)
+        {
+          if (p_batch->i_used + p_b->i_used > p_batch->i_cap)
+            {
+              i_cap = p_batch->i_cap ? p_batch->i_cap : 64 * 1024;
+              while (i_cap < p_batch->i_used + p_b->i_used)
+                i_cap *= 2;
+              if (i_cap > UINT32_MAX ||
+                  !(p_new = (char *) realloc(p_batch->p_buf, sizeof(log_block_t) + i_cap)))
+                {
+                  /* The records are lost, so the batch fails */
+                  i_ret = -1;
+                  p_b->i_used = 0;
+                  p_b->i_records = 0;
+                  pthread_mutex_unlock(&p_b->lock);
+                  continue;
+                }
+              p_batch->p_buf = p_new;
+              p_batch->i_cap = i_cap;
+            }
+          memcpy(p_batch->p_buf + sizeof(log_block_t) + p_batch->i_used,
+                 p_b->p_buf + sizeof(log_block_t), p_b->i_used);
+          p_batch->i_used += p_b->i_used;
+          p_batch->i_records += p_b->i_records;
+          p_b->i_used = 0;
+          p_b->i_records = 0;
+        }
+      pthread_mutex_unlock(&p_b->lock);
+    }
+
+  if (i_ret < 0 || p_batch->i_records == 0)
+    {
+      p_batch->i_used = 0;
+      p_batch->i_records = 0;
+      return i_ret;
+    }
+  if (buffer_write(p_log, p_batch) < 0)
+    return -1;
+  return fdatasync(p_log->fd);
+}
+
+static void *log_flusher(void *p_arg)
+{
+  ght_log_t *p_log = (ght_log_t *) p_arg;
+  uint64_t i_batch;
+  int i_ret;
+
+  pthread_mutex_lock(&p_log->lock);
+  for (;;)
+    {
+      while (p_log->i_requested <= p_log->i_durable && !p_log->b_stop)
+        pthread_cond_wait(&p_log->work, &p_log->lock);
+      if (p_log->i_requested <= p_log->i_durable)
+        break;
+      pthread_mutex_unlock(&p_log->lock);
+
+      /* Let more changes join the batch. Without a latency bound the
+       * batch is what came in during the last commit. */
+      if (p_log->i_latency_us > 0)
+        usleep(p_log->i_latency_us);
+      i_batch = __atomic_fetch_add(&p_log->i_open, 1, __ATOMIC_SEQ_CST);
+      i_ret = log_commit(p_log);
+
+      pthread_mutex_lock(&p_log->lock);
+      if (i_ret < 0 && p_log->i_failed > i_batch)
+        __atomic_store_n(&p_log->i_failed, i_batch, __ATOMIC_SEQ_CST);
+      p_log->i_durable = i_batch;
+      pthread_cond_broadcast(&p_log->done);
+    }
+  pthread_mutex_unlock(&p_log->lock);
+  return NULL;
+}
+
+/* Wait until batch i_batch is on disk. A batch after a failed one is
+ * not readable from the log, so it has failed too. */
+static int log_wait(ght_log_t *p_log, uint64_t i_batch)
+{
+  int i_ret;
+
+  pthread_mutex_lock(&p_log->lock);
+  if (p_log->i_requested < i_batch)
+    {
+      p_log->i_requested = i_batch;
+      pthread_cond_signal(&p_log->work);
+    }
+  while (p_log->i_durable < i_batch)
+    pthread_cond_wait(&p_log->done, &p_log->lock);
+  i_ret = i_batch >= p_log->i_failed ? -1 : 0;
+  pthread_mutex_unlock(&p_log->lock);
+  return i_ret;
+}
+
+/* Append a record to the buffer of the calling thread. Returns the
+ * batch the record is in, or 0 if memory ran out. The caller holds the
+ * stripe lock of the key. */
+static uint64_t log_append(ght_log_t *p_log, ght_uint32_t i_op, const void *p_key, unsigned int i_key_size, void *p_data)
+{
+  log_buffer_t *p_b;
+  uint64_t i_batch = 0;
+
+  if (log_thread < 0)
+    log_thread = __atomic_fetch_add(&log_threads, 1, __ATOMIC_RELAXED);
+  p_b = &p_log->buffers[log_thread % LOG_BUFFERS];
+
+  pthread_mutex_lock(&p_b->lock);
+  /* The flusher moves to the next batch before it gathers the buffers,
+   * so a record is never in a batch before the one read here */
+  if (buffer_add(p_b, __atomic_add_fetch(&p_log->i_seq, 1, __ATOMIC_RELAXED), i_op, p_key, i_key_size,
+                 p_data, p_log->fn_save, p_log->p_ctx) == 0)
+    i_batch = __atomic_load_n(&p_log->i_open, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&p_b->lock);
+  return i_batch;
+}
+
+/* Free what the map of a replay holds, applying the latest changes to
+ * p_ht first if b_apply is set */
+static int replay_finish(ght_hash_table_t *p_ht, ght_hash_table_t *p_map, int b_apply,
+                         ght_fn_bucket_free_callback_t fn_free)
+{
+  ght_iterator_t iterator;
+  log_latest_t *p_l;
+  const void *p_key;
+  unsigned int i_key_size;
+  void *p_old;
+  int i_ret = 0;
+
+  for (p_l = (log_latest_t *) ght_first_keysize(p_map, &iterator, &p_key, &i_key_size); p_l;
+       p_l = (log_latest_t *) ght_next_keysize(p_map, &iterator, &p_key, &i_key_size))
+    {
+      if (b_apply)
+        {
+          if ((p_old = lockless_ght_remove(p_ht, i_key_size, p_key)) && fn_free)
+            fn_free(p_old, p_key);
+          if (p_l->i_op == LOG_INSERT && ght_insert_listed(p_ht, p_l->p_data, i_key_size, p_key) == 0)
+            p_l->p_data = NULL;
+        }
+      if (p_l->p_data)
+        {
+          i_ret = -1;
+          if (fn_free)
+            fn_free(p_l->p_data, p_key);
+        }
+      free(p_l);
+    }
+  ght_finalize(p_map);
+  return i_ret;
+}
+
+/* Apply the records of one block to the map of the replay */
+static int replay_block(ght_hash_table_t *p_map, const char *p_buf, const log_block_t *p_block, uint64_t *p_seq,
+                        ght_fn_load_t fn_load, ght_fn_bucket_free_callback_t fn_free, void *p_ctx)
+{
+  log_record_t record;
+  log_latest_t *p_l;
+  const char *p_key;
+  size_t i_pos = 0;
+  size_t i_need;
+  void *p_data;
+  unsigned int i;
+
+  for (i = 0; i < p_block->i_records; i++)
+    {
+      if (p_block->i_bytes - i_pos < sizeof(record))
+        return -1;
+      memcpy(&record, p_buf + i_pos, sizeof(record));
+      i_need = sizeof(record) + LOG_ALIGN((size_t) record.i_key_size) + LOG_ALIGN((size_t) record.i_data_size);
+      if (i_need > p_block->i_bytes - i_pos || (record.i_op != LOG_INSERT && record.i_op != LOG_REMOVE))
+        return -1;
+      p_key = p_buf + i_pos + sizeof(record);
+      i_pos += i_need;
+      if (record.i_seq > *p_seq)
+        *p_seq = record.i_seq;
+
+      p_l = (log_latest_t *) ght_get(p_map, record.i_key_size, p_key);
+      if (p_l && p_l->i_seq > record.i_seq)
+        continue;
+      p_data = NULL;
+      if (record.i_op == LOG_INSERT &&
+          !(p_data = fn_load(p_key + LOG_ALIGN((size_t) record.i_key_size), record.i_data_size, p_ctx)))
+        return -1;
+
+      if (!p_l)
+        {
+          if (!(p_l = (log_latest_t *) malloc(sizeof(log_latest_t))) ||
+              ght_insert(p_map, p_l, record.i_key_size, p_key) < 0)
+            {
+              free(p_l);
+              if (p_data && fn_free)
+                fn_free(p_data, p_key);
+              return -1;
+            }
+        }
+      else if (p_l->p_data && fn_free)
+        fn_free(p_l->p_data, p_key);
+      p_l->i_seq = record.i_seq;
+      p_l->i_op = record.i_op;
+      p_l->p_data = p_data;
+    }
+  return 0;
+}
+
+/* Replay the log in fd from its current offset. The offset is left
+ * after the last whole block, and p_seq gets the highest sequence
+ * number in the log. Returns the number of records, or -1. An empty
+ * file has no header and gives 0 with the offset unchanged, as does a
+ * header which a crash cut short before anything followed it. */
+static int log_replay(ght_hash_table_t *p_ht, int fd, uint64_t *p_seq, ght_fn_load_t fn_load,
+                      ght_fn_bucket_free_callback_t fn_free, void *p_ctx)
+{
+  ght_hash_table_t *p_map;
+  log_header_t header;
+  log_block_t block;
+  char *p_buf = NULL;
+  char *p_new;
+  size_t i_cap = 0;
+  off_t i_end;
+  ssize_t n;
+  int i_records = 0;
+
+  *p_seq = 0;
+  if ((i_end = lseek(fd, 0, SEEK_CUR)) < 0 || (n = read_all(fd, &header, sizeof(header))) < 0)
+    return -1;
+  if (n < (ssize_t) sizeof(header))
+    return lseek(fd, i_end, SEEK_SET) < 0 ? -1 : 0;
+  if (header.i_magic != LOG_MAGIC || header.i_version != LOG_VERSION)
+    return -1;
+  *p_seq = header.i_seq;
+  i_end += sizeof(header);
+
+  if (!(p_map = ght_create(1024)))
+    return -1;
+  ght_set_rehash(p_map, TRUE);
+
+  /* A block which is cut short or fails its checksum is where a crash
+   * interrupted a commit, and ends the log */
+  for (;;)
+    {
+      if (read_all(fd, &block, sizeof(block)) != sizeof(block) || block.i_bytes % 8 != 0)
+        break;
+      if (block.i_bytes > i_cap)
+        {
+          if (!(p_new = (char *) realloc(p_buf, block.i_bytes)))
+            goto fail;
+          p_buf = p_new;
+          i_cap = block.i_bytes;
+        }
+      if (read_all(fd, p_buf, block.i_bytes) != (ssize_t) block.i_bytes ||
+          log_check(p_buf, block.i_bytes, block.i_records) != block.i_check)
+        break;
+      if (replay_block(p_map, p_buf, &block, p_seq, fn_load, fn_free, p_ctx) < 0)
+        goto fail;
+      i_end += sizeof(block) + block.i_bytes;
+      i_records += block.i_records;
+    }
+  free(p_buf);
+
+  if (lseek(fd, i_end, SEEK_SET) < 0)
+    {
+      replay_finish(p_ht, p_map, FALSE, fn_free);
+      return -1;
+    }
+  return replay_finish(p_ht, p_map, TRUE, fn_free) < 0 ? -1 : i_records;
+
+ fail:
+  free(p_buf);
+  replay_finish(p_ht, p_map, FALSE, fn_free);
+  return -1;
+}
+
+int ght_log_replay(ght_hash_table_t *p_ht, int fd, ght_fn_load_t fn_load, ght_fn_bucket_free_callback_t fn_free,
+                   void *p_ctx)
+{
+  uint64_t i_seq;
+
+  assert(p_ht && fn_load);
+
+  return log_replay(p_ht, fd, &i_seq, fn_load, fn_free, p_ctx);
+}
+
+/* Start a new log in fd, whose records after the header are numbered
+ * above i_seq */
+static int write_header(int fd, uint64_t i_seq)
+{
+  log_header_t header;
+
+  header.i_magic = LOG_MAGIC;
+  header.i_version = LOG_VERSION;
+  header.i_seq = i_seq;
+  return write_all(fd, &header, sizeof(header));
+}
+
+/* Free a log whose flusher has stopped, or never started */
+static void log_free(ght_log_t *p_log)
+{
+  int i;
+
+  for (i = 0; i < LOG_BUFFERS; i++)
+    {
+      pthread_mutex_destroy(&p_log->buffers[i].lock);
+      free(p_log->buffers[i].p_buf);
+    }
+  for (i = 0; i < LOG_STRIPES; i++)
+    pthread_mutex_destroy(&p_log->stripes[i]);
+  free(p_log->batch.p_buf);
+  pthread_mutex_destroy(&p_log->io);
+  pthread_cond_destroy(&p_log->done);
+  pthread_cond_destroy(&p_log->work);
+  pthread_mutex_destroy(&p_log->lock);
+  free(p_log);
+}
+
+ght_log_t *ght_log_open(ght_hash_table_t *p_ht, int fd, unsigned int i_latency_us, ght_fn_save_t fn_save,
+                        ght_fn_load_t fn_load, ght_fn_bucket_free_callback_t fn_free, void *p_ctx)
+{
+  ght_log_t *p_log;
+  uint64_t i_seq;
+  off_t i_start;
+  off_t i_end;
+  int i;
+
+  assert(p_ht && fn_save && fn_load);
+
+  if ((i_start = lseek(fd, 0, SEEK_CUR)) < 0 ||
+      log_replay(p_ht, fd, &i_seq, fn_load, fn_free, p_ctx) < 0 ||
+      (i_end = lseek(fd, 0, SEEK_CUR)) < 0)
+    return NULL;
+  /* Cut a torn block or header off, and start the log in an empty file */
+  if (ftruncate(fd, i_end) < 0 || (i_end == i_start && write_header(fd, 0) < 0) || fdatasync(fd) < 0)
+    return NULL;
+
+  if (!(p_log = (ght_log_t *) calloc(1, sizeof(ght_log_t))))
+    return NULL;
+  p_log->p_ht = p_ht;
+  p_log->fd = fd;
+  p_log->i_latency_us = i_latency_us;
+  p_log->fn_save = fn_save;
+  p_log->p_ctx = p_ctx;
+  p_log->i_seq = i_seq;
+  p_log->i_open = 1;
+  p_log->i_failed = UINT64_MAX;
+  pthread_mutex_init(&p_log->lock, NULL);
+  pthread_cond_init(&p_log->work, NULL);
+  pthread_cond_init(&p_log->done, NULL);
+  pthread_mutex_init(&p_log->io, NULL);
+  for (i = 0; i < LOG_STRIPES; i++)
+    pthread_mutex_init(&p_log->stripes[i], NULL);
+  for (i = 0; i < LOG_BUFFERS; i++)
+    pthread_mutex_init(&p_log->buffers[i].lock, NULL);
+
+  if (pthread_create(&p_log->flusher, NULL, log_flusher, p_log) != 0)
+    {
+      log_free(p_log);
+      return NULL;
+    }
+  return p_log;
+}
+
+int ght_log_insert(ght_log_t *p_log, void *p_entry_data, unsigned int i_key_size, const void *p_key_data)
+{
+  pthread_mutex_t *p_stripe;
+  uint64_t i_batch;
+
+  assert(p_log);
+
+  if (__atomic_load_n(&p_log->i_failed, __ATOMIC_SEQ_CST) != UINT64_MAX)
+    return -1;
+
+  p_stripe = &p_log->stripes[key_stripe(p_log, i_key_size, p_key_data)];
+  pthread_mutex_lock(p_stripe);
+  if (ght_insert_listed(p_log->p_ht, p_entry_data, i_key_size, p_key_data) < 0)
+    {
+      pthread_mutex_unlock(p_stripe);
+      return -1;
+    }
+  if (!(i_batch = log_append(p_log, LOG_INSERT, p_key_data, i_key_size, p_entry_data)))
+    {
+      lockless_ght_remove(p_log->p_ht, i_key_size, p_key_data);
+      pthread_mutex_unlock(p_stripe);
+      return -1;
+    }
+  pthread_mutex_unlock(p_stripe);
+
+  return log_wait(p_log, i_batch) < 0 ? -2 : 0;
+}
+
+int ght_log_remove(ght_log_t *p_log, unsigned int i_key_size, const void *p_key_data, void **pp_data)
+{
+  pthread_mutex_t *p_stripe;
+  uint64_t i_batch;
+  void *p_data;
+
+  assert(p_log && pp_data);
+
+  *pp_data = NULL;
+  if (__atomic_load_n(&p_log->i_failed, __ATOMIC_SEQ_CST) != UINT64_MAX)
+    return -1;
+
+  p_stripe = &p_log->stripes[key_stripe(p_log, i_key_size, p_key_data)];
+  pthread_mutex_lock(p_stripe);
+  if (!(p_data = lockless_ght_remove(p_log->p_ht, i_key_size, p_key_data)))
+    {
+      pthread_mutex_unlock(p_stripe);
+      return -1;
+    }
+  if (!(i_batch = log_append(p_log, LOG_REMOVE, p_key_data, i_key_size, NULL)))
+    {
+      /* Put the entry back, nobody else can have inserted the key */
+      ght_insert_listed(p_log->p_ht, p_data, i_key_size, p_key_data);
+      pthread_mutex_unlock(p_stripe);
+      return -1;
+    }
+  pthread_mutex_unlock(p_stripe);
+
+  *pp_data = p_data;
+  return log_wait(p_log, i_batch) < 0 ? -2 : 0;
+}
+
+int ght_log_compact(ght_log_t *p_log, int fd)
+{
+  lockless_ght_snapshot_t snapshot;
+  log_buffer_t buffer;
+  const void *p_key;
+  unsigned int i_key_size;
+  void *p_data;
+  uint64_t i_seq;
+  int i_entries = 0;
+  int i_ret = 0;
+  int i;
+
+  assert(p_log);
+
+  /* With every stripe held no change is in flight. Once the records so
+   * far are in the old log, the new one starts from a snapshot of this
+   * state and gets the changes which follow. */
+  for (i = 0; i < LOG_STRIPES; i++)
+    pthread_mutex_lock(&p_log->stripes[i]);
+  if (log_wait(p_log, __atomic_load_n(&p_log->i_open, __ATOMIC_SEQ_CST)) < 0)
+    i_ret = -1;
+  i_seq = __atomic_load_n(&p_log->i_seq, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&p_log->io);
+  if (i_ret == 0 && write_header(fd, i_seq) == 0)
+    p_log->fd = fd;
+  else
+    i_ret = -1;
+  pthread_mutex_unlock(&p_log->io);
+  if (i_ret == 0)
+    lockless_ght_snapshot_open(p_log->p_ht, &snapshot);
+  for (i = 0; i < LOG_STRIPES; i++)
+    pthread_mutex_unlock(&p_log->stripes[i]);
+  if (i_ret < 0)
+    return -1;
+
+  /* The live entries are numbered i_seq, below every change made
+   * since, and are written in blocks between the commits */
+  memset(&buffer, 0, sizeof(buffer));
+  while ((p_data = lockless_ght_snapshot_next(p_log->p_ht, &snapshot, &p_key, &i_key_size)) || p_key)
+    {
+      if (buffer_add(&buffer, i_seq, LOG_INSERT, p_key, i_key_size, p_data, p_log->fn_save, p_log->p_ctx) < 0 ||
+          (buffer.i_used >= LOG_BLOCK && buffer_write(p_log, &buffer) < 0))
+        {
+          i_ret = -1;
+          break;
+        }
+      i_entries++;
+    }
+  lockless_ght_snapshot_close(p_log->p_ht, &snapshot);
+  if (i_ret == 0 && buffer.i_records > 0 && buffer_write(p_log, &buffer) < 0)
+    i_ret = -1;
+  free(buffer.p_buf);
+
+  if (i_ret < 0 || fdatasync(fd) < 0)
+    {
+      /* The new log is missing entries, so nothing more is durable */
+      pthread_mutex_lock(&p_log->lock);
+      __atomic_store_n(&p_log->i_failed, __atomic_load_n(&p_log->i_open, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&p_log->lock);
+      return -1;
+    }
+  return i_entries;
+}
+
+void ght_log_close(ght_log_t *p_log)
+{
+  if (!p_log)
+    return;
+
+  pthread_mutex_lock(&p_log->lock);
+  p_log->b_stop = TRUE;
+  pthread_cond_signal(&p_log->work);
+  pthread_mutex_unlock(&p_log->lock);
+  pthread_join(p_log->flusher, NULL);
+  log_free(p_log);
+}
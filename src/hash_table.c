@@ -30,10 +30,15 @@
 #include <string.h> /* memcmp */
 #include <assert.h> /* assert */
 #include <time.h>   /* sleep  */
+#include <unistd.h> /* usleep */
 #include <stdint.h>
 #include <limits.h>
+#include <math.h>   /* log */
+#include <pthread.h>
 
 #include "ght_hash_table.h"
+#include "memory_mng.h"
+#include "ght_private.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -44,24 +49,100 @@
 #define FLAGS_NORMAL   0 /* Normal item. All user-inserted stuff is normal */
 #define FLAGS_INTERNAL 1 /* The item is internal to the hash table */
 
+/* The death stamp of an entry which has not been removed, and the
+ * stamps of an entry which is being inserted or removed right now */
+#define EPOCH_LIVE     UINT_MAX
+#define EPOCH_PENDING  (UINT_MAX - 1)
+/* The stamp of an entry which ght_compact() is copying elsewhere. It
+ * is found by lookups like a live entry but cannot be removed. */
+#define EPOCH_MOVING   (UINT_MAX - 2)
+
+/* TRUE if an entry with the death stamp i_death is in the table */
+#define EPOCH_VISIBLE(i_death) ((i_death) == EPOCH_LIVE || (i_death) == EPOCH_MOVING)
+
 /* Prototypes */
+struct s_entry_batch;
 static inline void transpose(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_entry_t *p_entry);
 static inline void move_to_front(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_entry_t *p_entry);
-static inline void free_entry_chain(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry);
+static inline void free_entry_chain(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry, struct s_entry_batch *p_batch);
 static inline ght_hash_entry_t *search_in_bucket(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_key_t *p_key, unsigned char i_heuristics);
 
 static inline void hk_fill(ght_hash_key_t *p_hk, int i_size, const void *p_key);
+static void insert_entry(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry, ght_uint32_t l_hash);
 //static inline ght_hash_entry_t *he_create(ght_hash_table_t *p_ht, void *p_data, unsigned int i_key_size, const void *p_key_data);
 ght_hash_entry_t *he_create(ght_hash_table_t *p_ht, void *p_data, unsigned int i_key_size, const void *p_key_data);
 ght_hash_entry_t *lockless_he_create(ght_hash_table_t *p_ht, void *p_data, unsigned int i_key_size, const void *p_key_data);
+static void he_init(ght_hash_entry_t *p_he, void *p_data, unsigned int i_key_size, const void *p_key_data);
 static void he_finalize(ght_hash_table_t *p_ht, ght_hash_entry_t *p_he);
+static void he_retire(ght_hash_table_t *p_ht, ght_hash_entry_t *p_he);
+static void purge_deferred(ght_hash_table_t *p_ht);
 
-void *get_next_entry(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, ght_hash_entry_t *start_entry);
+void *get_next_entry(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, ght_uint32_t l_bucket, ght_hash_entry_t *start_entry);
 static void *lockless_set_iterator(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, ght_hash_entry_t *p_uentry, int l_bucket, const void **p_key, unsigned int *size);
 void *lockless_ght_iterator_remove(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, const void **p_key);
+static void *lockless_skip_removed(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, void *p_data, const void **p_key, unsigned int *size);
 
 /* --- private methods --- */
 
+/* Wake the threads sleeping on a bucket after leaving it */
+static inline void wake_bucket(ght_hash_table_t *p_ht, ght_uint32_t l_bucket) {
+	if(__atomic_load_n(&ght_backoff_sleepers, __ATOMIC_SEQ_CST))
+		ght_backoff_wake_channel(&p_ht->pp_entries[l_bucket]);
+}
+
+/* The occupancy bitmap has one bit per bucket, so iterators can skip
+ * runs of empty buckets without touching the bucket array. A bit may
+ * stay set for a bucket that just became empty, but it is never clear
+ * for a bucket that holds an entry. */
+#define OCCUPIED_WORDS(i_size) (((i_size) + 63) / 64)
+
+/* A checkpoint tracks changes in groups of this many buckets, one
+ * cache line of the bucket array, with one dirty bit per group */
+#define DIRTY_SPAN             8
+#define DIRTY_WORDS(i_size)    ((((i_size) + DIRTY_SPAN - 1) / DIRTY_SPAN + 63) / 64)
+
+/* Called after an entry has been linked into the bucket */
+static inline void occupied_set(ght_hash_table_t *p_ht, ght_uint32_t l_bucket) {
+	uint64_t *p_word = &p_ht->p_occupied[l_bucket / 64];
+	uint64_t bit = (uint64_t) 1 << (l_bucket % 64);
+
+	if (!(__atomic_load_n(p_word, __ATOMIC_SEQ_CST) & bit))
+		__atomic_fetch_or(p_word, bit, __ATOMIC_SEQ_CST);
+}
+
+/* Called after an entry has been unlinked from the bucket. An insert
+ * racing with us either sees the cleared bit and sets it again, or has
+ * linked its entry before we look at the head a second time. */
+static inline void occupied_clear(ght_hash_table_t *p_ht, ght_uint32_t l_bucket) {
+	uint64_t *p_word = &p_ht->p_occupied[l_bucket / 64];
+	uint64_t bit = (uint64_t) 1 << (l_bucket % 64);
+
+	if (ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[l_bucket])) != NULL)
+		return;
+
+	__atomic_fetch_and(p_word, ~bit, __ATOMIC_SEQ_CST);
+	if (ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[l_bucket])) != NULL)
+		__atomic_fetch_or(p_word, bit, __ATOMIC_SEQ_CST);
+}
+
+/* Return the first bucket from i_bucket on which may be non-empty, or
+ * the table size if there is none */
+static inline unsigned int next_occupied_bucket(ght_hash_table_t *p_ht, unsigned int i_bucket) {
+	unsigned int i_words = OCCUPIED_WORDS(p_ht->i_size);
+	unsigned int i_word = i_bucket / 64;
+	uint64_t word;
+
+	if (i_bucket >= p_ht->i_size)
+		return p_ht->i_size;
+
+	word = __atomic_load_n(&p_ht->p_occupied[i_word], __ATOMIC_ACQUIRE) & (~(uint64_t) 0 << (i_bucket % 64));
+	while (word == 0) {
+		if (++i_word >= i_words)
+			return p_ht->i_size;
+		word = __atomic_load_n(&p_ht->p_occupied[i_word], __ATOMIC_ACQUIRE);
+	}
+	return i_word * 64 + __builtin_ctzll(word);
+}
 
 
 #ifdef __EVENT_DEBUG_MODE__
@@ -155,17 +236,26 @@ static inline void move_to_front(ght_hash_table_t *p_ht, ght_uint32_t l_bucket,
 	p_ht->pp_entries[l_bucket] = p_entry;
 }
 
-static inline void remove_from_chain(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_entry_t *p) {
-	if (p->p_prev) {
-		p->p_prev->p_next = p->p_next;
-	} else /* first in list */
-	{
-		p_ht->pp_entries[l_bucket] = p->p_next;
+/* Append an entry to the insertion list, which ght_first() walks and
+ * ght_rehash() copies. The lockless functions hold the list lock around
+ * this, the others own the table. */
+static inline void list_append(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry) {
+	if (p_ht->p_oldest == NULL) {
+		p_ht->p_oldest = p_entry;
 	}
-	if (p->p_next) {
-		p->p_next->p_prev = p->p_prev;
+	p_entry->p_older = p_ht->p_newest;
+	p_entry->p_newer = NULL;
+
+	if (p_ht->p_newest != NULL) {
+		p_ht->p_newest->p_newer = p_entry;
 	}
 
+	p_ht->p_newest = p_entry;
+	p_entry->b_listed = TRUE;
+}
+
+/* Take an entry off the insertion list, under the same rules */
+static inline void list_unlink(ght_hash_table_t *p_ht, ght_hash_entry_t *p) {
 	if (p->p_older) {
 		p->p_older->p_newer = p->p_newer;
 	} else /* oldest */
@@ -178,6 +268,45 @@ static inline void remove_from_chain(ght_hash_table_t *p_ht, ght_uint32_t l_buck
 	{
 		p_ht->p_newest = p->p_older;
 	}
+	p->b_listed = FALSE;
+}
+
+/* The insertion list is not lockless, the lockless functions change it
+ * one at a time */
+static inline void list_lock(ght_hash_table_t *p_ht) {
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
+
+	while (!ght_atomic_cas_uint(&p_ht->i_list_lock, 0, 1))
+		p_ht->fn_backoff(&backoff, NULL);
+}
+
+static inline void list_unlock(ght_hash_table_t *p_ht) {
+	__atomic_store_n(&p_ht->i_list_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Take an entry which the lockless functions removed off the insertion
+ * list, if it is on it. Only the thread which claimed it calls this. */
+static void list_release(ght_hash_table_t *p_ht, ght_hash_entry_t *p_e) {
+	if (!p_e->b_listed)
+		return;
+	list_lock(p_ht);
+	list_unlink(p_ht, p_e);
+	list_unlock(p_ht);
+}
+
+static inline void remove_from_chain(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_entry_t *p) {
+	if (p->p_prev) {
+		p->p_prev->p_next = p->p_next;
+	} else /* first in list */
+	{
+		p_ht->pp_entries[l_bucket] = p->p_next;
+	}
+	if (p->p_next) {
+		p->p_next->p_prev = p->p_prev;
+	}
+
+	if (p->b_listed)
+		list_unlink(p_ht, p);
 }
 
 /*
@@ -195,24 +324,22 @@ static inline ght_hash_entry_t *lockless_search_in_bucket(ght_hash_table_t *p_ht
 */
 
 static inline ght_hash_entry_t *lockless_search_in_bucket(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_key_t *p_key, unsigned char i_heuristics) {
-	ght_hash_entry_t *p_e = p_ht->pp_entries[l_bucket];
-	ght_hash_entry_t *p_prev_step = NULL;
-	UnMark(&(p_e));
+	ght_hash_entry_t *p_e = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[l_bucket]));
 
 	int refcnt;
 	while (p_e) {
-		do {
-			refcnt = p_e->refCount;
-		} while(p_e && !__sync_bool_compare_and_swap(&p_e->refCount, refcnt, refcnt + 2));
+		refcnt = __atomic_add_fetch(&p_e->refCount, 2, __ATOMIC_ACQ_REL);
 
-		if(p_e->refCount % 2 == 0) { 
-			if ( !Has_Mark(&(p_e->p_next)) && (p_e->key.i_size == p_key->i_size) && (memcmp(p_e->key.p_key, p_key->p_key, p_e->key.i_size) == 0)) {
+		if(refcnt % 2 == 0) {
+			/* An entry being moved stays valid while it is unlinked,
+			 * for those who passed its copy before it was linked */
+			if ( ((!Has_Mark(&(p_e->p_next)) && p_e->i_death == EPOCH_LIVE) || p_e->i_death == EPOCH_MOVING) &&
+					(p_e->key.i_size == p_key->i_size) && (memcmp(p_e->key.p_key, p_key->p_key, p_e->key.i_size) == 0)) {
 				return p_e;
 			}
 			FAA(&p_e->refCount, -2);
 		}
-		p_e = p_e->p_next;
-		UnMark( &p_e );
+		p_e = ght_ptr_unmark(ght_atomic_load_ptr(&p_e->p_next));
 	}
 	return NULL;
 }
@@ -240,13 +367,176 @@ static inline ght_hash_entry_t *search_in_bucket(ght_hash_table_t *p_ht, ght_uin
 	return NULL;
 }
 
+/* The size of an entry with its key stored inline */
+#define ENTRY_SIZE(i_key_size) (sizeof(ght_hash_entry_t) + (i_key_size))
+
+/* Entries are allocated and freed up to this many at a time when the
+ * allocator has batch functions */
+#define ENTRY_BATCH 64
+
+typedef struct s_entry_batch
+{
+	void *pp_ptrs[ENTRY_BATCH];
+	size_t sizes[ENTRY_BATCH];
+	unsigned int n;
+} entry_batch_t;
+
+/* The arena hands out entries from a list of chunks, newest first,
+ * and frees them only all together */
+#define ARENA_ALIGN(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+typedef struct s_arena_chunk
+{
+	struct s_arena_chunk *p_next;
+	size_t size;
+} arena_chunk_t;
+
+struct s_ght_arena
+{
+	arena_chunk_t *p_chunks;
+	char *p_free;              /* The next free byte in the newest chunk */
+	char *p_end;
+	size_t chunk_size;
+};
+
+static arena_chunk_t *arena_chunk(size_t size) {
+	arena_chunk_t *p_chunk;
+
+	if ((p_chunk = (arena_chunk_t*) malloc(sizeof(arena_chunk_t) + size)))
+		p_chunk->size = size;
+	return p_chunk;
+}
+
+static struct s_ght_arena *arena_create(size_t chunk_size) {
+	struct s_ght_arena *p_arena;
+
+	if (!(p_arena = (struct s_ght_arena*) malloc(sizeof(struct s_ght_arena))))
+		return NULL;
+	if (!(p_arena->p_chunks = arena_chunk(chunk_size))) {
+		free(p_arena);
+		return NULL;
+	}
+	p_arena->p_chunks->p_next = NULL;
+	p_arena->p_free = (char*) (p_arena->p_chunks + 1);
+	p_arena->p_end = p_arena->p_free + chunk_size;
+	p_arena->chunk_size = chunk_size;
+	return p_arena;
+}
+
+/* Free all chunks but the first one, or all of them if b_all */
+static void arena_release(struct s_ght_arena *p_arena, int b_all) {
+	arena_chunk_t *p_chunk = p_arena->p_chunks;
+	arena_chunk_t *p_next;
+
+	for (; p_chunk && (b_all || p_chunk->p_next); p_chunk = p_next) {
+		p_next = p_chunk->p_next;
+		free(p_chunk);
+	}
+	p_arena->p_chunks = p_chunk;
+	if (p_chunk) {
+		p_arena->p_free = (char*) (p_chunk + 1);
+		p_arena->p_end = p_arena->p_free + p_chunk->size;
+	}
+}
+
+static void arena_free(struct s_ght_arena *p_arena) {
+	if (p_arena) {
+		arena_release(p_arena, TRUE);
+		free(p_arena);
+	}
+}
+
+static void *arena_alloc(struct s_ght_arena *p_arena, size_t size) {
+	arena_chunk_t *p_chunk;
+	void *p;
+
+	size = ARENA_ALIGN(size);
+	if (size > (size_t) (p_arena->p_end - p_arena->p_free)) {
+		if (size > p_arena->chunk_size) {
+			/* A chunk of its own, behind the one being filled */
+			if (!(p_chunk = arena_chunk(size)))
+				return NULL;
+			p_chunk->p_next = p_arena->p_chunks->p_next;
+			p_arena->p_chunks->p_next = p_chunk;
+			return p_chunk + 1;
+		}
+		if (!(p_chunk = arena_chunk(p_arena->chunk_size)))
+			return NULL;
+		p_chunk->p_next = p_arena->p_chunks;
+		p_arena->p_chunks = p_chunk;
+		p_arena->p_free = (char*) (p_chunk + 1);
+		p_arena->p_end = p_arena->p_free + p_arena->chunk_size;
+	}
+	p = p_arena->p_free;
+	p_arena->p_free += size;
+	return p;
+}
+
+static inline void *entry_alloc(ght_hash_table_t *p_ht, unsigned int i_key_size) {
+	if (p_ht->p_arena)
+		return arena_alloc(p_ht->p_arena, ENTRY_SIZE(i_key_size));
+	if (p_ht->allocator.fn_alloc)
+		return p_ht->allocator.fn_alloc(p_ht->p_alloc_ctx, ENTRY_SIZE(i_key_size), i_key_size);
+	return p_ht->fn_alloc(ENTRY_SIZE(i_key_size));
+}
+
+static inline void entry_free(ght_hash_table_t *p_ht, ght_hash_entry_t *p_he) {
+	/* Arena entries are only freed with their chunk */
+	if (p_ht->p_arena)
+		return;
+	if (p_ht->allocator.fn_free)
+		p_ht->allocator.fn_free(p_ht->p_alloc_ctx, p_he, ENTRY_SIZE(p_he->key.i_size));
+	else
+		p_ht->fn_free(p_he);
+}
+
+/* Allocate the entries of p_batch->sizes. Returns the number of
+ * entries allocated, which are the first ones. */
+static unsigned int entries_alloc(ght_hash_table_t *p_ht, entry_batch_t *p_batch) {
+	unsigned int i;
+
+	if (!p_ht->p_arena && p_ht->allocator.fn_alloc_batch)
+		return p_ht->allocator.fn_alloc_batch(p_ht->p_alloc_ctx, p_batch->pp_ptrs, p_batch->sizes, p_batch->n);
+
+	for (i = 0; i < p_batch->n; i++) {
+		if (!(p_batch->pp_ptrs[i] = entry_alloc(p_ht, p_batch->sizes[i] - sizeof(ght_hash_entry_t))))
+			break;
+	}
+	return i;
+}
+
+/* Free and empty the batch */
+static void entries_free(ght_hash_table_t *p_ht, entry_batch_t *p_batch) {
+	unsigned int i;
+
+	if (p_batch->n == 0 || p_ht->p_arena) {
+		p_batch->n = 0;
+		return;
+	}
+
+	if (p_ht->allocator.fn_free_batch)
+		p_ht->allocator.fn_free_batch(p_ht->p_alloc_ctx, p_batch->pp_ptrs, p_batch->sizes, p_batch->n);
+	else {
+		for (i = 0; i < p_batch->n; i++)
+			entry_free(p_ht, (ght_hash_entry_t*) p_batch->pp_ptrs[i]);
+	}
+	p_batch->n = 0;
+}
+
 /* Free a chain of entries (in a bucket) */
-static inline void free_entry_chain(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry) {
+static inline void free_entry_chain(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry, entry_batch_t *p_batch) {
 	ght_hash_entry_t *p_e = p_entry;
 
 	while (p_e) {
-		ght_hash_entry_t *p_e_next = p_e->p_next;
-		he_finalize(p_ht, p_e);
+		ght_hash_entry_t *p_e_next = ght_ptr_unmark(p_e->p_next);
+
+		/* Entries linked by the lockless functions hold no reference */
+		p_e->refCount = 2;
+		he_retire(p_ht, p_e);
+		p_batch->pp_ptrs[p_batch->n] = p_e;
+		p_batch->sizes[p_batch->n] = ENTRY_SIZE(p_e->key.i_size);
+		if (++p_batch->n == ENTRY_BATCH)
+			entries_free(p_ht, p_batch);
 		p_e = p_e_next;
 	}
 }
@@ -262,7 +552,7 @@ static inline void hk_fill(ght_hash_key_t *p_hk, int i_size, const void *p_key)
 ght_hash_entry_t *lockless_he_create(ght_hash_table_t *p_ht, void *p_data, unsigned int i_key_size, const void *p_key_data) {
 	ght_hash_entry_t *p_he;
 
-	if (!(p_he = (ght_hash_entry_t*) p_ht->fn_alloc(sizeof(ght_hash_entry_t) + i_key_size))) {
+	if (!(p_he = (ght_hash_entry_t*) entry_alloc(p_ht, i_key_size))) {
 		fprintf(stderr, "fn_alloc failed!\n");
 		return NULL;
 	}
@@ -274,7 +564,9 @@ ght_hash_entry_t *lockless_he_create(ght_hash_table_t *p_ht, void *p_data, unsig
 	p_he->p_prev = NULL;
 	p_he->p_older = NULL;
 	p_he->p_newer = NULL;
-	p_he->refCount = 2;
+	p_he->i_birth = EPOCH_PENDING;
+	p_he->i_death = EPOCH_LIVE;
+	p_he->b_listed = FALSE;
 
 #ifdef __EVENT_DEBUG_MODE__
 	p_he->event[0] = NULL;
@@ -284,10 +576,14 @@ ght_hash_entry_t *lockless_he_create(ght_hash_table_t *p_ht, void *p_data, unsig
 
 	EVENTS('C', p_he);
 
-	/* Create the key */
+	/* Create the key, inline after the entry like he_create() does.
+	 * The allocator always gets room for it. */
 	p_he->key.i_size = i_key_size;
+	memcpy(p_he + 1, p_key_data, i_key_size);
+	p_he->key.p_key = (void*) (p_he + 1);
 
-	memcpy(p_he->key.p_key, p_key_data, i_key_size);	
+	/* Last, a pool scan which pins the slot must see the rest */
+	__atomic_store_n(&p_he->refCount, 2, __ATOMIC_RELEASE);
 
 	return p_he;
 }
@@ -311,46 +607,65 @@ ght_hash_entry_t *he_create(ght_hash_table_t *p_ht, void *p_data, unsigned int i
 	 * This saves space since malloc only is called once and thus avoids
 	 * some fragmentation. Thanks to Dru Lemley for this idea.
 	 */
-	if (!(p_he = (ght_hash_entry_t*) p_ht->fn_alloc(sizeof(ght_hash_entry_t) + i_key_size))) {
+	if (!(p_he = (ght_hash_entry_t*) entry_alloc(p_ht, i_key_size))) {
 		fprintf(stderr, "fn_alloc failed!\n");
 		return NULL;
 	}
-	memset(p_he, 0, sizeof(ght_hash_entry_t) + i_key_size);
+	he_init(p_he, p_data, i_key_size, p_key_data);
+	return p_he;
+}
+
+/* Initialize a newly allocated hash entry */
+static void he_init(ght_hash_entry_t *p_he, void *p_data, unsigned int i_key_size, const void *p_key_data) {
+	/* Every field is set below. refCount is not cleared, a free pool
+	 * slot keeps its odd count until the entry is ready. */
+#ifdef __EVENT_DEBUG_MODE__
+	memset(p_he->event, 0, sizeof(p_he->event));
+	memset(p_he->eventCnt, 0, sizeof(p_he->eventCnt));
+#endif
 
-	int i=0;
 	p_he->p_data = p_data;
 	p_he->p_next = NULL;
 	p_he->p_prev = NULL;
 	p_he->p_older = NULL;
 	p_he->p_newer = NULL;
-	p_he->refCount = 2;
+	p_he->i_birth = EPOCH_PENDING;     /* Until it is linked */
+	p_he->i_death = EPOCH_LIVE;
+	p_he->b_listed = FALSE;
 
 	/* Create the key */
 	p_he->key.i_size = i_key_size;
 	memcpy(p_he + 1, p_key_data, i_key_size);
 	p_he->key.p_key = (void*) (p_he + 1);
-	return p_he;
+
+	__atomic_store_n(&p_he->refCount, 2, __ATOMIC_RELEASE);
 }
 
 /* Finalize (free) a hash entry */
 static void __attribute__((noinline)) he_finalize(ght_hash_table_t *p_ht, ght_hash_entry_t *p_he) {
+	he_retire(p_ht, p_he);
+	entry_free(p_ht, p_he);
+}
+
+/* Wait for the readers of a hash entry to leave it, the caller frees it */
+static void he_retire(ght_hash_table_t *p_ht, ght_hash_entry_t *p_he) {
 	assert(p_he);
 
 #if !defined(NDEBUG)
-	p_he->p_next = NULL;
+	p_he->p_next = (ght_hash_entry_t *) GHT_MARK_DELETE;
 	p_he->p_prev = NULL;
 	p_he->p_older = NULL;
 	p_he->p_newer = NULL;
 #endif /* NDEBUG */
 
-	while(!__sync_bool_compare_and_swap(&p_he->refCount, 2, 1));
+	while(!ght_atomic_cas_int(&p_he->refCount, 2, 1))
+		ght_cpu_relax();
 
 	p_he->p_data = NULL;
 	p_he->p_prev = 0x1;
 	p_he->p_next = 0x1;
 
 	EVENTS('F', p_he);
-	p_ht->fn_free(p_he);
 }
 
 #if 0
@@ -381,9 +696,202 @@ static inline ght_uint32_t get_hash_value(ght_hash_table_t *p_ht, ght_hash_key_t
 # define get_hash_value(p_ht, p_key) ( (p_ht)->fn_hash(p_key) )
 #endif
 
+/* The lookup cache is kept per thread, so unlike the shared hash value
+ * cache above it needs no synchronization. A slot is only trusted
+ * while the modification counter of its bucket is unchanged. */
+#define LOOKUP_CACHE_SLOTS 128
+
+typedef struct
+{
+	unsigned int i_table;      /* The id of the table, 0 if the slot is empty */
+	unsigned int i_version;    /* The counter of l_bucket when the slot was filled */
+	ght_uint32_t l_bucket;
+	unsigned int i_key_size;
+	void *p_data;              /* The result of the lookup, NULL for a miss */
+	unsigned char key[GHT_LOOKUP_CACHE_KEY_MAX];
+} lookup_cache_slot_t;
+
+static __thread lookup_cache_slot_t lookup_cache[LOOKUP_CACHE_SLOTS];
+
+/* Table ids start at 1 and are never reused */
+static unsigned int ght_next_table_id = 0;
+
+static inline unsigned int new_table_id(void) {
+	return ght_atomic_fetch_add(&ght_next_table_id, 1) + 1;
+}
+
+/* Pick the slot from the ends of the key instead of hashing all of it */
+static inline lookup_cache_slot_t *lookup_cache_slot(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_key_data) {
+	uint64_t head = 0;
+	uint64_t tail = 0;
+	uint64_t x;
+
+	memcpy(&head, p_key_data, i_key_size < sizeof(head) ? i_key_size : sizeof(head));
+	if (i_key_size > sizeof(tail))
+		memcpy(&tail, (const char*) p_key_data + i_key_size - sizeof(tail), sizeof(tail));
+
+	x = (head ^ (tail * 0x9e3779b97f4a7c15ULL)) + (((uint64_t) i_key_size << 32) | p_ht->i_id);
+	x *= 0xff51afd7ed558ccdULL;
+
+	return &lookup_cache[(x >> 32) & (LOOKUP_CACHE_SLOTS - 1)];
+}
+
+/* Returns TRUE and sets *pp_data if the slot holds a valid result for the key */
+static inline int lookup_cache_hit(ght_hash_table_t *p_ht, lookup_cache_slot_t *p_slot, unsigned int i_key_size, const void *p_key_data, void **pp_data) {
+	if (p_slot->i_table != p_ht->i_id || p_slot->i_key_size != i_key_size ||
+			memcmp(p_slot->key, p_key_data, i_key_size) != 0)
+		return FALSE;
+	if (__atomic_load_n(&p_ht->p_version[p_slot->l_bucket], __ATOMIC_ACQUIRE) != p_slot->i_version)
+		return FALSE;
+
+	*pp_data = p_slot->p_data;
+	return TRUE;
+}
+
+/* i_version must have been read before the bucket was searched */
+static inline void lookup_cache_fill(ght_hash_table_t *p_ht, lookup_cache_slot_t *p_slot, ght_uint32_t l_bucket, unsigned int i_version, unsigned int i_key_size, const void *p_key_data, void *p_data) {
+	p_slot->i_table = p_ht->i_id;
+	p_slot->i_version = i_version;
+	p_slot->l_bucket = l_bucket;
+	p_slot->i_key_size = i_key_size;
+	p_slot->p_data = p_data;
+	memcpy(p_slot->key, p_key_data, i_key_size);
+}
+
+/* Mark the group of a bucket as changed since the last checkpoint.
+ * Most changes hit a group which is dirty already, so the shared word
+ * is only written when the bit is clear. The load is sequentially
+ * consistent with the change, so a bit that a checkpoint is clearing
+ * right now is either seen clear or cleared after the change. */
+static inline void dirty_set(ght_hash_table_t *p_ht, ght_uint32_t l_bucket) {
+	uint64_t *p_word = &p_ht->p_dirty[l_bucket / DIRTY_SPAN / 64];
+	uint64_t bit = (uint64_t) 1 << (l_bucket / DIRTY_SPAN % 64);
+
+	if (!(__atomic_load_n(p_word, __ATOMIC_SEQ_CST) & bit))
+		__atomic_fetch_or(p_word, bit, __ATOMIC_SEQ_CST);
+}
+
+/* Called after every change to a bucket that may change a lookup result */
+static inline void bucket_modified(ght_hash_table_t *p_ht, ght_uint32_t l_bucket) {
+	if (p_ht->p_version)
+		__atomic_add_fetch(&p_ht->p_version[l_bucket], 1, __ATOMIC_RELEASE);
+	if (p_ht->p_dirty)
+		dirty_set(p_ht, l_bucket);
+}
+
+/* The membership filter is a blocked Bloom filter with 8 bit counters
+ * instead of bits, so keys can be removed again. All probes of a key
+ * fall into one block of one cache line. A counter which overflows
+ * sticks at its maximum and is never decremented again. */
+#define FILTER_BLOCK       64  /* Counters per block */
+#define FILTER_MAX_PROBES  16
+#define FILTER_STICKY      UCHAR_MAX
+
+struct s_ght_filter
+{
+	unsigned char *p_counters;   /* i_blocks * FILTER_BLOCK counters */
+	unsigned int i_blocks;
+	unsigned int i_probes;
+
+	/* Kept apart from the read-only fields above */
+	unsigned long i_queries __attribute__((aligned(64)));
+	unsigned long i_negatives;
+	unsigned long i_false_positives;
+};
+
+/* Spread the 32 bit hash value over 64 bits, the upper half selects
+ * the block and the lower half the probes within it */
+static inline uint64_t filter_mix(ght_uint32_t l_hash) {
+	uint64_t x = (uint64_t) l_hash * 0x9e3779b97f4a7c15ULL;
+
+	x ^= x >> 31;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 29;
+	return x;
+}
+
+static inline unsigned char *filter_block(struct s_ght_filter *p_filter, uint64_t x) {
+	return &p_filter->p_counters[((x >> 32) * p_filter->i_blocks >> 32) * FILTER_BLOCK];
+}
+
+/* Add (i_delta 1) or remove (i_delta -1) a key */
+static void filter_update(struct s_ght_filter *p_filter, ght_uint32_t l_hash, int i_delta) {
+	uint64_t x = filter_mix(l_hash);
+	unsigned char *p_block = filter_block(p_filter, x);
+	unsigned int a = x & (FILTER_BLOCK - 1);
+	unsigned int b = ((x >> 6) & (FILTER_BLOCK - 1)) | 1;
+	unsigned int i;
+
+	for (i = 0; i < p_filter->i_probes; i++, a = (a + b) & (FILTER_BLOCK - 1)) {
+		unsigned char c = __atomic_load_n(&p_block[a], __ATOMIC_RELAXED);
+
+		do {
+			if (c == FILTER_STICKY || (i_delta < 0 && c == 0))
+				break;
+		} while (!__atomic_compare_exchange_n(&p_block[a], &c, (unsigned char) (c + i_delta), 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+}
+
+/* Returns FALSE if the key with the hash value l_hash is certainly not
+ * in the table */
+static inline int filter_check(ght_hash_table_t *p_ht, ght_uint32_t l_hash) {
+	struct s_ght_filter *p_filter = p_ht->p_filter;
+	uint64_t x;
+	unsigned char *p_block;
+	unsigned int a;
+	unsigned int b;
+	unsigned int i;
+
+	if (!p_filter)
+		return TRUE;
+
+	x = filter_mix(l_hash);
+	p_block = filter_block(p_filter, x);
+	a = x & (FILTER_BLOCK - 1);
+	b = ((x >> 6) & (FILTER_BLOCK - 1)) | 1;
+
+	__atomic_fetch_add(&p_filter->i_queries, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < p_filter->i_probes; i++, a = (a + b) & (FILTER_BLOCK - 1)) {
+		if (__atomic_load_n(&p_block[a], __ATOMIC_ACQUIRE) == 0) {
+			__atomic_fetch_add(&p_filter->i_negatives, 1, __ATOMIC_RELAXED);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Called when a lookup the filter let through found nothing */
+static inline void filter_missed(ght_hash_table_t *p_ht) {
+	if (p_ht->p_filter)
+		__atomic_fetch_add(&p_ht->p_filter->i_false_positives, 1, __ATOMIC_RELAXED);
+}
+
+static inline void filter_add(ght_hash_table_t *p_ht, ght_uint32_t l_hash) {
+	if (p_ht->p_filter)
+		filter_update(p_ht->p_filter, l_hash, 1);
+}
+
+static inline void filter_remove(ght_hash_table_t *p_ht, ght_uint32_t l_hash) {
+	if (p_ht->p_filter)
+		filter_update(p_ht->p_filter, l_hash, -1);
+}
+
+static void filter_free(struct s_ght_filter *p_filter) {
+	if (p_filter) {
+		free(p_filter->p_counters);
+		free(p_filter);
+	}
+}
+
 /* --- Exported methods --- */
 /* Create a new hash table */
 ght_hash_table_t *ght_create(unsigned int i_size) {
+	return ght_create_ex(i_size, 0);
+}
+
+/* Create a new hash table with its bucket arrays backed as i_flags say */
+ght_hash_table_t *ght_create_ex(unsigned int i_size, int i_flags) {
 	ght_hash_table_t *p_ht;
 	int i = 1;
 
@@ -410,27 +918,49 @@ ght_hash_table_t *ght_create(unsigned int i_size) {
 	/* Set flags */
 	p_ht->i_heuristics = GHT_HEURISTICS_NONE;
 	p_ht->i_automatic_rehash = FALSE;
+	p_ht->fn_backoff = ght_backoff_exponential;
+	p_ht->i_epoch = 0;
+	p_ht->i_snapshots = 0;
+	p_ht->i_deferred = 0;
+	p_ht->i_moving = 0;
+	p_ht->i_list_lock = 0;
+	p_ht->i_id = new_table_id();
+	p_ht->p_version = NULL;
+	p_ht->p_dirty = NULL;
+	p_ht->p_filter = NULL;
+	memset(&p_ht->allocator, 0, sizeof(p_ht->allocator));
+	p_ht->p_alloc_ctx = NULL;
 
 	p_ht->bucket_limit = 0;
 	p_ht->fn_bucket_free = NULL;
 	p_ht->mem_type = HASH_DYNAMIC_MEM;
+	p_ht->i_flags = i_flags;
+	p_ht->p_arena = NULL;
+	p_ht->p_pool = NULL;
 
 	/* Create an empty bucket list. */
-	if (!(p_ht->pp_entries = (ght_hash_entry_t**) malloc(p_ht->i_size * sizeof(ght_hash_entry_t*)))) {
-		perror("malloc");
+	if (!(p_ht->pp_entries = (ght_hash_entry_t**) ght_pages_alloc(p_ht->i_size * sizeof(ght_hash_entry_t*), i_flags))) {
+		perror("ght_pages_alloc");
 		free(p_ht);
 		return NULL;
 	}
-	memset(p_ht->pp_entries, 0, p_ht->i_size * sizeof(ght_hash_entry_t*));
 
 	/* Initialise the number of entries in each bucket to zero */
-	if (!(p_ht->p_nr = (unsigned int*) malloc(p_ht->i_size * sizeof(unsigned int)))) {
-		perror("malloc");
-		free(p_ht->pp_entries);
+	if (!(p_ht->p_nr = (unsigned int*) ght_pages_alloc(p_ht->i_size * sizeof(unsigned int), i_flags))) {
+		perror("ght_pages_alloc");
+		ght_pages_free(p_ht->pp_entries);
+		free(p_ht);
+		return NULL;
+	}
+
+	/* No bucket is occupied yet */
+	if (!(p_ht->p_occupied = (uint64_t*) ght_pages_alloc(OCCUPIED_WORDS(p_ht->i_size) * sizeof(uint64_t), 0))) {
+		perror("ght_pages_alloc");
+		ght_pages_free(p_ht->p_nr);
+		ght_pages_free(p_ht->pp_entries);
 		free(p_ht);
 		return NULL;
 	}
-	memset(p_ht->p_nr, 0, p_ht->i_size * sizeof(int));
 
 	p_ht->p_oldest = NULL;
 	p_ht->p_newest = NULL;
@@ -438,11 +968,70 @@ ght_hash_table_t *ght_create(unsigned int i_size) {
 	return p_ht;
 }
 
+/* The slots in each L1 word of an entry pool segment */
+#define POOL_L1_SLOTS (64 * 64 * 64)
+
+/* Create a table for the lockless functions with an entry pool of its own */
+ght_hash_table_t *ght_create_concurrent(unsigned int i_capacity, unsigned int i_max_key_size, int i_threads) {
+	ght_hash_table_t *p_ht;
+	LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *p_pool;
+	/* Size the first segment to hold all i_capacity entries */
+	int i_l1 = i_capacity / POOL_L1_SLOTS + (i_capacity % POOL_L1_SLOTS != 0);
+
+	if (!(p_ht = ght_create(i_capacity)))
+		return NULL;
+
+	if (!(p_pool = (LOCKLESS_STATIC_BUCKET_HASHTABLE_ST*) malloc(sizeof(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST)))) {
+		perror("malloc");
+		ght_finalize(p_ht);
+		return NULL;
+	}
+	if (init_array_lookup_table(p_pool, i_l1 > 0 ? i_l1 : 1, i_threads, NULL, i_max_key_size) < 0) {
+		free(p_pool);
+		ght_finalize(p_ht);
+		return NULL;
+	}
+
+	ght_set_allocator(p_ht, &lockless_memory_allocator, p_pool);
+	p_ht->p_pool = p_pool;
+
+	return p_ht;
+}
+
 /* Set the allocation/deallocation function to use */
 void ght_set_alloc(ght_hash_table_t *p_ht, ght_fn_alloc_t fn_alloc, ght_fn_free_t fn_free) {
 	p_ht->fn_alloc = fn_alloc;
 	p_ht->fn_free = fn_free;
 	p_ht->mem_type = HASH_STATIC_MEM;
+	memset(&p_ht->allocator, 0, sizeof(p_ht->allocator));
+	p_ht->p_alloc_ctx = NULL;
+}
+
+/* Set the allocation functions with a context */
+void ght_set_allocator(ght_hash_table_t *p_ht, const ght_allocator_t *p_ops, void *p_ctx) {
+	assert(p_ht && p_ops && p_ops->fn_alloc && p_ops->fn_free);
+
+	p_ht->allocator = *p_ops;
+	p_ht->p_alloc_ctx = p_ctx;
+	/* The keys are stored inline in the entries */
+	p_ht->mem_type = HASH_DYNAMIC_MEM;
+}
+
+/* Carve the entries out of chunks owned by the table */
+int ght_set_arena(ght_hash_table_t *p_ht, size_t chunk_size) {
+	struct s_ght_arena *p_arena = NULL;
+
+	assert(p_ht);
+
+	if (p_ht->i_items > 0)
+		return -1;
+	if (chunk_size > 0 && !(p_arena = arena_create(chunk_size))) {
+		perror("malloc");
+		return -1;
+	}
+	arena_free(p_ht->p_arena);
+	p_ht->p_arena = p_arena;
+	return 0;
 }
 
 /* Set the hash function to use */
@@ -450,6 +1039,11 @@ void ght_set_hash(ght_hash_table_t *p_ht, ght_fn_hash_t fn_hash) {
 	p_ht->fn_hash = fn_hash;
 }
 
+/* Set the backoff policy of the lockless functions */
+void ght_set_backoff(ght_hash_table_t *p_ht, ght_fn_backoff_t fn_backoff) {
+	p_ht->fn_backoff = fn_backoff;
+}
+
 /* Set the heuristics to use. */
 void ght_set_heuristics(ght_hash_table_t *p_ht, int i_heuristics) {
 	p_ht->i_heuristics = i_heuristics;
@@ -460,6 +1054,106 @@ void ght_set_rehash(ght_hash_table_t *p_ht, int b_rehash) {
 	p_ht->i_automatic_rehash = b_rehash;
 }
 
+/* Enable or disable the thread-local lookup cache */
+int ght_set_lookup_cache(ght_hash_table_t *p_ht, int b_cache) {
+	assert(p_ht);
+
+	if (!b_cache) {
+		free(p_ht->p_version);
+		p_ht->p_version = NULL;
+		return 0;
+	}
+	if (!p_ht->p_version &&
+			!(p_ht->p_version = (unsigned int*) calloc(p_ht->i_size, sizeof(unsigned int)))) {
+		perror("calloc");
+		return -1;
+	}
+	/* Forget what the threads cached while the counters were off */
+	p_ht->i_id = new_table_id();
+	return 0;
+}
+
+/* Start or stop tracking the changed buckets for ght_checkpoint() */
+int ght_set_dirty_tracking(ght_hash_table_t *p_ht, int b_track) {
+	assert(p_ht);
+
+	if (!b_track) {
+		free(p_ht->p_dirty);
+		p_ht->p_dirty = NULL;
+		return 0;
+	}
+	if (!p_ht->p_dirty &&
+			!(p_ht->p_dirty = (uint64_t*) malloc(DIRTY_WORDS(p_ht->i_size) * sizeof(uint64_t)))) {
+		perror("malloc");
+		return -1;
+	}
+	/* Nothing has been checkpointed yet, so the next delta is full */
+	memset(p_ht->p_dirty, 0xff, DIRTY_WORDS(p_ht->i_size) * sizeof(uint64_t));
+	return 0;
+}
+
+int ght_set_filter(ght_hash_table_t *p_ht, double fp_rate, unsigned int expected_items) {
+	struct s_ght_filter *p_filter;
+	ght_hash_entry_t *p_e;
+	double bits_per_key;
+	unsigned int i;
+
+	assert(p_ht);
+
+	filter_free(p_ht->p_filter);
+	p_ht->p_filter = NULL;
+	if (!(fp_rate > 0 && fp_rate < 1))
+		return 0;
+
+	if (expected_items == 0)
+		expected_items = p_ht->i_items > p_ht->i_size ? p_ht->i_items : p_ht->i_size;
+
+	/* The optimal Bloom filter size, plus about 15% for the blocking */
+	bits_per_key = -log(fp_rate) / (M_LN2 * M_LN2) * 1.15;
+
+	if (!(p_filter = (struct s_ght_filter*) calloc(1, sizeof(struct s_ght_filter)))) {
+		perror("calloc");
+		return -1;
+	}
+	p_filter->i_blocks = (unsigned int) ceil(bits_per_key * expected_items / FILTER_BLOCK);
+	if (p_filter->i_blocks == 0)
+		p_filter->i_blocks = 1;
+	p_filter->i_probes = (unsigned int) (bits_per_key / 1.15 * M_LN2 + 0.5);
+	if (p_filter->i_probes < 1)
+		p_filter->i_probes = 1;
+	if (p_filter->i_probes > FILTER_MAX_PROBES)
+		p_filter->i_probes = FILTER_MAX_PROBES;
+
+	if (posix_memalign((void**) &p_filter->p_counters, 64, (size_t) p_filter->i_blocks * FILTER_BLOCK) != 0) {
+		perror("posix_memalign");
+		free(p_filter);
+		return -1;
+	}
+	memset(p_filter->p_counters, 0, (size_t) p_filter->i_blocks * FILTER_BLOCK);
+
+	/* Add the keys which are already in the table */
+	for (i = 0; i < p_ht->i_size; i++) {
+		for (p_e = ght_ptr_unmark(p_ht->pp_entries[i]); p_e; p_e = ght_ptr_unmark(p_e->p_next)) {
+			if (EPOCH_VISIBLE(p_e->i_death))
+				filter_update(p_filter, get_hash_value(p_ht, &p_e->key), 1);
+		}
+	}
+
+	p_ht->p_filter = p_filter;
+	return 0;
+}
+
+void ght_get_filter_stats(ght_hash_table_t *p_ht, ght_filter_stats_t *p_stats) {
+	assert(p_ht && p_stats);
+
+	memset(p_stats, 0, sizeof(*p_stats));
+	if (p_ht->p_filter) {
+		p_stats->i_queries = __atomic_load_n(&p_ht->p_filter->i_queries, __ATOMIC_RELAXED);
+		p_stats->i_negatives = __atomic_load_n(&p_ht->p_filter->i_negatives, __ATOMIC_RELAXED);
+		p_stats->i_false_positives = __atomic_load_n(&p_ht->p_filter->i_false_positives, __ATOMIC_RELAXED);
+	}
+}
+
 void ght_set_bounded_buckets(ght_hash_table_t *p_ht, unsigned int limit, ght_fn_bucket_free_callback_t fn) {
 	p_ht->bucket_limit = limit;
 	p_ht->fn_bucket_free = fn;
@@ -479,56 +1173,63 @@ unsigned int ght_table_size(ght_hash_table_t *p_ht) {
 	return p_ht->i_size;
 }
 
-/* Insert an entry into the hash table without use of lock */
-int lockless_ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_size, const void *p_key_data) {
-	ght_hash_entry_t *p_entry;
-	ght_uint32_t l_key;
-	ght_hash_key_t key;
+/* Link a new entry into the table with the lockless functions, and
+ * append it to the insertion list as well if b_list is TRUE. If its key
+ * is already in the table, the entry is freed and -1 returned. */
+static int lockless_link_entry(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry, ght_uint32_t l_hash, int b_list) {
+	ght_uint32_t l_key = l_hash & p_ht->i_size_mask;
+	ght_hash_key_t key = p_entry->key;
 	ght_hash_entry_t *p_ret;
 	ght_hash_entry_t *p_unext;
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
 
-	assert(p_ht);
-	
-	hk_fill(&key, i_key_size, p_key_data);
+	/* Lookups must find the key in the filter once the entry is linked */
+	filter_add(p_ht, l_hash);
 
-	l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
-
-	if(p_ht->mem_type == HASH_STATIC_MEM ){
-		if (!(p_entry = lockless_he_create(p_ht, p_entry_data, i_key_size, p_key_data)))
-			return -2;
-	}
-	else{
-		if (!(p_entry = he_create(p_ht, p_entry_data, i_key_size, p_key_data)))
-			return -2;		
+	/* Listed before anybody can find it and take it off again */
+	if (b_list) {
+		list_lock(p_ht);
+		list_append(p_ht, p_entry);
+		list_unlock(p_ht);
 	}
 
 	fail_ins1:
 	p_ret = lockless_search_in_bucket(p_ht, l_key, &key, 0);
 	if (p_ret) {
 		FAA(&p_ret->refCount, -2);
+		filter_remove(p_ht, l_hash);
+		list_release(p_ht, p_entry);
 		he_finalize(p_ht, p_entry);
 		return -1;
 	}
 	
-	p_entry->p_next = p_ht->pp_entries[l_key];
-	UnMark( &(p_entry->p_next) );
-	Mark_delete( &p_entry->p_next );
-	p_unext = p_entry->p_next;
-	Unmark_delete( &p_unext );
+	p_unext = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[l_key]));
+	p_entry->p_next = (ght_hash_entry_t *) ((uintptr_t) p_unext | GHT_MARK_DELETE);
 	p_entry->p_prev = NULL;
+	p_entry->i_birth = EPOCH_PENDING;
 
-	if(!CAS1(&p_ht->pp_entries[l_key], &p_unext, &p_entry))
+	if(!CAS1(&p_ht->pp_entries[l_key], &p_unext, &p_entry)) {
+		p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
 		goto fail_ins1;
+	}
+	occupied_set(p_ht, l_key);
+
+	/* Stamp the entry before the delete mark makes it visible */
+	__atomic_store_n(&p_entry->i_birth, __atomic_load_n(&p_ht->i_epoch, __ATOMIC_SEQ_CST), __ATOMIC_RELEASE);
 	
 	fail_ins2:
 	if(p_unext != NULL) {
-		if( !CAS2(&p_unext->p_prev, NULL, &p_entry) )
+		if( !CAS2(&p_unext->p_prev, NULL, &p_entry) ) {
+			p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
 			goto fail_ins2;
+		}
 	}
 	
 	Unmark_delete( &p_entry->p_next );
+	bucket_modified(p_ht, l_key);
 	FAA(&p_entry->refCount, -2);
 	EVENTS('Z', p_entry);
+	wake_bucket(p_ht, l_key);
 
 	FAA(&(p_ht->p_nr[l_key]), 1);
 	FAA(&(p_ht->i_items), 1);
@@ -536,6 +1237,38 @@ int lockless_ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int
 	return 0;
 }
 
+static int lockless_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_size, const void *p_key_data, int b_list) {
+	ght_hash_entry_t *p_entry;
+	ght_hash_key_t key;
+
+	assert(p_ht);
+	
+	hk_fill(&key, i_key_size, p_key_data);
+
+	if(p_ht->mem_type == HASH_STATIC_MEM ){
+		if (!(p_entry = lockless_he_create(p_ht, p_entry_data, i_key_size, p_key_data)))
+			return -2;
+	}
+	else{
+		if (!(p_entry = he_create(p_ht, p_entry_data, i_key_size, p_key_data)))
+			return -2;		
+	}
+
+	return lockless_link_entry(p_ht, p_entry, get_hash_value(p_ht, &key), b_list);
+}
+
+/* Insert an entry into the hash table without use of lock */
+int lockless_ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_size, const void *p_key_data) {
+	return lockless_insert(p_ht, p_entry_data, i_key_size, p_key_data, FALSE);
+}
+
+/* Insert an entry as lockless_ght_insert() does, and put it on the
+ * insertion list as ght_load() does, so that every function of the
+ * table sees it. The log and the replays insert with this. */
+int ght_insert_listed(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_size, const void *p_key_data) {
+	return lockless_insert(p_ht, p_entry_data, i_key_size, p_key_data, TRUE);
+}
+
 /* Insert an entry into the hash table without use of lock */
 // int lockless_ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_size, const void *p_key_data) {
 // 	ght_hash_entry_t *p_entry;
@@ -616,14 +1349,14 @@ int lockless_ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int
 /* Insert an entry into the hash table */
 int ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_size, const void *p_key_data) {
 	ght_hash_entry_t *p_entry;
-	ght_uint32_t l_key;
+	ght_uint32_t l_hash;
 	ght_hash_key_t key;
 
 	assert(p_ht);
 
 	hk_fill(&key, i_key_size, p_key_data);
-	l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
-	if (search_in_bucket(p_ht, l_key, &key, 0)) {
+	l_hash = get_hash_value(p_ht, &key);
+	if (search_in_bucket(p_ht, l_hash & p_ht->i_size_mask, &key, 0)) {
 		/* Don't insert if the key is already present. */
 		return -1;
 	}
@@ -631,20 +1364,32 @@ int ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_si
 		return -2;
 	}
 
+	insert_entry(p_ht, p_entry, l_hash);
+	return 0;
+}
+
+/* Link a new entry, whose key is not in the table, into the table */
+static void insert_entry(ght_hash_table_t *p_ht, ght_hash_entry_t *p_entry, ght_uint32_t l_hash) {
+	ght_uint32_t l_key = l_hash & p_ht->i_size_mask;
+
 	/* Rehash if the number of items inserted is too high. */
 	if (p_ht->i_automatic_rehash && p_ht->i_items > 2 * p_ht->i_size) {
 		ght_rehash(p_ht, 2 * p_ht->i_size);
 		/* Recalculate l_key after ght_rehash has updated i_size_mask */
-		l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
+		l_key = l_hash & p_ht->i_size_mask;
 	}
+	filter_add(p_ht, l_hash);
 
 	/* Place the entry first in the list. */
 	p_entry->p_next = p_ht->pp_entries[l_key];
 	p_entry->p_prev = NULL;
+	p_entry->i_birth = 0;
 	if (p_ht->pp_entries[l_key]) {
 		p_ht->pp_entries[l_key]->p_prev = p_entry;
 	}
 	p_ht->pp_entries[l_key] = p_entry;
+	occupied_set(p_ht, l_key);
+	bucket_modified(p_ht, l_key);
 
 	/* If this is a limited bucket hash table, potentially remove the last item */
 	if (p_ht->bucket_limit != 0 && p_ht->p_nr[l_key] >= p_ht->bucket_limit) {
@@ -660,8 +1405,10 @@ int ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_si
 		assert(p && p->p_next == NULL);
 
 		remove_from_chain(p_ht, l_key, p); /* To allow it to be reinserted in fn_bucket_free */
+		filter_remove(p_ht, get_hash_value(p_ht, &p->key));
 		p_ht->fn_bucket_free(p->p_data, p->key.p_key);
 
+		ght_atomic_add_int(&p->refCount, 2);
 		he_finalize(p_ht, p);
 	} else {
 		p_ht->p_nr[l_key]++;
@@ -671,18 +1418,11 @@ int ght_insert(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key_si
 		p_ht->i_items++;
 	}
 
-	if (p_ht->p_oldest == NULL) {
-		p_ht->p_oldest = p_entry;
-	}
-	p_entry->p_older = p_ht->p_newest;
-
-	if (p_ht->p_newest != NULL) {
-		p_ht->p_newest->p_newer = p_entry;
-	}
-
-	p_ht->p_newest = p_entry;
+	list_append(p_ht, p_entry);
 
-	return 0;
+	/* Linked entries rest at refCount 0 whichever way they were linked,
+	 * so that the lockless functions can remove this one as well */
+	ght_atomic_add_int(&p_entry->refCount, -2);
 }
 
 /* Get an entry from the hash table. The entry is returned, or NULL if it wasn't found */
@@ -690,35 +1430,110 @@ void *lockless_ght_get(ght_hash_table_t *p_ht, unsigned int i_key_size, const vo
 	ght_hash_entry_t *p_e;
 	ght_hash_key_t key;
 	ght_uint32_t l_key;
+	ght_uint32_t l_hash;
+	lookup_cache_slot_t *p_slot = NULL;
+	unsigned int i_version = 0;
+	void *p_data;
 
 	assert(p_ht);
 
+	if (p_ht->p_version && i_key_size <= GHT_LOOKUP_CACHE_KEY_MAX) {
+		p_slot = lookup_cache_slot(p_ht, i_key_size, p_key_data);
+		if (lookup_cache_hit(p_ht, p_slot, i_key_size, p_key_data, &p_data))
+			return p_data;
+	}
+
 	hk_fill(&key, i_key_size, p_key_data);
 
-	l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
+	l_hash = get_hash_value(p_ht, &key);
+	if (!filter_check(p_ht, l_hash))
+		return NULL;
+	l_key = l_hash & p_ht->i_size_mask;
 
 	/* Check that the first element in the list really is the first. */
 	assert(p_ht->pp_entries[l_key]?p_ht->pp_entries[l_key]->p_prev == NULL:1);
 
+	if (p_slot)
+		i_version = __atomic_load_n(&p_ht->p_version[l_key], __ATOMIC_ACQUIRE);
+
 	p_e = lockless_search_in_bucket(p_ht, l_key, &key, p_ht->i_heuristics);
+	p_data = NULL;
 	if(p_e) {
+		p_data = p_e->p_data;
 		FAA(&p_e->refCount, -2);
 		EVENTS('K', p_e);
 	}
+	else
+		filter_missed(p_ht);
+	if (p_slot)
+		lookup_cache_fill(p_ht, p_slot, l_key, i_version, i_key_size, p_key_data, p_data);
+
+	return p_data;
+}
+
+/* Get an entry from the hash table and keep the reference on it in p_pin */
+void *lockless_ght_get_pinned(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_key_data, lockless_ght_pin_t *p_pin) {
+	ght_hash_entry_t *p_e;
+	ght_hash_key_t key;
+	ght_uint32_t l_key;
+	ght_uint32_t l_hash;
+
+	assert(p_ht && p_pin);
+
+	hk_fill(&key, i_key_size, p_key_data);
+
+	l_hash = get_hash_value(p_ht, &key);
+	if (!filter_check(p_ht, l_hash)) {
+		p_pin->p_entry = NULL;
+		return NULL;
+	}
+	l_key = l_hash & p_ht->i_size_mask;
+
+	/* The reference taken by the search is handed over to the pin */
+	p_e = lockless_search_in_bucket(p_ht, l_key, &key, p_ht->i_heuristics);
+	p_pin->p_entry = p_e;
+	if(p_e)
+		EVENTS('P', p_e);
+	else
+		filter_missed(p_ht);
+
 	return (p_e ? p_e->p_data : NULL);
 }
 
+/* Drop the reference held by a pin */
+void lockless_ght_unpin(ght_hash_table_t *p_ht, lockless_ght_pin_t *p_pin) {
+	assert(p_ht && p_pin);
+
+	if(p_pin->p_entry) {
+		EVENTS('p', p_pin->p_entry);
+		ght_atomic_add_int(&p_pin->p_entry->refCount, -2);
+		p_pin->p_entry = NULL;
+	}
+}
+
 /* Get an entry from the hash table. The entry is returned, or NULL if it wasn't found */
 void *ght_get(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_key_data) {
 	ght_hash_entry_t *p_e;
 	ght_hash_key_t key;
 	ght_uint32_t l_key;
+	ght_uint32_t l_hash;
+	lookup_cache_slot_t *p_slot = NULL;
+	void *p_data;
 
 	assert(p_ht);
 
+	if (p_ht->p_version && i_key_size <= GHT_LOOKUP_CACHE_KEY_MAX) {
+		p_slot = lookup_cache_slot(p_ht, i_key_size, p_key_data);
+		if (lookup_cache_hit(p_ht, p_slot, i_key_size, p_key_data, &p_data))
+			return p_data;
+	}
+
 	hk_fill(&key, i_key_size, p_key_data);
 
-	l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
+	l_hash = get_hash_value(p_ht, &key);
+	if (!filter_check(p_ht, l_hash))
+		return NULL;
+	l_key = l_hash & p_ht->i_size_mask;
 
 	/* Check that the first element in the list really is the first. */
 	assert(p_ht->pp_entries[l_key]?p_ht->pp_entries[l_key]->p_prev == NULL:1);
@@ -727,7 +1542,13 @@ void *ght_get(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_key
 	p_e = search_in_bucket(p_ht, l_key, &key, p_ht->i_heuristics);
 	/* UNLOCK: p_ht->pp_entries[l_key] */
 
-	return (p_e ? p_e->p_data : NULL);
+	if (!p_e)
+		filter_missed(p_ht);
+	p_data = (p_e ? p_e->p_data : NULL);
+	if (p_slot)
+		lookup_cache_fill(p_ht, p_slot, l_key, p_ht->p_version[l_key], i_key_size, p_key_data, p_data);
+
+	return p_data;
 }
 
 /* Replace an entry from the hash table. The entry is returned, or NULL if it wasn't found */
@@ -755,94 +1576,346 @@ void *ght_replace(ght_hash_table_t *p_ht, void *p_entry_data, unsigned int i_key
 
 	p_old = p_e->p_data;
 	p_e->p_data = p_entry_data;
+	bucket_modified(p_ht, l_key);
 
 	return p_old;
 }
 
+/* Stamp the pinned entry p_e as removed. Returns FALSE if somebody
+ * else has removed it already. */
+static inline int claim_entry(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_entry_t *p_e) {
+	if (!ght_atomic_cas_uint(&p_e->i_death, EPOCH_LIVE, EPOCH_PENDING))
+		return FALSE;
+
+	/* A snapshot opened from now on gets an epoch >= the stamp */
+	__atomic_store_n(&p_e->i_death, __atomic_load_n(&p_ht->i_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	bucket_modified(p_ht, l_bucket);
+	return TRUE;
+}
+
+/* TRUE if a removed entry may be unlinked, i.e. no snapshot can see it */
+static inline int may_unlink(ght_hash_table_t *p_ht) {
+	return __atomic_load_n(&p_ht->i_snapshots, __ATOMIC_SEQ_CST) == 0;
+}
+
+/* Tell the snapshots that a removed entry was left linked for them to
+ * purge. Returns FALSE if the last snapshot closed meanwhile, possibly
+ * without seeing this, so the caller must unlink the entry itself. */
+static inline int defer_removal(ght_hash_table_t *p_ht) {
+	FAA(&p_ht->i_deferred, 1);
+	return !may_unlink(p_ht);
+}
+
+/* Drop our pin on an entry which is left linked after being removed,
+ * once the other threads that found it before the removal are done */
+static inline void release_removed_entry(ght_hash_entry_t *p_e) {
+	while (__atomic_load_n(&p_e->refCount, __ATOMIC_ACQUIRE) != 2)
+		ght_cpu_relax();
+	ght_atomic_add_int(&p_e->refCount, -2);
+}
+
+/* Unlink the pinned and removed entry p_out from bucket l_key and free
+ * it. If b_wait is FALSE, give up and return FALSE instead of waiting
+ * when a neighbour is busy. */
+static int unlink_entry(ght_hash_table_t *p_ht, ght_uint32_t l_key, ght_hash_entry_t *p_out, int b_wait) {
+	ght_hash_entry_t *p_unext = NULL;
+	ght_hash_entry_t *p_uprev = NULL;
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
+
+	fail_del:
+	EVENTS('a', p_out);
+	if (!Mark_delete(&(p_out->p_next))) {
+		if (!b_wait)
+			return FALSE;
+		p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+		goto fail_del;
+	}
+	EVENTS('b', p_out);
+	p_unext = ght_ptr_unmark(ght_atomic_load_ptr(&p_out->p_next));
+
+	if(!Mark_delete(&(p_out->p_prev))) {
+		while(!Unmark_delete( &(p_out->p_next)))
+			p_ht->fn_backoff(&backoff, NULL);
+		wake_bucket(p_ht, l_key);
+		if (!b_wait)
+			return FALSE;
+		p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+		goto fail_del;
+	}
+	p_uprev = ght_ptr_unmark(ght_atomic_load_ptr(&p_out->p_prev));
+	EVENTS('c', p_out);
+	if (p_uprev != NULL) {
+		EVENTS('d', p_out);
+		if (!CAS1(&(p_uprev->p_next), &p_out, &p_unext)) {
+			EVENTS('e', p_out);
+			while(!Unmark_delete(&(p_out->p_prev)))
+				p_ht->fn_backoff(&backoff, NULL);
+			while(!Unmark_delete(&(p_out->p_next)))
+				p_ht->fn_backoff(&backoff, NULL);
+			wake_bucket(p_ht, l_key);
+			if (!b_wait)
+				return FALSE;
+			p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+			goto fail_del;
+		}
+	} else {
+		EVENTS('f', p_out);
+		if (!CAS1(&(p_ht->pp_entries[l_key]), &p_out, &p_unext)) {
+			EVENTS('g', p_out);
+			while(!Unmark_delete(&(p_out->p_prev)))
+				p_ht->fn_backoff(&backoff, NULL);
+			while(!Unmark_delete(&(p_out->p_next)))
+				p_ht->fn_backoff(&backoff, NULL);
+			wake_bucket(p_ht, l_key);
+			if (!b_wait)
+				return FALSE;
+			p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+			goto fail_del;
+		}
+	}
+
+	fail_nxt_rem: if (p_unext != NULL) {
+		EVENTS('h', p_out);
+		if (!CAS1( &(p_unext->p_prev), &p_out, &p_uprev) ) {
+			p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+			goto fail_nxt_rem;
+		}
+	}
+
+#if !defined(NDEBUG)
+	/* Keep the delete mark, a snapshot standing on the entry relies on it */
+	p_out->p_next = (ght_hash_entry_t *) GHT_MARK_DELETE;
+	p_out->p_prev = NULL;
+#endif /* NDEBUG */
+
+	FAA(&(p_ht->p_nr[l_key]), -1);
+	occupied_clear(p_ht, l_key);
+	p_out->p_older = p_uprev;
+	p_out->p_newer = p_unext;
+	EVENTS('R', p_out);
+	wake_bucket(p_ht, l_key);
+	he_finalize(p_ht, p_out);
+
+	return TRUE;
+}
+
 void *lockless_ght_remove(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_key_data) {
 	ght_hash_entry_t *p_out;
 	ght_hash_key_t key;
 	ght_uint32_t l_key;
 	void *p_ret = NULL;
-	ght_hash_entry_t *p_unext = NULL;
-	ght_hash_entry_t *p_uprev = NULL;
+	ght_uint32_t l_hash;
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
+	int b_moving;
 
 	assert(p_ht);
 
 	hk_fill(&key, i_key_size, p_key_data);
-	l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
+	l_hash = get_hash_value(p_ht, &key);
+	if (!filter_check(p_ht, l_hash))
+		return NULL;
+	l_key = l_hash & p_ht->i_size_mask;
 
 	/* Check that the first element really is the first */
 	assert((p_ht->pp_entries[l_key]?p_ht->pp_entries[l_key]->p_prev == NULL : 1));
 
 	fail_del: p_out = lockless_search_in_bucket(p_ht, l_key, &key, 0);
 	if (p_out && p_out->p_data != NULL) {
-		EVENTS('a', p_out);
-		if (!Mark_delete(&(p_out->p_next))) {
-			FAA(&p_out->refCount, -2);
-			goto fail_del;
-		}
-		EVENTS('b', p_out);
-		p_unext = p_out->p_next;
-		while(!UnMark( &p_unext ));
-		
-		if(!Mark_delete(&(p_out->p_prev))) {
-			FAA(&p_out->refCount, -2);
-			while(!Unmark_delete( &(p_out->p_next)));
+		if (!claim_entry(p_ht, l_key, p_out)) {
+			/* Removed by somebody else, look for a newer entry. An
+			 * entry being moved is replaced by its copy shortly. */
+			b_moving = __atomic_load_n(&p_out->i_death, __ATOMIC_ACQUIRE) == EPOCH_MOVING;
+			ght_atomic_add_int(&p_out->refCount, -2);
+			if (b_moving)
+				p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
 			goto fail_del;
 		}
-		p_uprev = p_out->p_prev;
-		while(!UnMark( &p_uprev ));
-		EVENTS('c', p_out);
-		if (p_uprev != NULL) {
-			EVENTS('d', p_out);
-			if (!CAS1(&(p_uprev->p_next), &p_out, &p_unext)) {
-				EVENTS('e', p_out);
-				FAA(&p_out->refCount, -2);
-				while(!Unmark_delete(&(p_out->p_prev)));
-				while(!Unmark_delete(&(p_out->p_next)));
-				goto fail_del;
-			}
-		} else {
-			EVENTS('f', p_out);
-			if (!CAS1(&(p_ht->pp_entries[l_key]), &p_out, &p_unext)) {
-				EVENTS('g', p_out);
-				FAA(&p_out->refCount, -2);
-				while(!Unmark_delete(&(p_out->p_prev)));
-				while(!Unmark_delete(&(p_out->p_next)));
-				goto fail_del;
-			}
-		}
+		filter_remove(p_ht, l_hash);
+		list_release(p_ht, p_out);
+		FAA(&(p_ht->i_items), -1);
+		p_ret = p_out->p_data;
 
-		fail_nxt_rem: if (p_unext != NULL) {
-			EVENTS('h', p_out);
-			if (!CAS1( &(p_unext->p_prev), &p_out, &p_uprev) ) {
-				goto fail_nxt_rem;
-			}
-		}
-		
-#if !defined(NDEBUG)
-		p_out->p_next = NULL;
-		p_out->p_prev = NULL;
-#endif /* NDEBUG */
+		/* Leave it to the snapshots if there are any */
+		if (may_unlink(p_ht) || !defer_removal(p_ht))
+			unlink_entry(p_ht, l_key, p_out, TRUE);
+		else
+			release_removed_entry(p_out);
+	}
+	else {
+		if (p_out)
+			ght_atomic_add_int(&p_out->refCount, -2);
+		filter_missed(p_ht);
+	}
 
+	/* Removals which the last purge found busy are retried here, so
+	 * they do not wait for another snapshot */
+	purge_deferred(p_ht);
 
-		FAA(&(p_ht->i_items), -1);
+	return p_ret;
+}
 
-		FAA(&(p_ht->p_nr[l_key]), -1);
-		p_ret = p_out->p_data;
-//		p_out->p_data = NULL;
-//		p_out->p_prev = 0x1;
-//		p_out->p_next = 0x1;
-		p_out->p_older = p_uprev;
-		p_out->p_newer = p_unext;
-		EVENTS('R', p_out);
-		he_finalize(p_ht, p_out);
+/* Entries moved by ght_compact() between two pauses */
+#define COMPACT_BATCH 64
+
+/* The memory_mng pool the entries of the table come from, or NULL */
+static LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *entry_pool(ght_hash_table_t *p_ht) {
+	if (p_ht->p_arena || p_ht->allocator.fn_alloc != lockless_memory_allocator.fn_alloc)
+		return NULL;
+	return (LOCKLESS_STATIC_BUCKET_HASHTABLE_ST*) p_ht->p_alloc_ctx;
+}
+
+
+/*
+ * Replace the pinned entry p_e of bucket l_key by a copy at p_dst and
+ * free p_e. The copy is linked at the head of the bucket before p_e is
+ * unlinked, so lookups find one or the other all the time. Both are
+ * stamped EPOCH_MOVING meanwhile, which keeps removers off them until
+ * the copy is live. Returns FALSE if p_e was removed before.
+ */
+static int move_entry(ght_hash_table_t *p_ht, ght_uint32_t l_key, ght_hash_entry_t *p_e, ght_hash_entry_t *p_dst) {
+	ght_hash_entry_t *p_unext;
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
+
+	if (!ght_atomic_cas_uint(&p_e->i_death, EPOCH_LIVE, EPOCH_MOVING))
+		return FALSE;
+
+	memcpy(p_dst, p_e, ENTRY_SIZE(p_e->key.i_size));
+	p_dst->key.p_key = (void*) (p_dst + 1);
+	p_dst->p_prev = NULL;
+	p_dst->refCount = 2;
+
+	/* The copy takes the place of p_e on the insertion list. Nobody
+	 * else takes p_e off it, it cannot be claimed while it moves. */
+	if (p_e->b_listed) {
+		list_lock(p_ht);
+		p_dst->p_older = p_e->p_older;
+		p_dst->p_newer = p_e->p_newer;
+		if (p_dst->p_older)
+			p_dst->p_older->p_newer = p_dst;
+		else
+			p_ht->p_oldest = p_dst;
+		if (p_dst->p_newer)
+			p_dst->p_newer->p_older = p_dst;
+		else
+			p_ht->p_newest = p_dst;
+		p_e->b_listed = FALSE;
+		list_unlock(p_ht);
+	}
+	else {
+		p_dst->p_older = NULL;
+		p_dst->p_newer = NULL;
 	}
-	else if( p_out && p_out->p_data == NULL )
-		FAA(&p_out->refCount, -2);
 
-	return p_ret;
+	/* Link the copy like lockless_ght_insert() does */
+	fail_link:
+	p_unext = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[l_key]));
+	p_dst->p_next = (ght_hash_entry_t *) ((uintptr_t) p_unext | GHT_MARK_DELETE);
+	if (!CAS1(&p_ht->pp_entries[l_key], &p_unext, &p_dst)) {
+		p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+		goto fail_link;
+	}
+	fail_prev:
+	if (p_unext != NULL && !CAS2(&p_unext->p_prev, NULL, &p_dst)) {
+		p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+		goto fail_prev;
+	}
+	Unmark_delete(&p_dst->p_next);
+	ght_atomic_add_int(&p_dst->refCount, -2);
+	FAA(&(p_ht->p_nr[l_key]), 1);
+
+	/* Waits for the readers of p_e, then frees it */
+	unlink_entry(p_ht, l_key, p_e, TRUE);
+
+	__atomic_store_n(&p_dst->i_death, EPOCH_LIVE, __ATOMIC_RELEASE);
+	bucket_modified(p_ht, l_key);
+	wake_bucket(p_ht, l_key);
+
+	return TRUE;
+}
+
+/* Move the entry in slot i_index of the pool to a lower slot if it is
+ * linked in the table. Returns 1 if it was moved, 0 if not and -1 if
+ * there is no lower slot free. */
+static int compact_slot(ght_hash_table_t *p_ht, LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *p_pool, int *p_cursor, int i_index) {
+	ght_hash_entry_t *p_e = (ght_hash_entry_t*) lockless_memory_slot(p_pool, i_index);
+	ght_hash_entry_t *p_found;
+	ght_hash_key_t key;
+	ght_uint32_t l_key;
+	int i_dst;
+
+	/* The slot may be free or half written, only an entry which the
+	 * table leads us back to is moved */
+	key.i_size = __atomic_load_n(&p_e->key.i_size, __ATOMIC_ACQUIRE);
+	if (key.i_size > (unsigned int) p_pool->key_size || p_e->key.p_key != (void*) (p_e + 1))
+		return 0;
+	key.p_key = p_e + 1;
+	l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
+
+	if (!(p_found = lockless_search_in_bucket(p_ht, l_key, &key, 0)))
+		return 0;
+	if (p_found != p_e || p_e->p_data == NULL) {
+		ght_atomic_add_int(&p_found->refCount, -2);
+		return 0;
+	}
+
+	if ((i_dst = lockless_alloc_memory_below(p_pool, p_cursor, i_index)) < 0) {
+		ght_atomic_add_int(&p_e->refCount, -2);
+		return -1;
+	}
+	if (!move_entry(p_ht, l_key, p_e, (ght_hash_entry_t*) lockless_memory_slot(p_pool, i_dst))) {
+		ght_atomic_add_int(&p_e->refCount, -2);
+		lockless_dealloc_memory(p_pool, i_dst);
+		return 0;
+	}
+	return 1;
+}
+
+/* Move the entries of a pool table to its lowest slots and release the
+ * memory of the slots left free */
+int ght_compact(ght_hash_table_t *p_ht, unsigned int i_max_moves, unsigned int i_pause_us) {
+	LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *p_pool;
+	u_int64_t used;
+	int i_cursor = 0;
+	unsigned int i_moved = 0;
+	int i_word;
+	int i_ret = 0;
+
+	assert(p_ht);
+
+	if (!(p_pool = entry_pool(p_ht)))
+		return -1;
+
+	/* The slots cached by the threads would look allocated */
+	lockless_flush_memory(p_pool);
+
+	/* Empty the highest words into the holes of the lowest ones */
+	for (i_word = lockless_memory_words(p_pool) - 1; i_word > i_cursor && i_ret >= 0; i_word--) {
+		for (used = lockless_memory_used(p_pool, i_word); used && i_ret >= 0; used &= used - 1) {
+			if (i_moved >= i_max_moves) {
+				i_ret = -1;
+				break;
+			}
+			/* A snapshot would see an entry and its copy. Either the
+			 * snapshot sees the move announced and waits for it, or
+			 * we see the snapshot and stop. */
+			__atomic_fetch_add(&p_ht->i_moving, 1, __ATOMIC_SEQ_CST);
+			if (!may_unlink(p_ht)) {
+				__atomic_fetch_sub(&p_ht->i_moving, 1, __ATOMIC_SEQ_CST);
+				i_ret = -1;
+				break;
+			}
+			i_ret = compact_slot(p_ht, p_pool, &i_cursor, i_word * 64 + __builtin_ctzll(used));
+			__atomic_fetch_sub(&p_ht->i_moving, 1, __ATOMIC_SEQ_CST);
+			if (i_ret > 0) {
+				if (++i_moved % COMPACT_BATCH == 0 && i_pause_us > 0)
+					usleep(i_pause_us);
+			}
+		}
+	}
+
+	purge_deferred(p_ht);
+	lockless_trim_memory(p_pool);
+	return i_moved;
 }
 
 /* Remove an entry from the hash table. The removed entry, or NULL, is
@@ -852,11 +1925,15 @@ void *ght_remove(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_
 	ght_hash_key_t key;
 	ght_uint32_t l_key;
 	void *p_ret = NULL;
+	ght_uint32_t l_hash;
 
 	assert(p_ht);
 
 	hk_fill(&key, i_key_size, p_key_data);
-	l_key = get_hash_value(p_ht, &key) & p_ht->i_size_mask;
+	l_hash = get_hash_value(p_ht, &key);
+	if (!filter_check(p_ht, l_hash))
+		return NULL;
+	l_key = l_hash & p_ht->i_size_mask;
 
 	/* Check that the first element really is the first */
 	assert((p_ht->pp_entries[l_key]?p_ht->pp_entries[l_key]->p_prev == NULL:1));
@@ -867,11 +1944,14 @@ void *ght_remove(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_
 	/* Link p_out out of the list. */
 	if (p_out) {
 		remove_from_chain(p_ht, l_key, p_out);
+		filter_remove(p_ht, l_hash);
 
 		/* This should ONLY be done for normal items (for now all items) */
 		p_ht->i_items--;
 
 		p_ht->p_nr[l_key]--;
+		occupied_clear(p_ht, l_key);
+		bucket_modified(p_ht, l_key);
 		/* UNLOCK: p_ht->pp_entries[l_key] */
 #if !defined(NDEBUG)
 		p_out->p_next = NULL;
@@ -879,9 +1959,11 @@ void *ght_remove(ght_hash_table_t *p_ht, unsigned int i_key_size, const void *p_
 #endif /* NDEBUG */
 
 		p_ret = p_out->p_data;
+		ght_atomic_add_int(&p_out->refCount, 2);
 		he_finalize(p_ht, p_out);
 	}
-	/* else: UNLOCK: p_ht->pp_entries[l_key] */
+	else /* UNLOCK: p_ht->pp_entries[l_key] */
+		filter_missed(p_ht);
 
 	return p_ret;
 }
@@ -957,63 +2039,26 @@ void *ght_next_keysize(ght_hash_table_t *p_ht, ght_iterator_t *p_iterator, const
 /*
  * this function try to mark an entry on the bucket which its head has been iteration_mark!
  */
-void *get_next_entry(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, ght_hash_entry_t *start_entry) {
+void *get_next_entry(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, ght_uint32_t l_bucket, ght_hash_entry_t *start_entry) {
 	ght_hash_entry_t *p_utemp = NULL;
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
 	
-	p_utemp = start_entry;
-	UnMark( &p_utemp );
+	p_utemp = ght_ptr_unmark(start_entry);
 	if(p_utemp) {
 		switch(p_iterator->type)
 		{
 			case HASH_ITERATOR_WAIT:
 				while(p_utemp && !Mark_iteration( &(p_utemp->p_next) )) {
-					usleep(1);
-					p_utemp = p_iterator->p_next;
-					UnMark( &p_utemp );					
-				}
-				return p_utemp;
-			break;
-
-			case HASH_ITERATOR_SKIP_ENTRY:
-				while(p_utemp && !Mark_iteration( &(p_utemp->p_next) ))
-				{
-					p_utemp = p_utemp->p_next;
-					UnMark( &p_utemp );
-					p_iterator->jumpCounter++;
+					p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_bucket]);
+					p_utemp = ght_ptr_unmark(p_iterator->p_next);
 				}
 				return p_utemp;
 			break;
 
-			default:
-				if(Mark_iteration( &(p_utemp->p_next) ))
-					return p_utemp;
-				else
-					return NULL;
-			break;
-		}
-	}
-	return NULL;
-}
-
-void *get_next_entry2(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, ght_hash_entry_t *start_entry) {
-	ght_hash_entry_t *p_utemp = NULL;
-	
-	p_utemp = start_entry;
-	UnMark( &p_utemp );
-	if(p_utemp) {
-		switch(p_iterator->type)
-		{
-			case HASH_ITERATOR_WAIT:
-				while(p_utemp && !Mark_iteration( &(p_utemp->p_next) ))
-					usleep(1);
-				return p_utemp;
-			break;
-
 			case HASH_ITERATOR_SKIP_ENTRY:
 				while(p_utemp && !Mark_iteration( &(p_utemp->p_next) ))
 				{
-					p_utemp = p_utemp->p_next;
-					UnMark( &p_utemp );
+					p_utemp = ght_ptr_unmark(ght_atomic_load_ptr(&p_utemp->p_next));
 					p_iterator->jumpCounter++;
 				}
 				return p_utemp;
@@ -1055,23 +2100,23 @@ static void *lockless_first_keysize(ght_hash_table_t *p_ht, lockless_ght_iterato
 	ght_hash_entry_t *p_uentry = NULL;
 	
 	int i = 0;
-	for(i = 0; i < p_ht->i_size && !p_uentry; i++)
+	for(i = next_occupied_bucket(p_ht, 0); i < p_ht->i_size && !p_uentry; i = next_occupied_bucket(p_ht, i + 1))
 	{
-		p_uhead = p_ht->pp_entries[i];
-		UnMark( &p_uhead );
+		p_uhead = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[i]));
 		if(p_uhead == NULL)
 			continue;
 		if( Mark_iteration( &(p_ht->pp_entries[i]) ))
 		{
-			p_uentry = get_next_entry(p_ht, p_iterator, p_ht->pp_entries[i]);
+			p_uentry = get_next_entry(p_ht, p_iterator, i, p_ht->pp_entries[i]);
 			if( p_uentry ) {
 				lockless_set_iterator(p_ht, p_iterator, p_uentry, i, p_key, size);
 			}
 			UnMark_iteration( &(p_ht->pp_entries[i]) );
+			wake_bucket(p_ht, i);
 		}
 		else
 		{	
-			p_uentry = get_next_entry(p_ht, p_iterator, p_ht->pp_entries[i]);
+			p_uentry = get_next_entry(p_ht, p_iterator, i, p_ht->pp_entries[i]);
 			if(p_uentry)
 				lockless_set_iterator(p_ht, p_iterator, p_uentry, i, p_key, size);
 		}
@@ -1090,11 +2135,11 @@ static void *lockless_first_keysize(ght_hash_table_t *p_ht, lockless_ght_iterato
 }
 
 void *lockless_ght_first(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, const void **p_key) {
-	return lockless_first_keysize(p_ht, p_iterator, p_key, NULL);
+	return lockless_skip_removed(p_ht, p_iterator, lockless_first_keysize(p_ht, p_iterator, p_key, NULL), p_key, NULL);
 }
 
 void *lockless_ght_first_keysize(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, const void **p_key, unsigned int *size) {
-	return lockless_first_keysize(p_ht, p_iterator, p_key, size);
+	return lockless_skip_removed(p_ht, p_iterator, lockless_first_keysize(p_ht, p_iterator, p_key, size), p_key, size);
 }
 
 static void *lockless_next_keysize(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, const void **p_key, unsigned int *size) {
@@ -1106,36 +2151,39 @@ static void *lockless_next_keysize(ght_hash_table_t *p_ht, lockless_ght_iterator
 	int i = 0;
 
 	if (p_iterator->was_forwarded_by_delete == 'n') {
-		p_uentry = get_next_entry(p_ht, p_iterator, p_iterator->p_next);
+		p_uentry = get_next_entry(p_ht, p_iterator, p_iterator->next_ibucket - 1, p_iterator->p_next);
 		if(p_uentry)
 		{
 			UnMark_iteration( &(p_iterator->p_entry->p_next) );
+			wake_bucket(p_ht, p_iterator->next_ibucket - 1);
 			lockless_set_iterator(p_ht, p_iterator, p_uentry, p_iterator->next_ibucket - 1, p_key, size);
 		}
 		else
 		{
-			for (i = p_iterator->next_ibucket; i < p_ht->i_size && !p_uentry; i++)
+			for (i = next_occupied_bucket(p_ht, p_iterator->next_ibucket); i < p_ht->i_size && !p_uentry; i = next_occupied_bucket(p_ht, i + 1))
 			{
-				p_uhead = p_ht->pp_entries[i];
-				UnMark( &p_uhead );
+				p_uhead = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[i]));
 				if(p_uhead == NULL)
 					continue;
 
 				if(Mark_iteration( &(p_ht->pp_entries[i] )))
 				{
-					p_uentry = get_next_entry(p_ht, p_iterator, p_ht->pp_entries[i]);
+					p_uentry = get_next_entry(p_ht, p_iterator, i, p_ht->pp_entries[i]);
 					if(p_uentry)
 					{
 						UnMark_iteration( &(p_iterator->p_entry->p_next) );
+						wake_bucket(p_ht, p_iterator->next_ibucket - 1);
 						lockless_set_iterator(p_ht, p_iterator, p_uentry, i, p_key, size);
 					}
 					UnMark( &(p_ht->pp_entries[i]) );
+					wake_bucket(p_ht, i);
 				}
 				else
 				{
-					p_uentry = get_next_entry(p_ht, p_iterator, p_ht->pp_entries[i]);
+					p_uentry = get_next_entry(p_ht, p_iterator, i, p_ht->pp_entries[i]);
 					if(p_uentry){
 						UnMark_iteration( &(p_iterator->p_entry->p_next) );
+						wake_bucket(p_ht, p_iterator->next_ibucket - 1);
 						lockless_set_iterator(p_ht, p_iterator, p_uentry, i, p_key, size);
 					}
 				}
@@ -1146,6 +2194,7 @@ static void *lockless_next_keysize(ght_hash_table_t *p_ht, lockless_ght_iterator
 			return p_iterator->p_entry->p_data;
 		}
 		UnMark_iteration( &(p_iterator->p_entry->p_next) );
+		wake_bucket(p_ht, p_iterator->next_ibucket - 1);
 		p_iterator->p_entry = NULL;
 		p_iterator->p_next = NULL;
 		p_iterator->next_ibucket = i;
@@ -1161,12 +2210,20 @@ static void *lockless_next_keysize(ght_hash_table_t *p_ht, lockless_ght_iterator
 	return NULL;
 }
 
+/* Step over the entries which have been removed while a snapshot was
+ * open and are still linked */
+static void *lockless_skip_removed(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, void *p_data, const void **p_key, unsigned int *size) {
+	while (p_data && !EPOCH_VISIBLE(__atomic_load_n(&p_iterator->p_entry->i_death, __ATOMIC_ACQUIRE)))
+		p_data = lockless_next_keysize(p_ht, p_iterator, p_key, size);
+	return p_data;
+}
+
 void *lockless_ght_next(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, const void **pp_key) {
-	return lockless_next_keysize(p_ht, p_iterator, pp_key, NULL);
+	return lockless_skip_removed(p_ht, p_iterator, lockless_next_keysize(p_ht, p_iterator, pp_key, NULL), pp_key, NULL);
 }
 
 void *lockless_ght_next_keysize(ght_hash_table_t *p_ht, lockless_ght_iterator_t *p_iterator, const void **pp_key, unsigned int *size) {
-	return lockless_next_keysize(p_ht, p_iterator, pp_key, size);
+	return lockless_skip_removed(p_ht, p_iterator, lockless_next_keysize(p_ht, p_iterator, pp_key, size), pp_key, size);
 }
 
 /*
@@ -1180,39 +2237,64 @@ void *lockless_ght_iterator_remove(ght_hash_table_t *p_ht, lockless_ght_iterator
 
  	ght_hash_entry_t *p_unext = NULL;
  	ght_hash_entry_t *p_uprev = NULL;
+ 	ght_backoff_t backoff = GHT_BACKOFF_INIT;
+ 	int b_claimed;
+ 	int b_unlink;
+ 	ght_uint32_t l_hash;
 
  	assert(p_ht);
 
  	//hk_fill(&key, i_key_size, p_key_data);
- 	l_key = get_hash_value(p_ht, &p_iterator->p_entry->key) & p_ht->i_size_mask;
+ 	l_hash = get_hash_value(p_ht, &p_iterator->p_entry->key);
+ 	l_key = l_hash & p_ht->i_size_mask;
  	/* Check that the first element really is the first */
  	assert((p_ht->pp_entries[l_key]?p_ht->pp_entries[l_key]->p_prev == NULL:1));
 	
- 	Force_Mark_Delete( &(p_iterator->p_entry->p_next) );
- 	EVENTS('z', p_iterator->p_entry);
-
  	p_del = p_iterator->p_entry;
+ 	b_claimed = claim_entry(p_ht, l_key, p_del);
+ 	if (b_claimed) {
+ 		filter_remove(p_ht, l_hash);
+ 		list_release(p_ht, p_del);
+ 	}
+ 	b_unlink = b_claimed && (may_unlink(p_ht) || !defer_removal(p_ht));
+ 	p_ret = p_del->p_data;
+
+ 	/* While snapshots are open the entry stays linked */
+ 	if (b_unlink) {
+ 		Force_Mark_Delete( &(p_del->p_next) );
+ 		EVENTS('z', p_del);
+ 	}
 
  	p_iterator->was_forwarded_by_delete = 'n';
  	lockless_ght_next(p_ht, p_iterator, p_key);
  	p_iterator->was_forwarded_by_delete = 'y';
  	EVENTS('y', p_del);
+
+ 	if (!b_unlink) {
+ 		if (!b_claimed)
+ 			return NULL;
+ 		FAA(&(p_ht->i_items), -1);
+ 		return p_ret;
+ 	}
+ 	p_ret = NULL;
  	
  	fail_iterator_remove:
  	if (p_del && p_del->p_data != NULL ) {
 
-		p_unext = p_del->p_next;
- 		UnMark( &p_unext );
+		p_unext = ght_ptr_unmark(ght_atomic_load_ptr(&p_del->p_next));
 
- 		while( !Mark_delete( &(p_del->p_prev) ) );
- 		p_uprev = p_del->p_prev;
- 		UnMark( &p_uprev );
+ 		while( !Mark_delete( &(p_del->p_prev) ) )
+ 			p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
+ 		p_uprev = ght_ptr_unmark(ght_atomic_load_ptr(&p_del->p_prev));
  		EVENTS('x', p_del);
  		if (p_uprev != NULL) {
  			EVENTS('w', p_del);
  			if (!CAS1(&(p_uprev->p_next), &p_del, &p_unext)) {
  				EVENTS('v', p_del);
- 				while(!UnMark( &(p_del->p_prev) ));
+ 				while(!UnMark( &(p_del->p_prev) ))
+ 					p_ht->fn_backoff(&backoff, NULL);
+ 				wake_bucket(p_ht, l_key);
+ 				p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
  				goto fail_iterator_remove;
  			}
  		}
@@ -1222,7 +2304,10 @@ void *lockless_ght_iterator_remove(ght_hash_table_t *p_ht, lockless_ght_iterator
 
  			if (!CAS1(&(p_ht->pp_entries[l_key]), &p_del, &p_unext)) {
  				EVENTS('t', p_del);
- 				while( !UnMark( &(p_del->p_prev) ) );
+ 				while( !UnMark( &(p_del->p_prev) ) )
+ 					p_ht->fn_backoff(&backoff, NULL);
+ 				wake_bucket(p_ht, l_key);
+ 				p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
  				goto fail_iterator_remove;
  			}
  		}
@@ -1231,23 +2316,26 @@ void *lockless_ght_iterator_remove(ght_hash_table_t *p_ht, lockless_ght_iterator
  		if (p_unext != NULL) {
  			EVENTS('s', p_del);
 			if (!CAS1(&(p_unext->p_prev), &p_del, &(p_uprev))) {
+ 				p_ht->fn_backoff(&backoff, &p_ht->pp_entries[l_key]);
  				goto fail_nxt_iter;
  			}
  		}
 
  #if !defined(NDEBUG)
- 		p_del->p_next = NULL;
+ 		p_del->p_next = (ght_hash_entry_t *) GHT_MARK_DELETE;
  		p_del->p_prev = NULL;
  #endif /* NDEBUG */
  		FAA(&(p_ht->i_items), -1);
 
  		FAA(&(p_ht->p_nr[l_key]), -1);
+ 		occupied_clear(p_ht, l_key);
  		p_ret = p_del->p_data;
 // 		p_del->p_data = NULL;
 // 		p_del->p_prev = 0x1;
 // 		p_del->p_next = 0x1;
  		FAA(&(p_del->refCount), 2);
  		EVENTS('T', p_del);
+ 		wake_bucket(p_ht, l_key);
  		he_finalize(p_ht, p_del);
 
  	}
@@ -1327,73 +2415,1123 @@ void *lockless_ght_iterator_remove(ght_hash_table_t *p_ht, lockless_ght_iterator
 	return p_ret;*/
 }
 
-/* Finalize (free) a hash table */
-void ght_finalize(ght_hash_table_t *p_ht) {
-	int i;
+/* Visit the entries of the buckets [bucket_begin, bucket_end) */
+unsigned int ght_iter_range(ght_hash_table_t *p_ht, unsigned int bucket_begin, unsigned int bucket_end, ght_fn_iterate_t fn, void *p_ctx) {
+	ght_hash_entry_t *p_e;
+	ght_hash_entry_t *p_next;
+	unsigned int i_visited = 0;
+	unsigned int i;
 
-	assert(p_ht);
+	assert(p_ht && fn);
 
-	if (p_ht->pp_entries) {
-		/* For each bucket, free all entries */
-		for (i = 0; i < p_ht->i_size; i++) {
-			free_entry_chain(p_ht, p_ht->pp_entries[i]);
-			p_ht->pp_entries[i] = NULL;
+	if (bucket_end > p_ht->i_size)
+		bucket_end = p_ht->i_size;
+
+	for (i = next_occupied_bucket(p_ht, bucket_begin); i < bucket_end; i = next_occupied_bucket(p_ht, i + 1)) {
+		for (p_e = p_ht->pp_entries[i]; p_e; p_e = p_next) {
+			p_next = p_e->p_next;
+			i_visited++;
+			if (fn(p_e->p_data, p_e->key.p_key, p_e->key.i_size, p_ctx))
+				return i_visited;
 		}
-		free(p_ht->pp_entries);
-		p_ht->pp_entries = NULL;
-	}
-	if (p_ht->p_nr) {
-		free(p_ht->p_nr);
-		p_ht->p_nr = NULL;
 	}
-
-	free(p_ht);
+	return i_visited;
 }
 
-/* Rehash the hash table (i.e. change its size and reinsert all
- * items). This operation is slow and should not be used frequently.
- */
-void ght_rehash(ght_hash_table_t *p_ht, unsigned int i_size) {
-	ght_hash_table_t *p_tmp;
-	ght_iterator_t iterator;
-	const void *p_key;
-	void *p;
+/* Visit the entries of the buckets [bucket_begin, bucket_end), pinning
+ * each entry the same way as lockless_search_in_bucket() does */
+unsigned int lockless_ght_iter_range(ght_hash_table_t *p_ht, unsigned int bucket_begin, unsigned int bucket_end, ght_fn_iterate_t fn, void *p_ctx) {
+	ght_hash_entry_t *p_e;
+	ght_hash_entry_t *p_next;
+	unsigned int i_visited = 0;
+	unsigned int i;
+	int b_stop = 0;
+	int refcnt;
+
+	assert(p_ht && fn);
+
+	if (bucket_end > p_ht->i_size)
+		bucket_end = p_ht->i_size;
+
+	for (i = next_occupied_bucket(p_ht, bucket_begin); i < bucket_end && !b_stop; i = next_occupied_bucket(p_ht, i + 1)) {
+		p_e = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[i]));
+		while (p_e && !b_stop) {
+			refcnt = __atomic_add_fetch(&p_e->refCount, 2, __ATOMIC_ACQ_REL);
+			p_next = ght_ptr_unmark(ght_atomic_load_ptr(&p_e->p_next));
+
+			if(refcnt % 2 == 0) {
+				if (!Has_Delete_Mark(&(p_e->p_next)) && EPOCH_VISIBLE(p_e->i_death) && p_e->p_data != NULL) {
+					i_visited++;
+					b_stop = fn(p_e->p_data, p_e->key.p_key, p_e->key.i_size, p_ctx);
+				}
+				ght_atomic_add_int(&p_e->refCount, -2);
+			}
+			p_e = p_next;
+		}
+	}
+	return i_visited;
+}
+
+/* The number of buckets in a partition of a parallel iteration is a
+ * multiple of this, so no two threads touch the same cache line of the
+ * bucket array. */
+#define PARTITION_ALIGN         64
+/* The number of partitions per thread, for load balancing */
+#define PARTITIONS_PER_THREAD   4
+
+typedef unsigned int (*iter_range_fn_t)(ght_hash_table_t *p_ht, unsigned int bucket_begin, unsigned int bucket_end, ght_fn_iterate_t fn, void *p_ctx);
+
+typedef struct
+{
+	ght_hash_table_t *p_ht;
+	iter_range_fn_t fn_range;
+	ght_fn_iterate_t fn;
+	void *p_ctx;
+
+	unsigned int i_partition_size;
+	unsigned int i_partitions;
+	unsigned int i_next_partition;
+	unsigned int i_visited;
+	int b_stop;
+} parallel_iteration_t;
+
+/* Forwards to the user callback and stops every thread once one of
+ * the calls asks to stop */
+static int parallel_callback(void *p_data, const void *p_key, unsigned int i_key_size, void *p_ctx) {
+	parallel_iteration_t *p_par = (parallel_iteration_t*) p_ctx;
+
+	if (p_par->fn(p_data, p_key, i_key_size, p_par->p_ctx))
+		__atomic_store_n(&p_par->b_stop, 1, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&p_par->b_stop, __ATOMIC_RELAXED);
+}
+
+static void *parallel_worker(void *p_arg) {
+	parallel_iteration_t *p_par = (parallel_iteration_t*) p_arg;
+	unsigned int i_visited = 0;
+	unsigned int i_partition;
+	unsigned int i_begin;
+
+	while (!__atomic_load_n(&p_par->b_stop, __ATOMIC_RELAXED)) {
+		i_partition = ght_atomic_fetch_add(&p_par->i_next_partition, 1);
+		if (i_partition >= p_par->i_partitions)
+			break;
+
+		i_begin = i_partition * p_par->i_partition_size;
+		i_visited += p_par->fn_range(p_par->p_ht, i_begin, i_begin + p_par->i_partition_size, parallel_callback, p_par);
+	}
+	FAA(&p_par->i_visited, i_visited);
+
+	return NULL;
+}
+
+/* Split [0, i_range) of what fn_range iterates over, buckets or pool
+ * words, among nthreads threads */
+static unsigned int parallel_for_each(ght_hash_table_t *p_ht, unsigned int nthreads, unsigned int i_range, iter_range_fn_t fn_range, ght_fn_iterate_t fn, void *p_ctx) {
+	parallel_iteration_t par;
+	pthread_t *p_threads;
+	unsigned int i_started = 0;
+	unsigned int i;
+
+	assert(p_ht && fn);
+
+	if (nthreads == 0)
+		nthreads = 1;
+	if (i_range == 0)
+		return 0;
+
+	par.p_ht = p_ht;
+	par.fn_range = fn_range;
+	par.fn = fn;
+	par.p_ctx = p_ctx;
+	par.i_next_partition = 0;
+	par.i_visited = 0;
+	par.b_stop = 0;
+
+	/* Round the partitions up to whole cache lines of buckets */
+	par.i_partition_size = (i_range + nthreads * PARTITIONS_PER_THREAD - 1) / (nthreads * PARTITIONS_PER_THREAD);
+	par.i_partition_size = (par.i_partition_size + PARTITION_ALIGN - 1) & ~(PARTITION_ALIGN - 1);
+	par.i_partitions = (i_range + par.i_partition_size - 1) / par.i_partition_size;
+
+	if (nthreads > par.i_partitions)
+		nthreads = par.i_partitions;
+
+	/* If a thread cannot be started, its share is done by the others */
+	if (nthreads > 1 && (p_threads = (pthread_t*) malloc((nthreads - 1) * sizeof(pthread_t)))) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&p_threads[i_started], NULL, parallel_worker, &par) == 0)
+				i_started++;
+		}
+		parallel_worker(&par);
+		for (i = 0; i < i_started; i++)
+			pthread_join(p_threads[i], NULL);
+		free(p_threads);
+	}
+	else
+		parallel_worker(&par);
+
+	return par.i_visited;
+}
+
+unsigned int ght_parallel_for_each(ght_hash_table_t *p_ht, unsigned int nthreads, ght_fn_iterate_t fn, void *p_ctx) {
+	return parallel_for_each(p_ht, nthreads, p_ht->i_size, ght_iter_range, fn, p_ctx);
+}
+
+unsigned int lockless_ght_parallel_for_each(ght_hash_table_t *p_ht, unsigned int nthreads, ght_fn_iterate_t fn, void *p_ctx) {
+	return parallel_for_each(p_ht, nthreads, p_ht->i_size, lockless_ght_iter_range, fn, p_ctx);
+}
+
+unsigned int lockless_ght_pool_words(ght_hash_table_t *p_ht) {
+	LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *p_pool;
+
+	assert(p_ht);
+
+	if (!(p_pool = entry_pool(p_ht)))
+		return 0;
+	return lockless_memory_words(p_pool);
+}
+
+/* Pin a slot which holds a linked entry. The slot is only written to
+ * once it looks like one, a free slot may be handed out meanwhile. */
+static inline int pool_pin(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *p_pool, ght_hash_entry_t *p_e) {
+	int refcnt;
+
+	if (!EPOCH_VISIBLE(__atomic_load_n(&p_e->i_death, __ATOMIC_RELAXED)) ||
+	    __atomic_load_n(&p_e->i_birth, __ATOMIC_RELAXED) == EPOCH_PENDING)
+		return FALSE;
+	refcnt = __atomic_load_n(&p_e->refCount, __ATOMIC_RELAXED);
+	do {
+		/* Odd while it is retired or free */
+		if (refcnt % 2 != 0)
+			return FALSE;
+	} while (!__atomic_compare_exchange_n(&p_e->refCount, &refcnt, refcnt + 2, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	/* Pinned, so it cannot change to another entry under us */
+	if (p_e->key.p_key == (void*) (p_e + 1) && p_e->key.i_size <= (unsigned int) p_pool->key_size &&
+	    __atomic_load_n(&p_e->i_birth, __ATOMIC_ACQUIRE) != EPOCH_PENDING &&
+	    !Has_Delete_Mark(&(p_e->p_next)) && EPOCH_VISIBLE(p_e->i_death) && p_e->p_data != NULL)
+		return TRUE;
+	ght_atomic_add_int(&p_e->refCount, -2);
+	return FALSE;
+}
+
+/* Visit the entries in the pool words [word_begin, word_end), in the
+ * order of their slots instead of bucket by bucket */
+unsigned int lockless_ght_pool_range(ght_hash_table_t *p_ht, unsigned int word_begin, unsigned int word_end, ght_fn_iterate_t fn, void *p_ctx) {
+	LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *p_pool;
+	ght_hash_entry_t *p_e;
+	u_int64_t used;
+	unsigned int i_visited = 0;
+	unsigned int i_word;
+	int i_slot;
+	int b_stop = 0;
+
+	assert(p_ht && fn);
+
+	if (!(p_pool = entry_pool(p_ht)))
+		return 0;
+	if (word_end > (unsigned int) lockless_memory_words(p_pool))
+		word_end = lockless_memory_words(p_pool);
+
+	for (i_word = word_begin; i_word < word_end && !b_stop; i_word++) {
+		for (used = lockless_memory_used(p_pool, i_word); used && !b_stop; used &= used - 1) {
+			i_slot = i_word * 64 + __builtin_ctzll(used);
+			p_e = (ght_hash_entry_t*) lockless_memory_slot(p_pool, i_slot);
+			/* The next slot in use is fetched while this one is visited */
+			if (used & (used - 1))
+				__builtin_prefetch(lockless_memory_slot(p_pool, i_word * 64 + __builtin_ctzll(used & (used - 1))));
+
+			if (!pool_pin(p_pool, p_e))
+				continue;
+			i_visited++;
+			b_stop = fn(p_e->p_data, p_e->key.p_key, p_e->key.i_size, p_ctx);
+			ght_atomic_add_int(&p_e->refCount, -2);
+		}
+	}
+	return i_visited;
+}
+
+unsigned int lockless_ght_pool_for_each(ght_hash_table_t *p_ht, unsigned int nthreads, ght_fn_iterate_t fn, void *p_ctx) {
+	/* Without a pool of its own, the table is scanned by buckets */
+	if (!entry_pool(p_ht))
+		return lockless_ght_parallel_for_each(p_ht, nthreads, fn, p_ctx);
+	return parallel_for_each(p_ht, nthreads, lockless_ght_pool_words(p_ht), lockless_ght_pool_range, fn, p_ctx);
+}
+
+/* TRUE if the entry was in the table when the snapshot of epoch
+ * i_epoch was opened */
+static inline int snapshot_visible(ght_hash_entry_t *p_e, unsigned int i_epoch) {
+	unsigned int i_death;
+
+	/* A removal in progress is only a few instructions away from its stamp */
+	while ((i_death = __atomic_load_n(&p_e->i_death, __ATOMIC_ACQUIRE)) == EPOCH_PENDING)
+		ght_cpu_relax();
+
+	return __atomic_load_n(&p_e->i_birth, __ATOMIC_ACQUIRE) <= i_epoch && i_death > i_epoch;
+}
+
+/* Return the first entry after p_prev in bucket l_bucket (or the first
+ * entry of the bucket if p_prev is NULL) which is visible to the
+ * snapshot. The entries it returns are neither unlinked nor freed while
+ * the snapshot is open, so p_prev needs no pin. The entries in between
+ * may be freed under us; they are pinned hand over hand, and the walk
+ * restarts at p_prev if one of them changes. */
+static ght_hash_entry_t *snapshot_scan_bucket(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_hash_entry_t *p_prev, unsigned int i_epoch) {
+	ght_hash_entry_t **pp_link;
+	ght_hash_entry_t *p_cur;
+	ght_hash_entry_t *p_e;
+	ght_hash_entry_t *p_next;
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
+	int refcnt;
+
+	restart:
+	p_cur = p_prev;
+	pp_link = p_prev ? &p_prev->p_next : &p_ht->pp_entries[l_bucket];
+	p_e = ght_ptr_unmark(ght_atomic_load_ptr(pp_link));
+
+	while (p_e) {
+		refcnt = __atomic_add_fetch(&p_e->refCount, 2, __ATOMIC_ACQ_REL);
+
+		/* Freed, or unlinked and reused, before we got the pin */
+		if (refcnt % 2 != 0 || ght_ptr_unmark(ght_atomic_load_ptr(pp_link)) != p_e) {
+			if (refcnt % 2 == 0)
+				ght_atomic_add_int(&p_e->refCount, -2);
+			if (p_cur != p_prev)
+				ght_atomic_add_int(&p_cur->refCount, -2);
+			p_ht->fn_backoff(&backoff, NULL);
+			goto restart;
+		}
+		if (p_cur != p_prev)
+			ght_atomic_add_int(&p_cur->refCount, -2);
+		p_cur = p_e;
+
+		/* Being linked in or unlinked right now */
+		p_next = ght_atomic_load_ptr(&p_e->p_next);
+		if ((uintptr_t) p_next & GHT_MARK_DELETE) {
+			ght_atomic_add_int(&p_cur->refCount, -2);
+			p_ht->fn_backoff(&backoff, NULL);
+			goto restart;
+		}
+
+		if (snapshot_visible(p_e, i_epoch)) {
+			ght_atomic_add_int(&p_cur->refCount, -2);
+			return p_e;
+		}
+		pp_link = &p_e->p_next;
+		p_e = ght_ptr_unmark(p_next);
+	}
+	if (p_cur != p_prev)
+		ght_atomic_add_int(&p_cur->refCount, -2);
+
+	return NULL;
+}
+
+/* Unlink and free the removed entries which no snapshot can see. Gives
+ * up as soon as a new snapshot is opened; that one purges on close.
+ * Returns FALSE if entries were left for the next purge. */
+static int purge_removed_entries(ght_hash_table_t *p_ht) {
+	ght_hash_entry_t *p_e;
+	ght_hash_entry_t *p_next;
+	unsigned int i_death;
+	unsigned int i;
+	int refcnt;
+	int b_done = TRUE;
+
+	for (i = next_occupied_bucket(p_ht, 0); i < p_ht->i_size; i = next_occupied_bucket(p_ht, i + 1)) {
+		restart:
+		p_e = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[i]));
+		while (p_e) {
+			refcnt = __atomic_add_fetch(&p_e->refCount, 2, __ATOMIC_ACQ_REL);
+
+			if(refcnt % 2 == 0) {
+				i_death = __atomic_load_n(&p_e->i_death, __ATOMIC_ACQUIRE);
+				/* The remover may still hold its pin, so only take
+				 * entries nobody else has pinned. Busy entries are
+				 * left to the next purge. */
+				if (!EPOCH_VISIBLE(i_death) && i_death != EPOCH_PENDING) {
+					if (__atomic_load_n(&p_e->refCount, __ATOMIC_ACQUIRE) != 2)
+						b_done = FALSE;
+					else if (!may_unlink(p_ht)) {
+						ght_atomic_add_int(&p_e->refCount, -2);
+						return FALSE;
+					}
+					else if (unlink_entry(p_ht, i, p_e, FALSE))
+						goto restart;
+					else
+						b_done = FALSE;
+				}
+				p_next = ght_ptr_unmark(ght_atomic_load_ptr(&p_e->p_next));
+				ght_atomic_add_int(&p_e->refCount, -2);
+			}
+			else
+				p_next = ght_ptr_unmark(ght_atomic_load_ptr(&p_e->p_next));
+			p_e = p_next;
+		}
+	}
+	return b_done;
+}
+
+/* Purge the removals left to the snapshots once none is open. The
+ * purge that empties i_deferred is the only one running, and it sets
+ * i_deferred again if entries were busy, for the next call to retry. */
+static void purge_deferred(ght_hash_table_t *p_ht) {
+	if (__atomic_load_n(&p_ht->i_deferred, __ATOMIC_RELAXED) != 0 && may_unlink(p_ht) &&
+	    __atomic_exchange_n(&p_ht->i_deferred, 0, __ATOMIC_SEQ_CST) != 0 && !purge_removed_entries(p_ht))
+		FAA(&p_ht->i_deferred, 1);
+}
+
+void lockless_ght_snapshot_open(ght_hash_table_t *p_ht, lockless_ght_snapshot_t *p_snapshot) {
+	ght_backoff_t backoff = GHT_BACKOFF_INIT;
+
+	assert(p_ht && p_snapshot);
+
+	/* A removal which still sees no open snapshot has been stamped
+	 * with an epoch <= ours, so we would skip the entry anyway */
+	__atomic_fetch_add(&p_ht->i_snapshots, 1, __ATOMIC_SEQ_CST);
+	/* ght_compact() moves no more entries now, wait for the one which
+	 * may be half moved */
+	while (__atomic_load_n(&p_ht->i_moving, __ATOMIC_SEQ_CST) != 0)
+		p_ht->fn_backoff(&backoff, NULL);
+	p_snapshot->i_epoch = __atomic_fetch_add(&p_ht->i_epoch, 1, __ATOMIC_SEQ_CST);
+	p_snapshot->i_bucket = next_occupied_bucket(p_ht, 0);
+	p_snapshot->p_entry = NULL;
+}
+
+void *lockless_ght_snapshot_next(ght_hash_table_t *p_ht, lockless_ght_snapshot_t *p_snapshot, const void **pp_key, unsigned int *size) {
+	ght_hash_entry_t *p_e;
+
+	assert(p_ht && p_snapshot);
+
+	while (p_snapshot->i_bucket < p_ht->i_size) {
+		p_e = snapshot_scan_bucket(p_ht, p_snapshot->i_bucket, p_snapshot->p_entry, p_snapshot->i_epoch);
+		if (p_e) {
+			p_snapshot->p_entry = p_e;
+			*pp_key = p_e->key.p_key;
+			if (size != NULL)
+				*size = p_e->key.i_size;
+			return p_e->p_data;
+		}
+		p_snapshot->p_entry = NULL;
+		p_snapshot->i_bucket = next_occupied_bucket(p_ht, p_snapshot->i_bucket + 1);
+	}
+
+	*pp_key = NULL;
+	if (size != NULL)
+		*size = 0;
+	return NULL;
+}
+
+void lockless_ght_snapshot_close(ght_hash_table_t *p_ht, lockless_ght_snapshot_t *p_snapshot) {
+	assert(p_ht && p_snapshot);
+
+	p_snapshot->i_bucket = p_ht->i_size;
+	p_snapshot->p_entry = NULL;
+
+	/* Only walk the table if a removal was left to the snapshots */
+	if (__atomic_sub_fetch(&p_ht->i_snapshots, 1, __ATOMIC_SEQ_CST) == 0)
+		purge_deferred(p_ht);
+}
+
+/* The image written by ght_save() is a header, blocks of records and
+ * an empty block at the end. A record is a save_record_t followed by
+ * the key and the serialized data. Numbers are in the byte order of
+ * the machine that wrote the image. */
+#define SAVE_MAGIC     0x31544847  /* "GHT1" on a little endian machine */
+#define SAVE_VERSION   1
+/* Records are gathered into blocks of about this size, and each block
+ * is written and read with one call. The blocks are the unit of work
+ * of the threads of ght_load(). */
+#define SAVE_BLOCK     ((size_t) 1 << 20)
+
+typedef struct
+{
+	ght_uint32_t i_magic;
+	ght_uint32_t i_version;
+	ght_uint32_t i_table_size;  /* The number of buckets */
+	ght_uint32_t i_reserved;
+} save_header_t;
+
+typedef struct
+{
+	ght_uint32_t i_bytes;       /* The size of the records, 0 at the end */
+	ght_uint32_t i_records;
+} save_block_t;
+
+typedef struct
+{
+	ght_uint32_t i_key_size;
+	ght_uint32_t i_data_size;
+} save_record_t;
+
+static int write_all(int fd, const void *p_buf, size_t size) {
+	const char *p = (const char*) p_buf;
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = write(fd, p, size)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* Returns the number of bytes read, which is only less than size at
+ * the end of the file, or -1 */
+static ssize_t read_all(int fd, void *p_buf, size_t size) {
+	char *p = (char*) p_buf;
+	size_t i_read = 0;
+	ssize_t n;
+
+	while (i_read < size) {
+		if ((n = read(fd, p + i_read, size - i_read)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		i_read += n;
+	}
+	return i_read;
+}
+
+/* Gathers records into blocks and writes each full block with one
+ * call */
+typedef struct
+{
+	int fd;
+	char *p_buf;               /* A save_block_t, then the records */
+	size_t i_cap;              /* The room for records */
+	size_t i_used;
+	unsigned int i_records;
+} save_writer_t;
+
+static int writer_init(save_writer_t *p_w, int fd) {
+	p_w->fd = fd;
+	p_w->i_cap = SAVE_BLOCK;
+	p_w->i_used = 0;
+	p_w->i_records = 0;
+	return (p_w->p_buf = (char*) malloc(sizeof(save_block_t) + p_w->i_cap)) ? 0 : -1;
+}
+
+static int writer_flush(save_writer_t *p_w) {
+	save_block_t block;
+
+	block.i_bytes = p_w->i_used;
+	block.i_records = p_w->i_records;
+	memcpy(p_w->p_buf, &block, sizeof(block));
+	p_w->i_used = 0;
+	p_w->i_records = 0;
+	return write_all(p_w->fd, p_w->p_buf, sizeof(block) + block.i_bytes);
+}
+
+/* Add the record of an entry, with its data serialized by fn_save */
+static int writer_add(save_writer_t *p_w, const void *p_key, unsigned int i_key_size, void *p_data, ght_fn_save_t fn_save, void *p_ctx) {
+	save_record_t record;
+	size_t i_need = sizeof(save_record_t) + i_key_size;
+	size_t i_data_size;
+	char *p_rec;
+	char *p_new;
+
+	for (;;) {
+		p_rec = p_w->p_buf + sizeof(save_block_t) + p_w->i_used;
+		i_data_size = 0;
+		if (i_need <= p_w->i_cap - p_w->i_used) {
+			i_data_size = fn_save(p_data, p_rec + i_need, p_w->i_cap - p_w->i_used - i_need, p_ctx);
+			if (i_data_size <= p_w->i_cap - p_w->i_used - i_need)
+				break;
+		}
+		if (p_w->i_records > 0) {
+			if (writer_flush(p_w) < 0)
+				return -1;
+			continue;
+		}
+		/* The record alone does not fit in a block */
+		if (i_need + i_data_size > UINT_MAX - sizeof(save_block_t) ||
+		    !(p_new = (char*) realloc(p_w->p_buf, sizeof(save_block_t) + i_need + i_data_size)))
+			return -1;
+		p_w->p_buf = p_new;
+		p_w->i_cap = i_need + i_data_size;
+	}
+
+	record.i_key_size = i_key_size;
+	record.i_data_size = i_data_size;
+	memcpy(p_rec, &record, sizeof(record));
+	memcpy(p_rec + sizeof(record), p_key, i_key_size);
+	p_w->i_used += i_need + i_data_size;
+	p_w->i_records++;
+	return 0;
+}
+
+/* Write what is left and the empty block at the end */
+static int writer_finish(save_writer_t *p_w) {
+	if (p_w->i_records > 0 && writer_flush(p_w) < 0)
+		return -1;
+	return writer_flush(p_w);
+}
+
+int ght_save(ght_hash_table_t *p_ht, int fd, ght_fn_save_t fn_save, void *p_ctx) {
+	lockless_ght_snapshot_t snapshot;
+	save_header_t header;
+	save_writer_t writer;
+	const void *p_key;
+	unsigned int i_key_size;
+	void *p_data;
+	int i_saved = 0;
+
+	assert(p_ht && fn_save);
+
+	header.i_magic = SAVE_MAGIC;
+	header.i_version = SAVE_VERSION;
+	header.i_table_size = p_ht->i_size;
+	header.i_reserved = 0;
+	if (writer_init(&writer, fd) < 0)
+		return -1;
+	if (write_all(fd, &header, sizeof(header)) < 0) {
+		free(writer.p_buf);
+		return -1;
+	}
+
+	/* The snapshot makes the image consistent even if other threads
+	 * modify the table meanwhile */
+	lockless_ght_snapshot_open(p_ht, &snapshot);
+	while ((p_data = lockless_ght_snapshot_next(p_ht, &snapshot, &p_key, &i_key_size)) || p_key) {
+		if (writer_add(&writer, p_key, i_key_size, p_data, fn_save, p_ctx) < 0) {
+			i_saved = -1;
+			break;
+		}
+		i_saved++;
+	}
+	lockless_ght_snapshot_close(p_ht, &snapshot);
+
+	if (i_saved >= 0 && writer_finish(&writer) < 0)
+		i_saved = -1;
+	free(writer.p_buf);
+	return i_saved;
+}
+
+typedef struct
+{
+	ght_hash_table_t *p_ht;
+	int fd;
+	ght_fn_load_t fn_load;
+	void *p_ctx;
+
+	pthread_mutex_t lock;       /* Held while a block is read */
+	pthread_mutex_t alloc;      /* Held while the entries of an arena are carved */
+	int b_end;
+	int b_failed;
+	unsigned int i_loaded;
+} load_t;
+
+/* Give back the entries [i_first, p_batch->n) of a batch, which were
+ * never initialized */
+static void load_free_unused(ght_hash_table_t *p_ht, entry_batch_t *p_batch, unsigned int i_first) {
+	unsigned int i;
+
+	for (i = i_first; i < p_batch->n; i++) {
+		p_batch->pp_ptrs[i - i_first] = p_batch->pp_ptrs[i];
+		p_batch->sizes[i - i_first] = p_batch->sizes[i];
+		((ght_hash_entry_t*) p_batch->pp_ptrs[i])->key.i_size = p_batch->sizes[i] - sizeof(ght_hash_entry_t);
+	}
+	p_batch->n -= i_first;
+	entries_free(p_ht, p_batch);
+}
+
+/* Insert the records of a block, allocating the entries a batch at a
+ * time */
+static int load_records(load_t *p_load, const char *p, const char *p_end, unsigned int i_records) {
+	ght_hash_table_t *p_ht = p_load->p_ht;
+	entry_batch_t batch;
+	save_record_t records[ENTRY_BATCH];
+	const char *p_keys[ENTRY_BATCH];
+	ght_hash_entry_t *p_ready[ENTRY_BATCH];
+	void *p_data;
+	unsigned int i_alloced;
+	unsigned int i_ready;
+	unsigned int i_loaded = 0;
+	unsigned int i;
+	int i_ret = 0;
+
+	while (i_records > 0 && i_ret == 0) {
+		for (batch.n = 0; batch.n < ENTRY_BATCH && i_records > 0; batch.n++, i_records--) {
+			if ((size_t) (p_end - p) < sizeof(save_record_t))
+				goto fail;
+			memcpy(&records[batch.n], p, sizeof(save_record_t));
+			p += sizeof(save_record_t);
+			if (records[batch.n].i_key_size > (size_t) (p_end - p) ||
+			    records[batch.n].i_data_size > (size_t) (p_end - p) - records[batch.n].i_key_size)
+				goto fail;
+			p_keys[batch.n] = p;
+			p += records[batch.n].i_key_size + records[batch.n].i_data_size;
+			batch.sizes[batch.n] = ENTRY_SIZE(records[batch.n].i_key_size);
+		}
+
+		/* The arena is a bump allocator, the threads take turns */
+		if (p_ht->p_arena)
+			pthread_mutex_lock(&p_load->alloc);
+		i_alloced = entries_alloc(p_ht, &batch);
+		if (p_ht->p_arena)
+			pthread_mutex_unlock(&p_load->alloc);
+		if (i_alloced < batch.n)
+			i_ret = -1;
+		batch.n = i_alloced;
+		for (i_ready = 0; i_ready < batch.n; i_ready++) {
+			if (!(p_data = p_load->fn_load(p_keys[i_ready] + records[i_ready].i_key_size, records[i_ready].i_data_size, p_load->p_ctx))) {
+				load_free_unused(p_ht, &batch, i_ready);
+				i_ret = -1;
+				break;
+			}
+			p_ready[i_ready] = (ght_hash_entry_t*) batch.pp_ptrs[i_ready];
+			he_init(p_ready[i_ready], p_data, records[i_ready].i_key_size, p_keys[i_ready]);
+		}
+
+		/* The keys of an image are unique, a duplicate fails the load */
+		for (i = 0; i < i_ready; i++) {
+			if (lockless_link_entry(p_ht, p_ready[i], get_hash_value(p_ht, &p_ready[i]->key), TRUE) < 0)
+				i_ret = -1;
+			else
+				i_loaded++;
+		}
+	}
+	if (p != p_end)
+		i_ret = -1;
+	FAA(&p_load->i_loaded, i_loaded);
+	return i_ret;
+
+ fail:
+	FAA(&p_load->i_loaded, i_loaded);
+	return -1;
+}
+
+static void *load_worker(void *p_arg) {
+	load_t *p_load = (load_t*) p_arg;
+	save_block_t block;
+	char *p_buf = NULL;
+	char *p_new;
+	size_t i_cap = 0;
+	int b_ok;
+
+	for (;;) {
+		/* The blocks are read in turn, so the file is read sequentially */
+		pthread_mutex_lock(&p_load->lock);
+		if (p_load->b_end || __atomic_load_n(&p_load->b_failed, __ATOMIC_RELAXED)) {
+			pthread_mutex_unlock(&p_load->lock);
+			break;
+		}
+		b_ok = read_all(p_load->fd, &block, sizeof(block)) == sizeof(block);
+		if (b_ok && block.i_bytes == 0) {
+			p_load->b_end = TRUE;
+			pthread_mutex_unlock(&p_load->lock);
+			break;
+		}
+		if (b_ok && block.i_bytes > i_cap) {
+			if ((p_new = (char*) realloc(p_buf, block.i_bytes))) {
+				p_buf = p_new;
+				i_cap = block.i_bytes;
+			}
+			else
+				b_ok = FALSE;
+		}
+		b_ok = b_ok && read_all(p_load->fd, p_buf, block.i_bytes) == (ssize_t) block.i_bytes;
+		if (!b_ok)
+			__atomic_store_n(&p_load->b_failed, TRUE, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&p_load->lock);
+
+		if (!b_ok || load_records(p_load, p_buf, p_buf + block.i_bytes, block.i_records) < 0) {
+			__atomic_store_n(&p_load->b_failed, TRUE, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	free(p_buf);
+
+	return NULL;
+}
+
+/* Load the blocks of records which follow the header of an image or
+ * a delta */
+static int load_blocks(ght_hash_table_t *p_ht, int fd, unsigned int nthreads, ght_fn_load_t fn_load, void *p_ctx) {
+	load_t load;
+	pthread_t *p_threads;
+	unsigned int i_started = 0;
+	unsigned int i;
+
+	load.p_ht = p_ht;
+	load.fd = fd;
+	load.fn_load = fn_load;
+	load.p_ctx = p_ctx;
+	pthread_mutex_init(&load.lock, NULL);
+	pthread_mutex_init(&load.alloc, NULL);
+	load.b_end = FALSE;
+	load.b_failed = FALSE;
+	load.i_loaded = 0;
+
+	/* If a thread cannot be started, its share is done by the others */
+	if (nthreads > 1 && (p_threads = (pthread_t*) malloc((nthreads - 1) * sizeof(pthread_t)))) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&p_threads[i_started], NULL, load_worker, &load) == 0)
+				i_started++;
+		}
+		load_worker(&load);
+		for (i = 0; i < i_started; i++)
+			pthread_join(p_threads[i], NULL);
+		free(p_threads);
+	}
+	else
+		load_worker(&load);
+	pthread_mutex_destroy(&load.alloc);
+	pthread_mutex_destroy(&load.lock);
+
+	return load.b_failed ? -1 : (int) load.i_loaded;
+}
+
+int ght_load(ght_hash_table_t *p_ht, int fd, unsigned int nthreads, ght_fn_load_t fn_load, void *p_ctx) {
+	save_header_t header;
+
+	assert(p_ht && fn_load);
+
+	if (ght_size(p_ht) != 0)
+		return -1;
+	if (read_all(fd, &header, sizeof(header)) != sizeof(header) ||
+	    header.i_magic != SAVE_MAGIC || header.i_version != SAVE_VERSION)
+		return -1;
+
+	/* Size the table up front, so that it is not rehashed as it fills */
+	if (header.i_table_size > p_ht->i_size)
+		ght_rehash(p_ht, header.i_table_size);
+
+	return load_blocks(p_ht, fd, nthreads, fn_load, p_ctx);
+}
+
+/* A delta written by ght_checkpoint() is a header, the bitmap of the
+ * bucket groups it holds and the records of their entries, in blocks
+ * like an image of ght_save() */
+#define DELTA_MAGIC    0x44544847  /* "GHTD" on a little endian machine */
+#define DELTA_VERSION  1
+
+typedef struct
+{
+	ght_uint32_t i_magic;
+	ght_uint32_t i_version;
+	ght_uint32_t i_table_size;  /* The number of buckets */
+	ght_uint32_t i_span;        /* The number of buckets per group */
+} delta_header_t;
+
+int ght_checkpoint(ght_hash_table_t *p_ht, int fd, int b_full, ght_fn_save_t fn_save, void *p_ctx) {
+	lockless_ght_snapshot_t snapshot;
+	delta_header_t header;
+	save_writer_t writer;
+	ght_hash_entry_t *p_e;
+	uint64_t *p_groups;
+	uint64_t bits;
+	unsigned int i_groups = (p_ht->i_size + DIRTY_SPAN - 1) / DIRTY_SPAN;
+	unsigned int i_words = DIRTY_WORDS(p_ht->i_size);
+	unsigned int i_group;
+	unsigned int i_bucket;
+	unsigned int i_end;
+	unsigned int i;
+	int i_saved = 0;
+
+	assert(p_ht && fn_save);
+
+	if (!p_ht->p_dirty || writer_init(&writer, fd) < 0)
+		return -1;
+	if (!(p_groups = (uint64_t*) malloc(i_words * sizeof(uint64_t)))) {
+		free(writer.p_buf);
+		return -1;
+	}
+
+	/* Take the dirty bits before the snapshot is opened. A change the
+	 * snapshot does not see sets its bit again, for the next delta. */
+	for (i = 0; i < i_words; i++)
+		p_groups[i] = __atomic_exchange_n(&p_ht->p_dirty[i], 0, __ATOMIC_SEQ_CST) | (b_full ? ~(uint64_t) 0 : 0);
+	if (i_groups % 64 != 0)
+		p_groups[i_words - 1] &= ((uint64_t) 1 << (i_groups % 64)) - 1;
+	lockless_ght_snapshot_open(p_ht, &snapshot);
+
+	header.i_magic = DELTA_MAGIC;
+	header.i_version = DELTA_VERSION;
+	header.i_table_size = p_ht->i_size;
+	header.i_span = DIRTY_SPAN;
+	if (write_all(fd, &header, sizeof(header)) < 0 || write_all(fd, p_groups, i_words * sizeof(uint64_t)) < 0)
+		goto fail;
+
+	for (i = 0; i < i_words; i++) {
+		for (bits = p_groups[i]; bits; bits &= bits - 1) {
+			i_group = i * 64 + __builtin_ctzll(bits);
+			i_end = (i_group + 1) * DIRTY_SPAN < p_ht->i_size ? (i_group + 1) * DIRTY_SPAN : p_ht->i_size;
+			for (i_bucket = i_group * DIRTY_SPAN; i_bucket < i_end; i_bucket++) {
+				for (p_e = snapshot_scan_bucket(p_ht, i_bucket, NULL, snapshot.i_epoch); p_e;
+				     p_e = snapshot_scan_bucket(p_ht, i_bucket, p_e, snapshot.i_epoch)) {
+					if (writer_add(&writer, p_e->key.p_key, p_e->key.i_size, p_e->p_data, fn_save, p_ctx) < 0)
+						goto fail;
+					i_saved++;
+				}
+			}
+		}
+	}
+	if (writer_finish(&writer) < 0)
+		goto fail;
+
+	lockless_ght_snapshot_close(p_ht, &snapshot);
+	free(p_groups);
+	free(writer.p_buf);
+	return i_saved;
+
+ fail:
+	/* The groups stay dirty for the next checkpoint */
+	for (i = 0; i < i_words; i++)
+		__atomic_fetch_or(&p_ht->p_dirty[i], p_groups[i], __ATOMIC_SEQ_CST);
+	lockless_ght_snapshot_close(p_ht, &snapshot);
+	free(p_groups);
+	free(writer.p_buf);
+	return -1;
+}
+
+/* Remove every entry of a bucket, before a delta replaces them */
+static int replay_empty_bucket(ght_hash_table_t *p_ht, ght_uint32_t l_bucket, ght_fn_bucket_free_callback_t fn_free) {
+	ght_hash_entry_t *p_e;
+	char key_buf[256];
+	char *p_key;
+	unsigned int i_key_size;
+	void *p_data;
+
+	while ((p_e = ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[l_bucket])))) {
+		/* The key is freed with the entry */
+		i_key_size = p_e->key.i_size;
+		if (!(p_key = i_key_size <= sizeof(key_buf) ? key_buf : (char*) malloc(i_key_size)))
+			return -1;
+		memcpy(p_key, p_e->key.p_key, i_key_size);
+
+		p_data = lockless_ght_remove(p_ht, i_key_size, p_key);
+		if (ght_ptr_unmark(ght_atomic_load_ptr(&p_ht->pp_entries[l_bucket])) == p_e) {
+			if (p_key != key_buf)
+				free(p_key);
+			return -1;
+		}
+		if (fn_free)
+			fn_free(p_data, p_key);
+		if (p_key != key_buf)
+			free(p_key);
+	}
+	return 0;
+}
+
+int ght_replay(ght_hash_table_t *p_ht, int fd, unsigned int nthreads, ght_fn_load_t fn_load,
+               ght_fn_bucket_free_callback_t fn_free, void *p_ctx) {
+	delta_header_t header;
+	uint64_t *p_groups;
+	uint64_t bits;
+	unsigned int i_groups;
+	unsigned int i_words;
+	unsigned int i_group;
+	unsigned int i_bucket;
+	unsigned int i_set;
+	unsigned int i;
+
+	assert(p_ht && fn_load);
+
+	if (read_all(fd, &header, sizeof(header)) != sizeof(header) || header.i_magic != DELTA_MAGIC ||
+	    header.i_version != DELTA_VERSION || header.i_span != DIRTY_SPAN || header.i_table_size == 0)
+		return -1;
+
+	i_groups = (header.i_table_size + DIRTY_SPAN - 1) / DIRTY_SPAN;
+	i_words = DIRTY_WORDS(header.i_table_size);
+	if (!(p_groups = (uint64_t*) malloc(i_words * sizeof(uint64_t))))
+		return -1;
+	if (read_all(fd, p_groups, i_words * sizeof(uint64_t)) != (ssize_t) (i_words * sizeof(uint64_t))) {
+		free(p_groups);
+		return -1;
+	}
+
+	/* The groups are ranges of buckets, so the bucket counts must
+	 * agree. A delta taken after a rehash holds every group, so the
+	 * table is emptied and resized. ght_rehash() only carries over the
+	 * entries on the insertion list, so it must find every bucket empty. */
+	if (header.i_table_size != p_ht->i_size) {
+		for (i = 0, i_set = 0; i < i_words; i++)
+			i_set += __builtin_popcountll(p_groups[i]);
+		for (i_bucket = 0; i_set == i_groups && i_bucket < p_ht->i_size; i_bucket++) {
+			if (replay_empty_bucket(p_ht, i_bucket, fn_free) < 0)
+				break;
+		}
+		if (i_set != i_groups || i_bucket < p_ht->i_size || ght_size(p_ht) != 0) {
+			free(p_groups);
+			return -1;
+		}
+		ght_rehash(p_ht, header.i_table_size);
+	}
+
+	/* The delta holds everything these groups had at the checkpoint */
+	for (i = 0; i < i_words; i++) {
+		for (bits = p_groups[i]; bits; bits &= bits - 1) {
+			i_group = i * 64 + __builtin_ctzll(bits);
+			for (i_bucket = i_group * DIRTY_SPAN; i_group < i_groups && i_bucket < (i_group + 1) * DIRTY_SPAN &&
+			     i_bucket < p_ht->i_size; i_bucket++) {
+				if (replay_empty_bucket(p_ht, i_bucket, fn_free) < 0) {
+					free(p_groups);
+					return -1;
+				}
+			}
+		}
+	}
+	free(p_groups);
+
+	return load_blocks(p_ht, fd, nthreads, fn_load, p_ctx);
+}
+
+/* Finalize (free) a hash table */
+void ght_finalize(ght_hash_table_t *p_ht) {
+	entry_batch_t batch;
+	int i;
+
+	assert(p_ht);
+
+	if (p_ht->pp_entries) {
+		/* For each bucket, free all entries. Arena entries go with
+		 * their chunks. */
+		batch.n = 0;
+		for (i = 0; i < p_ht->i_size && !p_ht->p_arena; i++) {
+			free_entry_chain(p_ht, p_ht->pp_entries[i], &batch);
+			p_ht->pp_entries[i] = NULL;
+		}
+		entries_free(p_ht, &batch);
+		ght_pages_free(p_ht->pp_entries);
+		p_ht->pp_entries = NULL;
+	}
+	if (p_ht->p_nr) {
+		ght_pages_free(p_ht->p_nr);
+		p_ht->p_nr = NULL;
+	}
+	if (p_ht->p_occupied) {
+		ght_pages_free(p_ht->p_occupied);
+		p_ht->p_occupied = NULL;
+	}
+	if (p_ht->p_version) {
+		free(p_ht->p_version);
+		p_ht->p_version = NULL;
+	}
+	free(p_ht->p_dirty);
+	p_ht->p_dirty = NULL;
+	filter_free(p_ht->p_filter);
+	p_ht->p_filter = NULL;
+	arena_free(p_ht->p_arena);
+	p_ht->p_arena = NULL;
+	/* All entries have been given back to the pool by now */
+	if (p_ht->p_pool) {
+		destroy_array_lookup_table(p_ht->p_pool);
+		free(p_ht->p_pool);
+		p_ht->p_pool = NULL;
+	}
+
+	free(p_ht);
+}
+
+/* Remove all entries but keep the buckets */
+void ght_clear(ght_hash_table_t *p_ht) {
+	entry_batch_t batch;
+	int i;
+
+	assert(p_ht);
+
+	if (p_ht->p_arena)
+		arena_release(p_ht->p_arena, FALSE);
+	else {
+		batch.n = 0;
+		for (i = 0; i < p_ht->i_size; i++)
+			free_entry_chain(p_ht, p_ht->pp_entries[i], &batch);
+		entries_free(p_ht, &batch);
+	}
+
+	ght_pages_zero(p_ht->pp_entries, p_ht->i_size * sizeof(ght_hash_entry_t*));
+	ght_pages_zero(p_ht->p_nr, p_ht->i_size * sizeof(unsigned int));
+	ght_pages_zero(p_ht->p_occupied, OCCUPIED_WORDS(p_ht->i_size) * sizeof(uint64_t));
+	if (p_ht->p_filter)
+		memset(p_ht->p_filter->p_counters, 0, (size_t) p_ht->p_filter->i_blocks * FILTER_BLOCK);
+	p_ht->i_items = 0;
+	p_ht->p_oldest = NULL;
+	p_ht->p_newest = NULL;
+	if (p_ht->p_dirty)
+		memset(p_ht->p_dirty, 0xff, DIRTY_WORDS(p_ht->i_size) * sizeof(uint64_t));
+
+	/* Forget what the threads cached */
+	p_ht->i_id = new_table_id();
+}
+
+/* Rehash the hash table (i.e. change its size and reinsert all
+ * items). This operation is slow and should not be used frequently.
+ */
+void ght_rehash(ght_hash_table_t *p_ht, unsigned int i_size) {
+	ght_hash_table_t *p_tmp;
+	ght_iterator_t iterator;
+	ght_hash_entry_t *p_src[ENTRY_BATCH];
+	entry_batch_t batch;
+	const void *p_key;
+	void *p;
+	unsigned int i_alloced;
+	unsigned int j;
 	int i;
 
 	assert(p_ht);
 
 	/* Recreate the hash table with the new size */
-	p_tmp = ght_create(i_size);
+	p_tmp = ght_create_ex(i_size, p_ht->i_flags);
 	assert(p_tmp);
 
 	/* Set the flags for the new hash table */
 	ght_set_hash(p_tmp, p_ht->fn_hash);
 	ght_set_alloc(p_tmp, p_ht->fn_alloc, p_ht->fn_free);
+	p_tmp->allocator = p_ht->allocator;
+	p_tmp->p_alloc_ctx = p_ht->p_alloc_ctx;
+	if (p_ht->p_arena)
+		ght_set_arena(p_tmp, p_ht->p_arena->chunk_size);
 	ght_set_heuristics(p_tmp, GHT_HEURISTICS_NONE);
 	ght_set_rehash(p_tmp, FALSE);
 
-	/* Walk through all elements in the table and insert them into the temporary one. */
-	for (p = ght_first(p_ht, &iterator, &p_key); p; p = ght_next(p_ht, &iterator, &p_key)) {
-		assert(iterator.p_entry);
+	/* Walk through all elements in the table and insert them into the
+	 * temporary one, allocating the new entries a batch at a time. */
+	p = ght_first(p_ht, &iterator, &p_key);
+	while (p) {
+		for (batch.n = 0; p && batch.n < ENTRY_BATCH; p = ght_next(p_ht, &iterator, &p_key)) {
+			assert(iterator.p_entry);
+			p_src[batch.n] = iterator.p_entry;
+			batch.sizes[batch.n++] = ENTRY_SIZE(iterator.p_entry->key.i_size);
+		}
+
+		i_alloced = entries_alloc(p_tmp, &batch);
+		for (j = 0; j < batch.n; j++) {
+			ght_hash_entry_t *p_e = (ght_hash_entry_t*) batch.pp_ptrs[j];
 
-		/* Insert the entry into the new table */
-		if (ght_insert(p_tmp, iterator.p_entry->p_data, iterator.p_entry->key.i_size, iterator.p_entry->key.p_key) < 0) {
-			fprintf(stderr, "hash_table.c ERROR: Out of memory error or entry already in hash table\n"
-					"when rehashing (internal error)\n");
+			/* Insert the entry into the new table */
+			if (j >= i_alloced) {
+				fprintf(stderr, "hash_table.c ERROR: Out of memory error or entry already in hash table\n"
+						"when rehashing (internal error)\n");
+				continue;
+			}
+			he_init(p_e, p_src[j]->p_data, p_src[j]->key.i_size, p_src[j]->key.p_key);
+			insert_entry(p_tmp, p_e, get_hash_value(p_tmp, &p_e->key));
 		}
 	}
 
 	/* Remove the old table... */
-	for (i = 0; i < p_ht->i_size; i++) {
+	batch.n = 0;
+	for (i = 0; i < p_ht->i_size && !p_ht->p_arena; i++) {
 		if (p_ht->pp_entries[i]) {
 			/* Delete the entries in the bucket */
-			free_entry_chain(p_ht, p_ht->pp_entries[i]);
+			free_entry_chain(p_ht, p_ht->pp_entries[i], &batch);
 			p_ht->pp_entries[i] = NULL;
 		}
 	}
+	entries_free(p_ht, &batch);
 
-	free(p_ht->pp_entries);
-	free(p_ht->p_nr);
+	ght_pages_free(p_ht->pp_entries);
+	ght_pages_free(p_ht->p_nr);
+	ght_pages_free(p_ht->p_occupied);
+	arena_free(p_ht->p_arena);
 
 	/* ... and replace it with the new */
 	p_ht->i_size = p_tmp->i_size;
@@ -1401,347 +3539,31 @@ void ght_rehash(ght_hash_table_t *p_ht, unsigned int i_size) {
 	p_ht->i_items = p_tmp->i_items;
 	p_ht->pp_entries = p_tmp->pp_entries;
 	p_ht->p_nr = p_tmp->p_nr;
+	p_ht->p_occupied = p_tmp->p_occupied;
 
 	p_ht->p_oldest = p_tmp->p_oldest;
 	p_ht->p_newest = p_tmp->p_newest;
+	p_ht->p_arena = p_tmp->p_arena;
 
 	/* Clean up */
 	p_tmp->pp_entries = NULL;
 	p_tmp->p_nr = NULL;
+	p_tmp->p_occupied = NULL;
 	free(p_tmp);
-}
-
-int __attribute__((noinline)) CAS(uint64_t *addr, uint64_t old, uint64_t new) {
-	asm volatile goto (
-			"movq %[old], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movq %[new], %%RCX\n\t"
-			"movl %%ECX, %%EBX\n\t"
-			"shr $32, %%RCX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[done]"
-			:
-			:[old] "m" (old), [new] "m" (new), [addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:done
-	);
-	return 0;
-	done: return 1;
-}
-
-int __attribute__((noinline)) CAS1(ght_hash_entry_t **addr, ght_hash_entry_t **old, ght_hash_entry_t **new) {
-	asm volatile goto (
-			"movq %[old], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movq %[new], %%RCX\n\t"
-			"movl %%ECX, %%EBX\n\t"
-			"shr $32, %%RCX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[done]"
-			:
-			:[old] "m" (*old), [new] "m" (*new), [addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:done
-	);
-	return 0;
-	done: return 1;
-}
-
-/**this CAS is for when our old value is not a valid address
- * and it have 0x0 value.
- */
-int __attribute__((noinline)) CAS2(ght_hash_entry_t **addr, ght_hash_entry_t *old, ght_hash_entry_t **new) {
-	asm volatile goto (
-			"movq %[old], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movq %[new], %%RCX\n\t"
-			"movl %%ECX, %%EBX\n\t"
-			"shr $32, %%RCX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[done]"
-			:
-			:[old] "m" (old), [new] "m" (*new), [addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:done
-	);
-	return 0;
-	done: return 1;
-}
-/**
- * this function set the lowest 2 bits of memory address to zero
- * and return true if the memory location was not changed. otherwise
- * return false and don't change the memory address. In other words,
- * this function remove both marks of deletetion and iteration.
- *
- * @param addr the address of memory location which must be UnMark!
- *
- * @return a boolean value indicating the successfulness of operation.
- */
-int __attribute__((noinline)) UnMark(ght_hash_entry_t **addr) {
-	asm volatile goto(
-			"movq %[addr], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movl %%EAX, %%EBX\n\t"
-			"movl %%EDX, %%ECX\n\t"
-			"andl $0xfffffffc, %%EBX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[success]"
-			:
-			:[addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:success
-	);
-	return 0;
-	success: return 1;
-}
-
-/**
- * this function just delete the iteration mark.
- */
-int __attribute__((noinline)) UnMark_iteration(ght_hash_entry_t **addr) {
-	asm volatile goto(
-			"movq %[addr], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movl %%EAX, %%EBX\n\t"
-			"movl %%EDX, %%ECX\n\t"
-			"andl $0xfffffffd, %%EBX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[success]"
-			:
-			:[addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:success
-	);
-	return 0;
-	success: return 1;
-}
 
-/**
- * this function add the value to the address in an atomic manner.
- * the value can be a negative number.
- */
-inline void FAA(unsigned int *address, signed int value) {
-	asm volatile (
-			"movl %[val], %%eax\n\t"
-			"lock\n\t"
-			"XADD %%eax, %[addr]"
-			:
-			:[val] "m" (value), [addr] "m" (*address)
-			:"eax", "memory"
-	);
-}
-
-/**
- * this function Set the lowest bit of 'addr' argument if it wasn't
- * mark before and return true. if the argument has been marked, don't
- * change it and return false.
- *
- * @param addr the address of memory location that must be mark!
- *
- * @return a boolean value indicating the successfulness of operation.
- */
-int __attribute__((noinline)) Mark_delete(ght_hash_entry_t **addr) {
-	asm volatile goto (
-			"movq %[addr], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movl %%EDX, %%ECX\n\t"
-			"movl %%EAX, %%EBX\n\t"
-			"andl $0xfffffff8, %%EAX\n\t"
-			"orl $0x1, %%EBX\n\t"
-			"andl $0xfffffffd, %%EBX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[success]"
-			:
-			:[addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:success
-	);
-	return 0;
-	success: return 1;
-}
-
-int __attribute__((noinline)) Unmark_delete(ght_hash_entry_t *addr) {
-	asm volatile goto(
-			"movq %[addr], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movl %%EAX, %%EBX\n\t"
-			"movl %%EDX, %%ECX\n\t"
-			"andl $0xfffffffe, %%EBX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[success]"
-			:
-			:[addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:success
-	);
-	return 0;
-	success: return 1;
-}
-
-int __attribute__((noinline)) Force_Mark_Delete(ght_hash_entry_t **addr) {
-	asm volatile goto (
-		"movq %[addr], %%RDX\n\t"
-		"movl %%EDX, %%EAX\n\t"
-		"shr $32, %%RDX\n\t"
-		"movl %%EDX, %%ECX\n\t"
-		"movl %%EAX, %%EBX\n\t"
-		"andl $0xfffffffa, %%EAX\n\t"
-		"orl $0x1, %%EBX\n\t"
-		"lock\n\t"
-		"cmpxchg8b %[addr]\n\t"
-		"jz %l[success]"
-		:
-		:[addr] "m" (*addr)
-		:"rax", "rbx", "rcx", "rdx"
-		:success
-		);
-	return 0;
-	success: return 1;
-}
-
-/**
- *this function mark the second bit of address if and only if
- *the address have no mark.
- */
-int __attribute__((noinline)) Mark_iteration(ght_hash_entry_t **addr) {
-	asm volatile goto (
-			"movq %[addr], %%RDX\n\t"
-			"movl %%EDX, %%EAX\n\t"
-			"shr $32, %%RDX\n\t"
-			"movl %%EAX, %%EBX\n\t"
-			"movl %%EDX, %%ECX\n\t"
-			"orl $0x2, %%EBX\n\t"
-			"andl $0xfffffffe, %%EBX\n\t"
-			"andl $0xfffffff8, %%EAX\n\t"
-			"lock\n\t"
-			"cmpxchg8b %[addr]\n\t"
-			"jz %l[success]"
-			:
-			:[addr] "m" (*addr)
-			:"rax", "rbx", "rcx", "rdx"
-			:success
-	);
-	return 0;
-	success: return 1;
-}
-
-int __attribute__((noinline)) Has_Delete_Mark(ght_hash_entry_t **addr) {
-	asm volatile goto (
-			"movq %[addr], %%RDX\n\t"
-			"andl $0x1, %%EDX\n\t"
-			"test %%EDX, %%EDX\n\t"
-			"jz %l[fail]"
-			:
-			:[addr] "m" (*addr)
-			:"rdx"
-			:fail
-	);
-	return 1;
-	fail: return 0;
-}
-
-int __attribute__((noinline)) Has_Iteration_Mark(ght_hash_entry_t **addr) {
-	asm volatile goto (
-			"movq %[addr], %%RDX\n\t"
-			"andl $0x2, %%EDX\n\t"
-			"test %%EDX, %%EDX\n\t"
-			"jz %l[fail]"
-			:
-			:[addr] "m" (*addr)
-			:"rdx"
-			:fail
-	);
-	return 1;
-	fail: return 0;
-}
-
-int __attribute__((noinline)) Has_Mark(ght_hash_entry_t **addr) {
-	asm volatile goto (
-			"movq %[addr], %%RDX\n\t"
-			"andl $0x03, %%EDX\n\t"
-			"test %%EDX, %%EDX\n\t"
-			"jz %l[fail]"
-			:
-			:[addr] "m" (*addr)
-			:"rdx"
-			:fail
-	);
-	return 1;
-	fail: return 0;
-}
-
-int __attribute__((noinline)) Release(uint64_t *addr) {
-	fail:
-	asm volatile goto (
-				"movq %[addr], %%RDX\n\t"
-				"movl %%EDX, %%EAX\n\t"
-				"movq %%RDX, %%RCX\n\t"
-				"shr $32, %%RDX\n\t"
-				"cmp $1, %%RCX\n\t"
-				"je L3\n\t"
-				"cmp $0, %%RCX\n\t"
-				"je L1\n\t"
-				"sub $2, %%RCX\n\t"
-				"cmp $0, %%RCX\n\t"
-				"jne L2\n\t"
-				"L1: \n\t"
-				"movq $1, %%RCX\n\t"
-				"L2: \n\t"
-				"movl %%ECX, %%EBX\n\t"
-				"shr $32, %%RCX\n\t"
-				"cmpxchg8b %[addr]\n\t"
-				"jnz %l[fail]\n\t"
-				"jmp %l[success]\n\t"
-				"L3:\n\t"
-				:
-				:[addr] "m" (*addr)
-				:"rax", "rbx", "rcx", "rdx"
-				:fail, success
-		);
-	return 0;
-	success: return 1;
-}
-
-//this function operate in two different states
-//1. if the data of input address is even, then return 0;
-//2. if the data of input address is odd , then plus 2 and return 1;
-int __attribute__((noinline)) safeRead(uint64_t *addr) {
-	fail:
-	asm volatile goto (
-				"movq %[addr], %%RDX\n\t"
-				"movl %%EDX, %%EAX\n\t"
-				"movq %%RDX, %%RCX\n\t"
-				"shr $32, %%RDX\n\t"
-				"add $2, %%RCX\n\t"
-				"movq %%RCX, %%RBX\n\t"
-				"andl $0x1, %%EBX\n\t"
-				"test %%EBX, %%EBX\n\t"
-				"jnz finish\n\t"
-				"movl %%ECX, %%EBX\n\t"
-				"shr $32, %%RCX\n\t"
-				"cmpxchg8b %[addr]\n\t"
-				"jnz %l[fail]\n\t"
-				"jmp %l[success]\n\t"
-				"finish:\n\t"
-				:
-				:[addr] "m" (*addr)
-				:"rax", "rbx", "rcx", "rdx"
-				:fail, success
-		);
-	return 0;
-	success: return 1;
+	/* The cached bucket numbers are stale now */
+	if (p_ht->p_version) {
+		free(p_ht->p_version);
+		if (!(p_ht->p_version = (unsigned int*) calloc(p_ht->i_size, sizeof(unsigned int))))
+			perror("calloc");
+	}
+	/* Every entry has moved, the next delta is full */
+	if (p_ht->p_dirty) {
+		free(p_ht->p_dirty);
+		if (!(p_ht->p_dirty = (uint64_t*) malloc(DIRTY_WORDS(p_ht->i_size) * sizeof(uint64_t))))
+			perror("malloc");
+		else
+			memset(p_ht->p_dirty, 0xff, DIRTY_WORDS(p_ht->i_size) * sizeof(uint64_t));
+	}
+	p_ht->i_id = new_table_id();
 }
@@ -1,165 +1,861 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>     /* sysconf */
+#include <sys/mman.h>   /* madvise */
+#endif
+
 #include "ght_hash_table.h"
 #include "memory_mng.h"
+#include "ght_private.h"
+
+/* An entry followed by its key, rounded up to keep the entries aligned */
+#define SLOT_SIZE( key_size ) ( ( sizeof( ght_hash_entry_t ) + ( key_size ) + 7 ) & ~( size_t ) 7 )
+
+static void segment_free(LOCKLESS_SEGMENT_ST *segment){
+	ght_pages_free( segment->l1_array_lookup_table );
+	ght_pages_free( segment->l2_array_lookup_table );
+	ght_pages_free( segment->l3_array_lookup_table );
+	ght_pages_free( segment->static_memory );
+	free( segment );
+}
+
+/* Allocate a segment with all of its slots free, or return NULL. The
+ * bitmaps start out zero and are filled as find_free_word_in() takes
+ * fresh L3 words into use, so a new segment is only zero pages. */
+static LOCKLESS_SEGMENT_ST *segment_create(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	LOCKLESS_SEGMENT_ST *segment;
+
+	if ( !( segment = (LOCKLESS_SEGMENT_ST*)calloc( 1, sizeof( LOCKLESS_SEGMENT_ST ) ) ) )
+		return NULL;
+
+	segment->l1_array_lookup_table = (u_int64_t*)ght_pages_alloc_node( array_lookup->max_l1_array_lookup_table_size * sizeof( u_int64_t ), 0, array_lookup->node );
+	segment->l2_array_lookup_table = (u_int64_t*)ght_pages_alloc_node( array_lookup->max_l2_array_lookup_table_size * sizeof( u_int64_t ), 0, array_lookup->node );
+	segment->l3_array_lookup_table = (u_int64_t*)ght_pages_alloc_node( array_lookup->max_l3_array_lookup_table_size * sizeof( u_int64_t ), 0, array_lookup->node );
+	/* One slab, the keys are stored inline after each entry */
+	segment->static_memory = ght_pages_alloc_node( (size_t)array_lookup->segment_size * array_lookup->slot_size, array_lookup->page_flags, array_lookup->node );
+	if ( !segment->l1_array_lookup_table || !segment->l2_array_lookup_table || !segment->l3_array_lookup_table ||
+			!segment->static_memory ) {
+		segment_free( segment );
+		return NULL;
+	}
 
-void init_array_lookup_table(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int max_l1_array_lookup_table_size, int max_core, void **static_memory, int key_size){
+	return segment;
+}
+
+/* Set up a pool without any segments */
+static int pool_init(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int max_l1_array_lookup_table_size, int max_core, int key_size, int page_flags){
 	int i = 0 ;
-	array_lookup->cur_allocated_num = 0;
-	array_lookup->max_core = max_core;
+
+	memset( array_lookup, 0, sizeof( *array_lookup ) );
+	array_lookup->page_flags = page_flags;
+	array_lookup->node = -1;
+	array_lookup->max_core = max_core > 0 ? max_core : 1;
+	array_lookup->key_size = key_size > 0 ? key_size : 1;
+	array_lookup->slot_size = SLOT_SIZE( array_lookup->key_size );
 	array_lookup->max_l1_array_lookup_table_size = max_l1_array_lookup_table_size;
 	array_lookup->max_l2_array_lookup_table_size = max_l1_array_lookup_table_size * 64;
 	array_lookup->max_l3_array_lookup_table_size = max_l1_array_lookup_table_size * 64 * 64; 
-	
-	array_lookup->l1_array_lookup_table = (u_int64_t*)calloc( array_lookup->max_l1_array_lookup_table_size , sizeof( u_int64_t ) );
-	array_lookup->l2_array_lookup_table = (u_int64_t*)calloc( array_lookup->max_l2_array_lookup_table_size , sizeof( u_int64_t ) );
-	array_lookup->l3_array_lookup_table = (u_int64_t*)calloc( array_lookup->max_l3_array_lookup_table_size , sizeof( u_int64_t ) );	
-	
-	
-	array_lookup->limit_size = max_l1_array_lookup_table_size * 64 * 64 * 64;
+	array_lookup->segment_size = max_l1_array_lookup_table_size * 64 * 64 * 64;
 
-	for ( i = 0 ; i < array_lookup->max_l1_array_lookup_table_size ; i++ )
-		array_lookup->l1_array_lookup_table[ i ] = 0xFFFFFFFFFFFFFFFF;
-	for ( i = 0 ; i < array_lookup->max_l2_array_lookup_table_size ; i++ )
-		array_lookup->l2_array_lookup_table[ i ] = 0xFFFFFFFFFFFFFFFF;
-	for ( i = 0 ; i < array_lookup->max_l3_array_lookup_table_size ; i++ )
-		array_lookup->l3_array_lookup_table[ i ] = 0xFFFFFFFFFFFFFFFF;
+	array_lookup->max_magazines = array_lookup->max_core;
+	if ( posix_memalign( ( void ** ) &array_lookup->magazines, 64, array_lookup->max_magazines * sizeof( LOCKLESS_MAGAZINE_ST ) ) != 0 ) {
+		printf("Can Not Allocated Magazines\n");
+		return -1;
+	}
+	for ( i = 0 ; i < array_lookup->max_magazines ; i++ ) {
+		memset( &array_lookup->magazines[ i ], 0, sizeof( LOCKLESS_MAGAZINE_ST ) );
+		array_lookup->magazines[ i ].alloc_word = -1;
+		array_lookup->magazines[ i ].free_word = -1;
+	}
+	return 0;
+}
 
+int init_array_lookup_table(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int max_l1_array_lookup_table_size, int max_core, void **static_memory, int key_size){
+	return init_array_lookup_table_ex( array_lookup, max_l1_array_lookup_table_size, max_core, static_memory, key_size, 0 );
+}
 
+int init_array_lookup_table_ex(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int max_l1_array_lookup_table_size, int max_core, void **static_memory, int key_size, int page_flags){
+	if ( pool_init( array_lookup, max_l1_array_lookup_table_size, max_core, key_size, page_flags ) < 0 )
+		return -1;
 
-	*static_memory = calloc(array_lookup->limit_size, sizeof(ght_hash_entry_t));
-	if(*static_memory == NULL){
-		printf("Can Not Allocated Static Memory size:%d\n", array_lookup->limit_size * sizeof(ght_hash_entry_t));
-		exit(0);
+	/* The pool starts with one segment and grows on demand */
+	if ( !( array_lookup->segments[ 0 ] = segment_create( array_lookup ) ) ) {
+		printf("Can Not Allocated Static Memory size:%lu\n", (unsigned long)array_lookup->segment_size * array_lookup->slot_size);
+		free( array_lookup->magazines );
+		array_lookup->magazines = NULL;
+		return -1;
 	}
-	ght_hash_entry_t *p_e = *static_memory;
-	for(i=0;i<array_lookup->limit_size;i++){
-		p_e[i].key.p_key = (void *)calloc(1, sizeof(key_size));
-		if(p_e[i].key.p_key == NULL){
-			printf("Can Not Allocated Static Memory For Key index:%d size:%d\n", i, key_size);
-			exit(0);
-		}
+	array_lookup->nr_segments = 1;
+	array_lookup->limit_size = array_lookup->segment_size;
+
+	if ( static_memory )
+		*static_memory = array_lookup->segments[ 0 ]->static_memory;
+	return 0;
+}
+
+void destroy_array_lookup_table(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	int i;
+
+	for ( i = 0 ; i < array_lookup->nr_segments ; i++ )
+		segment_free( array_lookup->segments[ i ] );
+	array_lookup->nr_segments = 0;
+	array_lookup->limit_size = 0;
+	free( array_lookup->magazines );
+	array_lookup->magazines = NULL;
+}
+
+/*
+ * The pool is made of segments of segment_size slots, which are never
+ * moved once created. Slot i of segment n has the index
+ * n * segment_size + i, and its L3 word has the global word number
+ * index / 64.
+ *
+ * Every slot has a bit in one of the L3 words of its segment, which is
+ * set while the slot is free. A bit in L2 is set if the L3 word below
+ * it may have free slots, and a bit in L1 likewise for L2. Stale L1
+ * and L2 bits are cleared lazily by find_free_word_in().
+ *
+ * In front of the bitmaps sits an array of magazines. A thread uses
+ * the magazine given by its thread number, and falls back to the
+ * bitmaps when another thread holds it. A magazine takes all the free
+ * slots of an L3 word with one CAS and collects freed slots of one L3
+ * word before returning them with one atomic or, so most allocations
+ * and frees touch no shared bitmap at all.
+ */
+
+#define SLOT_BIT( n ) ( ( u_int64_t ) 1 << ( n ) )
+
+static __thread int magazine_thread = -1;
+static unsigned int magazine_threads = 0;
+
+/* The magazine of the calling thread, whether it is free or not */
+static inline LOCKLESS_MAGAZINE_ST *magazine_of_thread(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	if ( magazine_thread < 0 )
+		magazine_thread = ght_atomic_fetch_add( &magazine_threads, 1 );
+	return &array_lookup->magazines[ magazine_thread % array_lookup->max_magazines ];
+}
+
+/* Count an event in the counters of the calling thread's magazine */
+#define MAGAZINE_COUNT( array_lookup, counter ) \
+	__atomic_fetch_add( &magazine_of_thread( array_lookup )->counter, 1, __ATOMIC_RELAXED )
+
+static inline LOCKLESS_MAGAZINE_ST *magazine_acquire(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	LOCKLESS_MAGAZINE_ST *magazine = magazine_of_thread( array_lookup );
+
+	if ( __atomic_exchange_n( &magazine->busy, 1, __ATOMIC_ACQUIRE ) ) {
+		__atomic_fetch_add( &magazine->misses, 1, __ATOMIC_RELAXED );
+		return NULL;
 	}
+	return magazine;
 }
 
-int lockless_alloc_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+/* Bump a counter only the holder of the magazine writes */
+#define MAGAZINE_COUNT_HELD( magazine, counter ) \
+	__atomic_store_n( &( magazine )->counter, ( magazine )->counter + 1, __ATOMIC_RELAXED )
+
+/* Count a slot as allocated and keep the high-water mark. held is the
+ * magazine the caller holds, or NULL. */
+static inline void count_alloc(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_MAGAZINE_ST *held){
+	u_int32_t allocated = ght_atomic_fetch_add( &array_lookup->cur_allocated_num, 1 ) + 1;
+	u_int32_t high_water = __atomic_load_n( &array_lookup->high_water, __ATOMIC_RELAXED );
+
+	while ( allocated > high_water &&
+			!__atomic_compare_exchange_n( &array_lookup->high_water, &high_water, allocated, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+		;
+	if ( held )
+		MAGAZINE_COUNT_HELD( held, allocs );
+	else
+		MAGAZINE_COUNT( array_lookup, shared_allocs );
+}
+
+static inline void magazine_release(LOCKLESS_MAGAZINE_ST *magazine){
+	__atomic_store_n( &magazine->busy, 0, __ATOMIC_RELEASE );
+}
+
+/* The L3 word of a global word number */
+static inline u_int64_t *l3_word(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int word){
+	LOCKLESS_SEGMENT_ST *segment = array_lookup->segments[ word / array_lookup->max_l3_array_lookup_table_size ];
+
+	return &segment->l3_array_lookup_table[ word % array_lookup->max_l3_array_lookup_table_size ];
+}
 
-	if ( array_lookup->cur_allocated_num > array_lookup->limit_size ) return -1;
-	int found =0;
-	int index = -1;
-
-	
-	
-	int l1_buket_index_remainded=-1;
-	int l2_buket_index_remainded=-1;
-	int l3_buket_index_remainded=-1;
-	
-	int l2_free_node_index =-1;
-	int l3_free_node_index =-1;
-	
+/* Mark the slots in mask of an L3 word of a segment free */
+static void segment_free_run(LOCKLESS_SEGMENT_ST *segment, int l3_buket_index, u_int64_t mask){
+	int l2_buket_index = l3_buket_index / 64;
+	int l1_buket_index = l2_buket_index / 64;
+
+	__atomic_fetch_or( &segment->l3_array_lookup_table[ l3_buket_index ], mask, __ATOMIC_RELEASE );
+	__atomic_fetch_or( &segment->l2_array_lookup_table[ l2_buket_index ], SLOT_BIT( l3_buket_index % 64 ), __ATOMIC_RELEASE );
+	__atomic_fetch_or( &segment->l1_array_lookup_table[ l1_buket_index ], SLOT_BIT( l2_buket_index % 64 ), __ATOMIC_RELEASE );
+}
+
+/* Take the next L3 word which was never used into use, with all of
+ * its slots free. Returns its index, or -1 if there is none left. */
+static int fresh_word(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_SEGMENT_ST *segment){
+	int word;
+
+	if ( __atomic_load_n( &segment->fresh_words, __ATOMIC_ACQUIRE ) >= array_lookup->max_l3_array_lookup_table_size )
+		return -1;
+	word = __atomic_fetch_add( &segment->fresh_words, 1, __ATOMIC_ACQ_REL );
+	if ( word >= array_lookup->max_l3_array_lookup_table_size )
+		return -1;
+	segment_free_run( segment, word, ~( u_int64_t ) 0 );
+	return word;
+}
+
+/* Return the index of an L3 word of the segment which had free slots, or -1 */
+static int find_free_word_in(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_SEGMENT_ST *segment){
+	int l1_loop_index;
+	int l1_buket_index_remainded;
+	int l2_buket_index_remainded;
+	int l2_free_node_index;
+	int l3_free_node_index;
+	int step;
 	u_int64_t cas_old_value;
-	u_int64_t cas_new_value;
-	
-	int l1_loop_index=0;
-	int step = array_lookup->max_core;
+
 	fail_alloc_memory :
 	l1_loop_index = array_lookup->cur_allocated_num % array_lookup->max_core;
+	step = array_lookup->max_core;
 	fail_alloc_memory_2 :
-	found =0;
-	for ( ; l1_loop_index < array_lookup->max_l1_array_lookup_table_size && !found; l1_loop_index+=step ) {
-		if ( 0 != array_lookup->l1_array_lookup_table[ l1_loop_index ] ) {
-			l1_buket_index_remainded = ffsll( array_lookup->l1_array_lookup_table[ l1_loop_index ] ) - 1;
-			l2_free_node_index = ( l1_loop_index * 64 ) + l1_buket_index_remainded;
-			found = 1;
+	for ( ; l1_loop_index < array_lookup->max_l1_array_lookup_table_size; l1_loop_index+=step ) {
+		if ( 0 != __atomic_load_n( &segment->l1_array_lookup_table[ l1_loop_index ], __ATOMIC_ACQUIRE ) )
 			break;
-		}
 	}
-	if(!found || l2_free_node_index < 0){
-		if(array_lookup->cur_allocated_num < array_lookup->limit_size){
+	if ( l1_loop_index >= array_lookup->max_l1_array_lookup_table_size ) {
+		if ( step != 1 ) {
 			l1_loop_index = 0;
-			step=1;
+			step = 1;
 			goto fail_alloc_memory_2;
 		}
-		return NULL;
+		/* Nothing was freed, carry on into the untouched words */
+		return fresh_word( array_lookup, segment );
 	}
-	//l1_loop_index-=step;
-	// printf(" l1_buket_index_remainded:%d", l1_buket_index_remainded);
-	
+
 	fail_alloc_memory_from_L2 :
-	cas_old_value = array_lookup->l1_array_lookup_table[ l1_loop_index ];	
-	l2_buket_index_remainded = ffsll( array_lookup->l2_array_lookup_table[ l2_free_node_index ] ) - 1;
-	// printf(" l2_buket_index_remainded:%d", l2_buket_index_remainded);
+	cas_old_value = __atomic_load_n( &segment->l1_array_lookup_table[ l1_loop_index ], __ATOMIC_ACQUIRE );
+	if ( cas_old_value == 0 )
+		goto fail_alloc_memory;
+	l1_buket_index_remainded = ffsll( cas_old_value ) - 1;
+	l2_free_node_index = ( l1_loop_index * 64 ) + l1_buket_index_remainded;
+	l2_buket_index_remainded = ffsll( __atomic_load_n( &segment->l2_array_lookup_table[ l2_free_node_index ], __ATOMIC_ACQUIRE ) ) - 1;
 	if(l2_buket_index_remainded == -1){
-		cas_new_value = cas_old_value & ( 0xFFFFFFFFFFFFFFFF ^ ( ( u_int64_t ) pow( 2 , l1_buket_index_remainded ) ) );
-		if(!CAS1(&array_lookup->l1_array_lookup_table[ l1_loop_index ], &cas_old_value , &cas_new_value) ) {
-			goto fail_alloc_memory_from_L2;
-		}
-		goto fail_alloc_memory;	
+		if ( !ght_atomic_cas_u64(&segment->l1_array_lookup_table[ l1_loop_index ], cas_old_value, cas_old_value & ~SLOT_BIT( l1_buket_index_remainded ) ) )
+			MAGAZINE_COUNT( array_lookup, cas_retries );
+		else if ( 0 != __atomic_load_n( &segment->l2_array_lookup_table[ l2_free_node_index ], __ATOMIC_ACQUIRE ) )
+			/* A free set the L2 word after we looked, keep it visible */
+			__atomic_fetch_or( &segment->l1_array_lookup_table[ l1_loop_index ], SLOT_BIT( l1_buket_index_remainded ), __ATOMIC_RELEASE );
+		goto fail_alloc_memory_from_L2;
 	}
-	
+
 	fail_alloc_memory_from_L3 :
-	cas_old_value = array_lookup->l2_array_lookup_table[ l2_free_node_index ];	
-	l3_free_node_index = (l2_free_node_index * 64) + l2_buket_index_remainded;	
-	l3_buket_index_remainded = ffsll( array_lookup->l3_array_lookup_table[ l3_free_node_index ] ) -1 ;	
-	// printf(" l3_buket_index_remainded:%d\n", l3_buket_index_remainded);	
-	if(l3_buket_index_remainded == -1){
-		cas_new_value = cas_old_value & ( 0xFFFFFFFFFFFFFFFF ^ ( ( u_int64_t ) pow( 2 , l2_buket_index_remainded ) ) );
-		if(!CAS1(&array_lookup->l2_array_lookup_table[ l2_free_node_index ], &cas_old_value , &cas_new_value) ){
-			goto fail_alloc_memory_from_L3;	
-		}
+	cas_old_value = __atomic_load_n( &segment->l2_array_lookup_table[ l2_free_node_index ], __ATOMIC_ACQUIRE );
+	if ( cas_old_value == 0 )
 		goto fail_alloc_memory_from_L2;
-	}
-	
-	cas_old_value = array_lookup->l3_array_lookup_table[ l3_free_node_index ];
-	cas_new_value = cas_old_value & ( 0xFFFFFFFFFFFFFFFF ^ ( ( u_int64_t ) pow( 2 , l3_buket_index_remainded ) ) );
-	if(cas_old_value == cas_new_value)
-		goto fail_alloc_memory_from_L3;
-	if( !CAS1(&array_lookup->l3_array_lookup_table[ l3_free_node_index ], &cas_old_value , &cas_new_value) ){
+	l2_buket_index_remainded = ffsll( cas_old_value ) - 1;
+	l3_free_node_index = (l2_free_node_index * 64) + l2_buket_index_remainded;
+	if ( 0 == __atomic_load_n( &segment->l3_array_lookup_table[ l3_free_node_index ], __ATOMIC_ACQUIRE ) ) {
+		if ( !ght_atomic_cas_u64(&segment->l2_array_lookup_table[ l2_free_node_index ], cas_old_value, cas_old_value & ~SLOT_BIT( l2_buket_index_remainded ) ) )
+			MAGAZINE_COUNT( array_lookup, cas_retries );
+		else if ( 0 != __atomic_load_n( &segment->l3_array_lookup_table[ l3_free_node_index ], __ATOMIC_ACQUIRE ) )
+			__atomic_fetch_or( &segment->l2_array_lookup_table[ l2_free_node_index ], SLOT_BIT( l2_buket_index_remainded ), __ATOMIC_RELEASE );
 		goto fail_alloc_memory_from_L3;
 	}
-	index = (l3_free_node_index * 64) + l3_buket_index_remainded;
-	FAA(&array_lookup->cur_allocated_num,1);
+	return l3_free_node_index;
+}
+
+/* Append a segment unless somebody else did since we saw nr_segments
+ * segments. Returns false if the pool cannot grow. */
+static int grow(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int nr_segments){
+	LOCKLESS_SEGMENT_ST *segment;
+
+	if ( nr_segments >= LOCKLESS_MAX_SEGMENTS )
+		return 0;
+	if ( __atomic_exchange_n( &array_lookup->growing, 1, __ATOMIC_ACQUIRE ) ) {
+		while ( __atomic_load_n( &array_lookup->growing, __ATOMIC_ACQUIRE ) )
+			ght_cpu_relax();
+		return __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE ) != nr_segments;
+	}
+	if ( __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE ) == nr_segments ) {
+		if ( !( segment = segment_create( array_lookup ) ) ) {
+			__atomic_store_n( &array_lookup->growing, 0, __ATOMIC_RELEASE );
+			return 0;
+		}
+		array_lookup->segments[ nr_segments ] = segment;
+		__atomic_add_fetch( &array_lookup->limit_size, array_lookup->segment_size, __ATOMIC_RELEASE );
+		/* Publishes the segment */
+		__atomic_store_n( &array_lookup->nr_segments, nr_segments + 1, __ATOMIC_RELEASE );
+	}
+	__atomic_store_n( &array_lookup->growing, 0, __ATOMIC_RELEASE );
+	return 1;
+}
+
+/* Return the global number of an L3 word which had free slots, growing
+ * the pool if all segments are full, or -1 */
+static int find_free_word(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	int nr_segments;
+	int word;
+	int i;
+
+	do {
+		nr_segments = __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE );
+		/* Fill the oldest segments first, so the trailing ones can
+		 * empty out and be released */
+		for ( i = 0 ; i < nr_segments ; i++ ) {
+			if ( ( word = find_free_word_in( array_lookup, array_lookup->segments[ i ] ) ) >= 0 )
+				return i * array_lookup->max_l3_array_lookup_table_size + word;
+		}
+	} while ( grow( array_lookup, nr_segments ) );
+	return -1;
+}
+
+/* Mark the slots in mask of a global L3 word free */
+static void free_run(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int word, u_int64_t mask){
+	segment_free_run( array_lookup->segments[ word / array_lookup->max_l3_array_lookup_table_size ],
+			word % array_lookup->max_l3_array_lookup_table_size, mask );
+}
+
+/* Allocate one slot from the bitmaps */
+static int shared_alloc(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	int l3_free_node_index;
+	int l3_buket_index_remainded;
+	u_int64_t *p_word;
+	u_int64_t cas_old_value;
+
+	while ( ( l3_free_node_index = find_free_word( array_lookup ) ) >= 0 ) {
+		p_word = l3_word( array_lookup, l3_free_node_index );
+		cas_old_value = __atomic_load_n( p_word, __ATOMIC_ACQUIRE );
+		while ( cas_old_value != 0 ) {
+			l3_buket_index_remainded = ffsll( cas_old_value ) - 1;
+			if ( __atomic_compare_exchange_n( p_word, &cas_old_value, cas_old_value & ~SLOT_BIT( l3_buket_index_remainded ),
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+				return (l3_free_node_index * 64) + l3_buket_index_remainded;
+			MAGAZINE_COUNT( array_lookup, cas_retries );
+		}
+	}
+	return -1;
+}
+
+/* Take all free slots of an L3 word into the magazine */
+static int magazine_refill(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_MAGAZINE_ST *magazine){
+	int l3_free_node_index;
+	u_int64_t mask;
+
+	while ( ( l3_free_node_index = find_free_word( array_lookup ) ) >= 0 ) {
+		mask = __atomic_exchange_n( l3_word( array_lookup, l3_free_node_index ), 0, __ATOMIC_ACQ_REL );
+		if ( mask != 0 ) {
+			magazine->alloc_word = l3_free_node_index;
+			magazine->alloc_mask = mask;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Return the slots a magazine holds to the bitmaps */
+static void magazine_drain(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_MAGAZINE_ST *magazine){
+	if ( magazine->alloc_mask )
+		free_run( array_lookup, magazine->alloc_word, magazine->alloc_mask );
+	if ( magazine->free_mask )
+		free_run( array_lookup, magazine->free_word, magazine->free_mask );
+	magazine->alloc_word = -1;
+	magazine->alloc_mask = 0;
+	magazine->free_word = -1;
+	magazine->free_mask = 0;
+}
+
+/* shared_alloc(), counted */
+static int counted_shared_alloc(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	int index;
+
+	if ( ( index = shared_alloc( array_lookup ) ) >= 0 )
+		count_alloc( array_lookup, NULL );
+	else
+		MAGAZINE_COUNT( array_lookup, failed_allocs );
+	return index;
+}
+
+int lockless_alloc_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	LOCKLESS_MAGAZINE_ST *magazine;
+	int index;
+
+	if ( !( magazine = magazine_acquire( array_lookup ) ) )
+		return counted_shared_alloc( array_lookup );
+
+	if ( magazine->alloc_mask == 0 ) {
+		/* Reuse what was freed through this magazine before taking more */
+		if ( magazine->free_mask != 0 ) {
+			magazine->alloc_word = magazine->free_word;
+			magazine->alloc_mask = magazine->free_mask;
+			magazine->free_word = -1;
+			magazine->free_mask = 0;
+		}
+		else if ( !magazine_refill( array_lookup, magazine ) ) {
+			magazine_release( magazine );
+			/* The last free slots may sit in the other magazines */
+			lockless_flush_memory( array_lookup );
+			return counted_shared_alloc( array_lookup );
+		}
+	}
+
+	index = ffsll( magazine->alloc_mask ) - 1;
+	magazine->alloc_mask &= magazine->alloc_mask - 1;
+	index += magazine->alloc_word * 64;
+	count_alloc( array_lookup, magazine );
+	magazine_release( magazine );
 
 	return index;
 }
 
 void lockless_dealloc_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int index){
-	if(index >= array_lookup->limit_size)
+	LOCKLESS_MAGAZINE_ST *magazine;
+	int l3_buket_index = index / 64;
+	u_int64_t t = SLOT_BIT( index % 64 );
+
+	if(index < 0 || index >= __atomic_load_n( &array_lookup->limit_size, __ATOMIC_ACQUIRE ))
 		return;
-	int l3_buket_index = ( int ) ( ( double ) index / ( double ) 64 );
-	int l3_buket_index_remainded = index % 64;
-	int l2_buket_index = ( int ) ( ( double ) l3_buket_index / ( double ) 64 );
-	int l2_buket_index_remainded = l3_buket_index % 64;
-	
-	int l1_buket_index = ( int ) ( ( double ) l2_buket_index / ( double ) 64 );
-	int l1_buket_index_remainded = l2_buket_index % 64;
-	
+
+	if ( !( magazine = magazine_acquire( array_lookup ) ) ) {
+		free_run( array_lookup, l3_buket_index, t );
+		MAGAZINE_COUNT( array_lookup, shared_frees );
+	}
+	else {
+		if ( l3_buket_index == magazine->alloc_word )
+			magazine->alloc_mask |= t;
+		else {
+			if ( l3_buket_index != magazine->free_word ) {
+				if ( magazine->free_mask )
+					free_run( array_lookup, magazine->free_word, magazine->free_mask );
+				magazine->free_word = l3_buket_index;
+				magazine->free_mask = 0;
+			}
+			magazine->free_mask |= t;
+		}
+		MAGAZINE_COUNT_HELD( magazine, frees );
+		magazine_release( magazine );
+	}
+	FAA(&array_lookup->cur_allocated_num,-1);
+}
+
+void lockless_flush_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	LOCKLESS_MAGAZINE_ST *magazine;
+	int i;
+
+	for ( i = 0 ; i < array_lookup->max_magazines ; i++ ) {
+		magazine = &array_lookup->magazines[ i ];
+		/* A magazine in use is skipped, its slots come back later */
+		if ( __atomic_exchange_n( &magazine->busy, 1, __ATOMIC_ACQUIRE ) )
+			continue;
+		magazine_drain( array_lookup, magazine );
+		magazine_release( magazine );
+	}
+}
+
+int lockless_shrink_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	LOCKLESS_SEGMENT_ST *segment;
+	int released = 0;
+	int i;
+
+	lockless_flush_memory( array_lookup );
+
+	/* The first segment is kept, so the pool never becomes empty */
+	while ( array_lookup->nr_segments > 1 ) {
+		segment = array_lookup->segments[ array_lookup->nr_segments - 1 ];
+		/* The words never taken into use are free as well */
+		for ( i = 0 ; i < segment->fresh_words && i < array_lookup->max_l3_array_lookup_table_size ; i++ ) {
+			if ( segment->l3_array_lookup_table[ i ] != 0xFFFFFFFFFFFFFFFF )
+				return released;
+		}
+		array_lookup->nr_segments--;
+		array_lookup->limit_size -= array_lookup->segment_size;
+		array_lookup->segments[ array_lookup->nr_segments ] = NULL;
+		segment_free( segment );
+		released++;
+	}
+	return released;
+}
+
+void lockless_memory_stats(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_MEMORY_STATS_ST *stats){
+	LOCKLESS_MAGAZINE_ST *magazine;
+	int i;
+
+	memset( stats, 0, sizeof( *stats ) );
+	for ( i = 0 ; i < array_lookup->max_magazines ; i++ ) {
+		magazine = &array_lookup->magazines[ i ];
+		stats->allocs += __atomic_load_n( &magazine->allocs, __ATOMIC_RELAXED ) +
+			__atomic_load_n( &magazine->shared_allocs, __ATOMIC_RELAXED );
+		stats->frees += __atomic_load_n( &magazine->frees, __ATOMIC_RELAXED ) +
+			__atomic_load_n( &magazine->shared_frees, __ATOMIC_RELAXED );
+		stats->failed_allocs += __atomic_load_n( &magazine->failed_allocs, __ATOMIC_RELAXED );
+		stats->cas_retries += __atomic_load_n( &magazine->cas_retries, __ATOMIC_RELAXED );
+		stats->magazine_misses += __atomic_load_n( &magazine->misses, __ATOMIC_RELAXED );
+	}
+	stats->allocated = __atomic_load_n( &array_lookup->cur_allocated_num, __ATOMIC_RELAXED );
+	stats->high_water = __atomic_load_n( &array_lookup->high_water, __ATOMIC_RELAXED );
+	stats->limit_size = __atomic_load_n( &array_lookup->limit_size, __ATOMIC_RELAXED );
+	stats->nr_segments = __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE );
+}
+
+void lockless_memory_fragmentation(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_MEMORY_FRAG_ST *frag){
+	LOCKLESS_SEGMENT_ST *segment;
+	LOCKLESS_MAGAZINE_ST *magazine;
+	int nr_segments = __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE );
+	int in_use;
+	u_int64_t word;
+	int i, j;
+
+	memset( frag, 0, sizeof( *frag ) );
+	for ( i = 0 ; i < nr_segments ; i++ ) {
+		segment = array_lookup->segments[ i ];
+		for ( j = 0 ; j < array_lookup->max_l1_array_lookup_table_size ; j++ )
+			frag->l1_bits += __builtin_popcountll( __atomic_load_n( &segment->l1_array_lookup_table[ j ], __ATOMIC_RELAXED ) );
+		/* Only the L2 words above L3 words in use can have bits set */
+		in_use = __atomic_load_n( &segment->fresh_words, __ATOMIC_ACQUIRE );
+		if ( in_use > array_lookup->max_l3_array_lookup_table_size )
+			in_use = array_lookup->max_l3_array_lookup_table_size;
+		for ( j = 0 ; j < ( in_use + 63 ) / 64 ; j++ )
+			frag->l2_bits += __builtin_popcountll( __atomic_load_n( &segment->l2_array_lookup_table[ j ], __ATOMIC_RELAXED ) );
+		for ( j = 0 ; j < in_use ; j++ ) {
+			word = __atomic_load_n( &segment->l3_array_lookup_table[ j ], __ATOMIC_RELAXED );
+			if ( word == 0 )
+				frag->words_full++;
+			else if ( word == ~( u_int64_t ) 0 )
+				frag->words_empty++;
+			else
+				frag->words_partial++;
+			frag->free_slots += __builtin_popcountll( word );
+		}
+		frag->words_untouched += array_lookup->max_l3_array_lookup_table_size - in_use;
+		frag->l1_words += array_lookup->max_l1_array_lookup_table_size;
+		frag->l2_words += array_lookup->max_l2_array_lookup_table_size;
+	}
+	for ( i = 0 ; i < array_lookup->max_magazines ; i++ ) {
+		magazine = &array_lookup->magazines[ i ];
+		frag->cached_slots += __builtin_popcountll( __atomic_load_n( &magazine->alloc_mask, __ATOMIC_RELAXED ) ) +
+			__builtin_popcountll( __atomic_load_n( &magazine->free_mask, __ATOMIC_RELAXED ) );
+	}
+}
+
+void *lockless_memory_slot(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int index){
+	LOCKLESS_SEGMENT_ST *segment = array_lookup->segments[ index / array_lookup->segment_size ];
+
+	return (char *)segment->static_memory + (size_t)( index % array_lookup->segment_size ) * array_lookup->slot_size;
+}
+
+int lockless_memory_index(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, void *p){
+	char *p_start;
+	int nr_segments = __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE );
+	int i;
+
+	for ( i = 0 ; i < nr_segments ; i++ ) {
+		p_start = (char *)array_lookup->segments[ i ]->static_memory;
+		if ( (char *)p >= p_start && (char *)p < p_start + (size_t)array_lookup->segment_size * array_lookup->slot_size )
+			return i * array_lookup->segment_size + ( (char *)p - p_start ) / array_lookup->slot_size;
+	}
+	return -1;
+}
+
+/* The L3 words of a segment which have been taken into use */
+static inline int words_in_use(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_SEGMENT_ST *segment){
+	int in_use = __atomic_load_n( &segment->fresh_words, __ATOMIC_ACQUIRE );
+
+	return in_use < array_lookup->max_l3_array_lookup_table_size ? in_use : array_lookup->max_l3_array_lookup_table_size;
+}
+
+int lockless_memory_words(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	return __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE ) * array_lookup->max_l3_array_lookup_table_size;
+}
+
+u_int64_t lockless_memory_used(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int word){
+	LOCKLESS_SEGMENT_ST *segment = array_lookup->segments[ word / array_lookup->max_l3_array_lookup_table_size ];
+	int i = word % array_lookup->max_l3_array_lookup_table_size;
+
+	if ( i >= words_in_use( array_lookup, segment ) )
+		return 0;
+	return ~__atomic_load_n( &segment->l3_array_lookup_table[ i ], __ATOMIC_ACQUIRE );
+}
+
+int lockless_alloc_memory_below(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int *cursor, int index){
+	u_int64_t *p_word;
 	u_int64_t cas_old_value;
-	u_int64_t cas_new_value;
-	
-	u_int64_t t = pow( 2 , l3_buket_index_remainded );
-	fail_dealloc_memory_from_L3:
-	// array_lookup->l3_array_lookup_table[ l3_buket_index ] = array_lookup->l3_array_lookup_table[ l3_buket_index ] | t;
-	cas_old_value = array_lookup->l3_array_lookup_table[ l3_buket_index ];
-	cas_new_value = cas_old_value | t;
-	if(cas_old_value == cas_new_value)
-		return ;
-		
-	if(!CAS1(&array_lookup->l3_array_lookup_table[ l3_buket_index ], &cas_old_value, &cas_new_value))
-		goto fail_dealloc_memory_from_L3;
-
-	t = pow( 2 , l2_buket_index_remainded );
-	fail_dealloc_memory_from_L2:
-	// array_lookup->l2_array_lookup_table[ l2_buket_index ] = array_lookup->l2_array_lookup_table[ l2_buket_index ] | t;
-	cas_old_value = array_lookup->l2_array_lookup_table[ l2_buket_index ];
-	cas_new_value = cas_old_value | t;
-	if(!CAS1(&array_lookup->l2_array_lookup_table[ l2_buket_index ], &cas_old_value, &cas_new_value))
-		goto fail_dealloc_memory_from_L2;
-
-	t = pow( 2 , l1_buket_index_remainded );
-	fail_dealloc_memory_from_L1:
-	//array_lookup->l1_array_lookup_table[ l1_buket_index ] = array_lookup->l1_array_lookup_table[ l1_buket_index ] | t;
-	cas_old_value = array_lookup->l1_array_lookup_table[ l1_buket_index ];
-	cas_new_value = cas_old_value | t;
-	if(!CAS1(&array_lookup->l1_array_lookup_table[ l1_buket_index ], &cas_old_value, &cas_new_value))
-		goto fail_dealloc_memory_from_L1;	
-	FAA(&array_lookup->cur_allocated_num,-1);	
+	int word;
+	int bit;
+
+	for ( word = *cursor ; word < index / 64 ; word++ ) {
+		/* Skip the untouched words at the end of a segment */
+		if ( word % array_lookup->max_l3_array_lookup_table_size >=
+				words_in_use( array_lookup, array_lookup->segments[ word / array_lookup->max_l3_array_lookup_table_size ] ) ) {
+			word |= array_lookup->max_l3_array_lookup_table_size - 1;
+			continue;
+		}
+		p_word = l3_word( array_lookup, word );
+		cas_old_value = __atomic_load_n( p_word, __ATOMIC_ACQUIRE );
+		/* Only partially used words, the empty ones are left to trim */
+		while ( cas_old_value != 0 && cas_old_value != ~( u_int64_t ) 0 ) {
+			bit = ffsll( cas_old_value ) - 1;
+			if ( __atomic_compare_exchange_n( p_word, &cas_old_value, cas_old_value & ~SLOT_BIT( bit ),
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+				count_alloc( array_lookup, NULL );
+				*cursor = word;
+				return word * 64 + bit;
+			}
+			MAGAZINE_COUNT( array_lookup, cas_retries );
+		}
+	}
+	*cursor = word;
+	return -1;
+}
+
+size_t lockless_trim_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup){
+	size_t released = 0;
+#ifdef __linux__
+	LOCKLESS_SEGMENT_ST *segment;
+	size_t page = (size_t)sysconf( _SC_PAGESIZE );
+	size_t group = (size_t)64 * array_lookup->slot_size;
+	int nr_segments = __atomic_load_n( &array_lookup->nr_segments, __ATOMIC_ACQUIRE );
+	int in_use;
+	uintptr_t start, end;
+	int i, j, run;
+
+	/* Dropping part of a huge page would split it */
+	if ( array_lookup->page_flags & ( GHT_PAGES_HUGE | GHT_PAGES_HUGE_1GB ) )
+		return 0;
+
+	lockless_flush_memory( array_lookup );
+	for ( i = 0 ; i < nr_segments ; i++ ) {
+		segment = array_lookup->segments[ i ];
+		in_use = words_in_use( array_lookup, segment );
+		for ( j = 0 ; j < in_use ; j++ ) {
+			/* Take a run of free words, so no slot of them is handed
+			 * out while their pages are dropped */
+			for ( run = j ; run < in_use ; run++ ) {
+				if ( !ght_atomic_cas_u64( &segment->l3_array_lookup_table[ run ], ~( u_int64_t ) 0, 0 ) )
+					break;
+			}
+			if ( run == j )
+				continue;
+
+			/* Only the pages which lie wholly within the run */
+			start = ( (uintptr_t)segment->static_memory + j * group + page - 1 ) & ~( uintptr_t )( page - 1 );
+			end = ( (uintptr_t)segment->static_memory + run * group ) & ~( uintptr_t )( page - 1 );
+			if ( end > start && madvise( (void *)start, end - start, MADV_DONTNEED ) == 0 )
+				released += end - start;
+
+			while ( j < run )
+				segment_free_run( segment, j++, ~( u_int64_t ) 0 );
+			/* The word at run is in use, if there is one */
+		}
+	}
+#endif
+	return released;
+}
+
+static void *memory_allocator_alloc(void *p_ctx, size_t size, unsigned int i_key_size){
+	LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup = (LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *)p_ctx;
+	int index;
+
+	if ( i_key_size > (unsigned int)array_lookup->key_size )
+		return NULL;
+	if ( ( index = lockless_alloc_memory( array_lookup ) ) < 0 )
+		return NULL;
+	return lockless_memory_slot( array_lookup, index );
+}
+
+static void memory_allocator_free(void *p_ctx, void *ptr, size_t size){
+	LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup = (LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *)p_ctx;
+
+	lockless_dealloc_memory( array_lookup, lockless_memory_index( array_lookup, ptr ) );
+}
+
+const ght_allocator_t lockless_memory_allocator = {
+	memory_allocator_alloc,
+	memory_allocator_free,
+	NULL,
+	NULL
+};
+
+/*
+ * The entry pool keeps one pool per key size class. The segments of a
+ * class are only created when the first entry of that class is
+ * allocated. Keys longer than the largest class go to malloc().
+ */
+static const int pool_class_key_size[ LOCKLESS_POOL_CLASSES ] = { 8, 16, 32, 64, LOCKLESS_POOL_MAX_KEY };
+
+static inline int pool_class(unsigned int key_size){
+	int i;
+
+	for ( i = 0 ; i < LOCKLESS_POOL_CLASSES ; i++ ) {
+		if ( key_size <= pool_class_key_size[ i ] )
+			return i;
+	}
+	return -1;
+}
+
+int init_entry_pool(LOCKLESS_ENTRY_POOL_ST *pool, int max_l1_array_lookup_table_size, int max_core){
+	return init_entry_pool_ex( pool, max_l1_array_lookup_table_size, max_core, 0 );
+}
+
+int init_entry_pool_ex(LOCKLESS_ENTRY_POOL_ST *pool, int max_l1_array_lookup_table_size, int max_core, int page_flags){
+	int i;
+
+	for ( i = 0 ; i < LOCKLESS_POOL_CLASSES ; i++ ) {
+		if ( pool_init( &pool->classes[ i ], max_l1_array_lookup_table_size, max_core, pool_class_key_size[ i ], page_flags ) < 0 ) {
+			while ( --i >= 0 )
+				destroy_array_lookup_table( &pool->classes[ i ] );
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void destroy_entry_pool(LOCKLESS_ENTRY_POOL_ST *pool){
+	int i;
+
+	for ( i = 0 ; i < LOCKLESS_POOL_CLASSES ; i++ )
+		destroy_array_lookup_table( &pool->classes[ i ] );
+}
+
+void *lockless_pool_alloc(LOCKLESS_ENTRY_POOL_ST *pool, unsigned int key_size){
+	int i = pool_class( key_size );
+	int index;
+
+	if ( i < 0 )
+		return malloc( sizeof( ght_hash_entry_t ) + key_size );
+	if ( ( index = lockless_alloc_memory( &pool->classes[ i ] ) ) < 0 )
+		return NULL;
+	return lockless_memory_slot( &pool->classes[ i ], index );
+}
+
+void lockless_pool_free(LOCKLESS_ENTRY_POOL_ST *pool, void *p, unsigned int key_size){
+	int i = pool_class( key_size );
+
+	if ( i < 0 )
+		free( p );
+	else
+		lockless_dealloc_memory( &pool->classes[ i ], lockless_memory_index( &pool->classes[ i ], p ) );
+}
+
+static void *pool_allocator_alloc(void *p_ctx, size_t size, unsigned int i_key_size){
+	return lockless_pool_alloc( (LOCKLESS_ENTRY_POOL_ST *)p_ctx, i_key_size );
+}
+
+static void pool_allocator_free(void *p_ctx, void *ptr, size_t size){
+	lockless_pool_free( (LOCKLESS_ENTRY_POOL_ST *)p_ctx, ptr, size - sizeof( ght_hash_entry_t ) );
+}
+
+const ght_allocator_t lockless_pool_allocator = {
+	pool_allocator_alloc,
+	pool_allocator_free,
+	NULL,
+	NULL
+};
+
+/*
+ * The NUMA pool keeps one entry pool per node, with its segments bound
+ * to that node. A thread allocates from the pool of the node it runs
+ * on and only takes memory from another node when its own is full.
+ * Entries are returned to the pool they came from, whichever thread
+ * frees them. The counters live with the node of the thread which
+ * updates them, so they do not bounce between the nodes either.
+ */
+int init_numa_pool(LOCKLESS_NUMA_POOL_ST *pool, int max_l1_array_lookup_table_size, int max_core, int page_flags){
+	int i, j;
+
+	pool->nr_nodes = ght_numa_nodes();
+	if ( posix_memalign( ( void ** ) &pool->nodes, 64, pool->nr_nodes * sizeof( LOCKLESS_NUMA_NODE_ST ) ) != 0 )
+		return -1;
+	memset( pool->nodes, 0, pool->nr_nodes * sizeof( LOCKLESS_NUMA_NODE_ST ) );
+
+	for ( i = 0 ; i < pool->nr_nodes ; i++ ) {
+		/* The cores are shared out between the nodes */
+		if ( init_entry_pool_ex( &pool->nodes[ i ].pool, max_l1_array_lookup_table_size,
+					( max_core + pool->nr_nodes - 1 ) / pool->nr_nodes, page_flags ) < 0 ) {
+			while ( --i >= 0 )
+				destroy_entry_pool( &pool->nodes[ i ].pool );
+			free( pool->nodes );
+			pool->nodes = NULL;
+			return -1;
+		}
+		for ( j = 0 ; j < LOCKLESS_POOL_CLASSES ; j++ )
+			pool->nodes[ i ].pool.classes[ j ].node = pool->nr_nodes > 1 ? i : -1;
+	}
+	return 0;
+}
+
+void destroy_numa_pool(LOCKLESS_NUMA_POOL_ST *pool){
+	int i;
+
+	for ( i = 0 ; i < pool->nr_nodes ; i++ )
+		destroy_entry_pool( &pool->nodes[ i ].pool );
+	free( pool->nodes );
+	pool->nodes = NULL;
+	pool->nr_nodes = 0;
+}
+
+void *lockless_numa_alloc(LOCKLESS_NUMA_POOL_ST *pool, unsigned int key_size){
+	int node = ght_numa_node() % pool->nr_nodes;
+	LOCKLESS_NUMA_NODE_ST *local = &pool->nodes[ node ];
+	void *p;
+	int i;
+
+	if ( ( p = lockless_pool_alloc( &local->pool, key_size ) ) ) {
+		__atomic_fetch_add( &local->local_allocs, 1, __ATOMIC_RELAXED );
+		return p;
+	}
+	for ( i = 1 ; i < pool->nr_nodes ; i++ ) {
+		if ( ( p = lockless_pool_alloc( &pool->nodes[ ( node + i ) % pool->nr_nodes ].pool, key_size ) ) ) {
+			__atomic_fetch_add( &local->remote_allocs, 1, __ATOMIC_RELAXED );
+			return p;
+		}
+	}
+	return NULL;
 }
+
+void lockless_numa_free(LOCKLESS_NUMA_POOL_ST *pool, void *p, unsigned int key_size){
+	int node = ght_numa_node() % pool->nr_nodes;
+	int c = pool_class( key_size );
+	int i, n;
+
+	if ( c < 0 ) {
+		free( p );
+		return;
+	}
+	/* Most entries are freed on the node which allocated them */
+	for ( i = 0 ; i < pool->nr_nodes ; i++ ) {
+		n = ( node + i ) % pool->nr_nodes;
+		if ( lockless_memory_index( &pool->nodes[ n ].pool.classes[ c ], p ) >= 0 ) {
+			if ( i > 0 )
+				__atomic_fetch_add( &pool->nodes[ node ].remote_frees, 1, __ATOMIC_RELAXED );
+			lockless_pool_free( &pool->nodes[ n ].pool, p, key_size );
+			return;
+		}
+	}
+}
+
+void lockless_numa_stats(LOCKLESS_NUMA_POOL_ST *pool, u_int64_t *local_allocs, u_int64_t *remote_allocs, u_int64_t *remote_frees){
+	int i;
+
+	*local_allocs = *remote_allocs = *remote_frees = 0;
+	for ( i = 0 ; i < pool->nr_nodes ; i++ ) {
+		*local_allocs += __atomic_load_n( &pool->nodes[ i ].local_allocs, __ATOMIC_RELAXED );
+		*remote_allocs += __atomic_load_n( &pool->nodes[ i ].remote_allocs, __ATOMIC_RELAXED );
+		*remote_frees += __atomic_load_n( &pool->nodes[ i ].remote_frees, __ATOMIC_RELAXED );
+	}
+}
+
+static void *numa_allocator_alloc(void *p_ctx, size_t size, unsigned int i_key_size){
+	return lockless_numa_alloc( (LOCKLESS_NUMA_POOL_ST *)p_ctx, i_key_size );
+}
+
+static void numa_allocator_free(void *p_ctx, void *ptr, size_t size){
+	lockless_numa_free( (LOCKLESS_NUMA_POOL_ST *)p_ctx, ptr, size - sizeof( ght_hash_entry_t ) );
+}
+
+const ght_allocator_t lockless_numa_allocator = {
+	numa_allocator_alloc,
+	numa_allocator_free,
+	NULL,
+	NULL
+};
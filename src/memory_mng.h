@@ -1,20 +1,64 @@
 #ifndef MEMORY_MNG_H
 #define MEMORY_MNG_H
 
+/* A per-thread cache of free slots, see memory_mng.c. The counters
+ * are those of the threads using the magazine, so updating them does
+ * not contend with other threads; they are summed by
+ * lockless_memory_stats(). allocs and frees are only written while
+ * the magazine is held, the others with atomic adds. */
+struct __LOCKLESS_MAGAZINE_ST__ {
+	u_int32_t busy;
+	int alloc_word;         /* The L3 word of the slots in alloc_mask */
+	u_int64_t alloc_mask;   /* Free slots handed out by this magazine */
+	int free_word;          /* The L3 word of the slots in free_mask */
+	u_int64_t free_mask;    /* Freed slots not yet returned */
+
+	u_int64_t allocs;
+	u_int64_t frees;
+	u_int64_t shared_allocs;  /* Made while the magazine was held elsewhere */
+	u_int64_t shared_frees;
+	u_int64_t failed_allocs;
+	u_int64_t cas_retries;  /* Failed CAS on the shared bitmaps */
+	u_int64_t misses;       /* Times the magazine was held by another thread */
+} __attribute__((aligned(64)));
+typedef struct __LOCKLESS_MAGAZINE_ST__ LOCKLESS_MAGAZINE_ST;
+
+/* The most segments a pool can grow to */
+#define LOCKLESS_MAX_SEGMENTS 256
+
+/* One segment of the pool, with the bitmap tree of its slots */
+struct __LOCKLESS_SEGMENT_ST__ {
+	u_int64_t *l1_array_lookup_table;
+	u_int64_t *l2_array_lookup_table;
+	u_int64_t *l3_array_lookup_table;
+
+	void *static_memory;    /* segment_size slots of slot_size bytes */
+	int fresh_words;        /* The L3 words below this have been taken into use */
+};
+typedef struct __LOCKLESS_SEGMENT_ST__ LOCKLESS_SEGMENT_ST;
+
 struct __LOCKLESS_STATIC_BUCKET_HASHTABLE_ST__ {
 	int max_l1_array_lookup_table_size;
 	int max_l2_array_lookup_table_size;
 	int max_l3_array_lookup_table_size;
 	
 	
-	u_int64_t *l1_array_lookup_table;
-	u_int64_t *l2_array_lookup_table;
-	u_int64_t *l3_array_lookup_table;
+	LOCKLESS_SEGMENT_ST *segments[LOCKLESS_MAX_SEGMENTS];
+	int nr_segments;
+	int segment_size;       /* The number of slots in a segment */
+	int key_size;           /* The longest key a slot can hold */
+	int slot_size;          /* An entry and its inline key */
+	u_int32_t growing;      /* Set while a segment is being appended */
+	int page_flags;         /* GHT_PAGES_* flags the slabs are mapped with */
+	int node;               /* The NUMA node the slabs are bound to, or -1 */
 	
-	int limit_size;
+	int limit_size;         /* The number of slots in all segments */
 	u_int32_t cur_allocated_num;
+	u_int32_t high_water;   /* The most slots ever allocated at once */
 	u_int32_t max_core;
 
+	LOCKLESS_MAGAZINE_ST *magazines;
+	int max_magazines;
 };
 typedef struct __LOCKLESS_STATIC_BUCKET_HASHTABLE_ST__ LOCKLESS_STATIC_BUCKET_HASHTABLE_ST;
 
@@ -27,9 +71,124 @@ struct __HASH_MEM_ACCESS_LAYER_ST__ {
 typedef struct __HASH_MEM_ACCESS_LAYER_ST__ HASH_MEM_ACCESS_LAYER_ST;
 
 
-void init_array_lookup_table(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int max_l1_array_lookup_table_size, int max_core, void **static_memory, int key_size);
+/* Create a pool of one segment of max_l1_array_lookup_table_size *
+ * 64^3 entries, each with room for a key_size bytes key right after
+ * it. Returns 0, or -1 if the memory could not be allocated.
+ * static_memory, if not NULL, is set to the slots of the first
+ * segment. */
+int init_array_lookup_table(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int max_l1_array_lookup_table_size, int max_core, void **static_memory, int key_size);
+/* The same, with the slabs of all segments backed as the GHT_PAGES_*
+ * flags of ght_create_ex() say */
+int init_array_lookup_table_ex(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int max_l1_array_lookup_table_size, int max_core, void **static_memory, int key_size, int page_flags);
+void destroy_array_lookup_table(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup);
 int lockless_alloc_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup);
 void lockless_dealloc_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup , int index);
+/* Return the slots cached in the magazines to the shared bitmaps */
+void lockless_flush_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup);
+/* Release the empty segments at the end of the pool and return how
+ * many were released. Must not run concurrently with other calls. */
+int lockless_shrink_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup);
+/* The counters of a pool. They are cumulative, so rates are the
+ * difference between two calls divided by the time between them. */
+struct __LOCKLESS_MEMORY_STATS_ST__ {
+	u_int64_t allocs;
+	u_int64_t frees;
+	u_int64_t failed_allocs;
+	u_int64_t cas_retries;
+	u_int64_t magazine_misses;
+	u_int32_t allocated;    /* cur_allocated_num */
+	u_int32_t high_water;
+	int limit_size;         /* The slots in all segments */
+	int nr_segments;
+};
+typedef struct __LOCKLESS_MEMORY_STATS_ST__ LOCKLESS_MEMORY_STATS_ST;
+
+/* The state of the bitmaps of a pool. An L3 word is a group of 64
+ * slots. Slots held in magazines count as used in the words. */
+struct __LOCKLESS_MEMORY_FRAG_ST__ {
+	u_int64_t l1_bits;      /* The L1 bits set, out of l1_words * 64 */
+	u_int64_t l2_bits;
+	u_int64_t l1_words;
+	u_int64_t l2_words;
+	u_int64_t words_untouched;  /* Never taken into use */
+	u_int64_t words_empty;      /* All 64 slots free */
+	u_int64_t words_partial;    /* Some slots free, the fragmentation */
+	u_int64_t words_full;       /* No slot free */
+	u_int64_t free_slots;       /* Free in the bitmaps */
+	u_int64_t cached_slots;     /* Free in the magazines */
+};
+typedef struct __LOCKLESS_MEMORY_FRAG_ST__ LOCKLESS_MEMORY_FRAG_ST;
+
+/* Sum the counters, costs one read per magazine and can be called at
+ * any time */
+void lockless_memory_stats(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_MEMORY_STATS_ST *stats);
+/* Scan the bitmaps of the L3 words in use, 8 bytes per 64 slots. The
+ * result is only approximate while other threads use the pool. */
+void lockless_memory_fragmentation(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, LOCKLESS_MEMORY_FRAG_ST *frag);
+
+/* Map between slot indexes and entries, the pool is not contiguous */
+void *lockless_memory_slot(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int index);
+int lockless_memory_index(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, void *p);
+/* The number of L3 words of 64 slots in the pool. Word n holds the
+ * slots n * 64 to n * 64 + 63. */
+int lockless_memory_words(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup);
+/* The slots of an L3 word which are allocated, one bit each. Slots
+ * cached in the magazines count as allocated. */
+u_int64_t lockless_memory_used(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int word);
+/* Allocate a slot of a partially used L3 word below the word of index,
+ * scanning up from the word *cursor, which is advanced past the full
+ * words. Returns -1 if there is none. Used to compact the pool. */
+int lockless_alloc_memory_below(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup, int *cursor, int index);
+/* Give the pages of the L3 words whose slots are all free back to the
+ * system; they read as zero when used again. Returns the number of
+ * bytes released. Can be called at any time. */
+size_t lockless_trim_memory(LOCKLESS_STATIC_BUCKET_HASHTABLE_ST *array_lookup);
+/* For ght_set_allocator(), with the pool as context. Entries with keys
+ * longer than the key_size of the pool are refused. */
+extern const ght_allocator_t lockless_memory_allocator;
+
+/* Entries with inline keys of up to 8, 16, 32, 64 and 128 bytes, each
+ * size class in its own pool */
+#define LOCKLESS_POOL_CLASSES 5
+#define LOCKLESS_POOL_MAX_KEY 128
+
+struct __LOCKLESS_ENTRY_POOL_ST__ {
+	LOCKLESS_STATIC_BUCKET_HASHTABLE_ST classes[LOCKLESS_POOL_CLASSES];
+};
+typedef struct __LOCKLESS_ENTRY_POOL_ST__ LOCKLESS_ENTRY_POOL_ST;
+
+int init_entry_pool(LOCKLESS_ENTRY_POOL_ST *pool, int max_l1_array_lookup_table_size, int max_core);
+int init_entry_pool_ex(LOCKLESS_ENTRY_POOL_ST *pool, int max_l1_array_lookup_table_size, int max_core, int page_flags);
+void destroy_entry_pool(LOCKLESS_ENTRY_POOL_ST *pool);
+/* Allocate an entry with room for key_size key bytes after it */
+void *lockless_pool_alloc(LOCKLESS_ENTRY_POOL_ST *pool, unsigned int key_size);
+void lockless_pool_free(LOCKLESS_ENTRY_POOL_ST *pool, void *p, unsigned int key_size);
+/* For ght_set_allocator(), with the pool as context */
+extern const ght_allocator_t lockless_pool_allocator;
+
+/* An entry pool per NUMA node, threads allocate from their own node */
+struct __LOCKLESS_NUMA_NODE_ST__ {
+	LOCKLESS_ENTRY_POOL_ST pool;
+	u_int64_t local_allocs;   /* Served by the node of the thread */
+	u_int64_t remote_allocs;  /* Served by another node, this one was full */
+	u_int64_t remote_frees;   /* Entries of another node freed here */
+} __attribute__((aligned(64)));
+typedef struct __LOCKLESS_NUMA_NODE_ST__ LOCKLESS_NUMA_NODE_ST;
+
+struct __LOCKLESS_NUMA_POOL_ST__ {
+	LOCKLESS_NUMA_NODE_ST *nodes;
+	int nr_nodes;
+};
+typedef struct __LOCKLESS_NUMA_POOL_ST__ LOCKLESS_NUMA_POOL_ST;
+
+int init_numa_pool(LOCKLESS_NUMA_POOL_ST *pool, int max_l1_array_lookup_table_size, int max_core, int page_flags);
+void destroy_numa_pool(LOCKLESS_NUMA_POOL_ST *pool);
+void *lockless_numa_alloc(LOCKLESS_NUMA_POOL_ST *pool, unsigned int key_size);
+void lockless_numa_free(LOCKLESS_NUMA_POOL_ST *pool, void *p, unsigned int key_size);
+/* Sum the counters of all nodes */
+void lockless_numa_stats(LOCKLESS_NUMA_POOL_ST *pool, u_int64_t *local_allocs, u_int64_t *remote_allocs, u_int64_t *remote_frees);
+/* For ght_set_allocator(), with the NUMA pool as context */
+extern const ght_allocator_t lockless_numa_allocator;
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,342 @@
+/*********************************************************************
+ *
+ * Filename:      pages.c
+ * Description:   Huge page backed and NUMA placed allocations for
+ *                the bucket arrays and the static entry pools.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ ********************************************************************/
+#include <stdlib.h>   /* calloc */
+#include <string.h>   /* memset */
+#include <stdint.h>   /* uintptr_t */
+#include <pthread.h>
+
+#ifdef __linux__
+#include <stdio.h>        /* snprintf */
+#include <unistd.h>       /* syscall, access */
+#include <sys/syscall.h>  /* SYS_mbind, SYS_getcpu */
+#include <sys/mman.h>     /* mmap, madvise */
+#endif
+
+#include "ght_hash_table.h"
+#include "ght_private.h"
+
+#define HUGE_2MB ((size_t) 1 << 21)
+#define HUGE_1GB ((size_t) 1 << 30)
+
+#ifndef MAP_HUGE_SHIFT
+# define MAP_HUGE_SHIFT 26
+#endif
+
+/* From linux/mempolicy.h */
+#define MPOL_PREFERRED  1
+#define MPOL_INTERLEAVE 3
+
+/* The nodes a policy can name, one bit each in the node mask */
+#define MAX_NODES       (sizeof(unsigned long) * 8)
+
+/* Regions at least this large are always mapped, so their pages stay
+ * shared zero pages until first written */
+#define MAP_MIN         ((size_t) 1 << 20)
+
+/* How many node lookups a thread serves from its cached node before
+ * asking the kernel again, in case it was migrated */
+#define NODE_REFRESH    4096
+
+/* How a mapping is backed */
+#define KIND_MMAP      0 /* Normal pages */
+#define KIND_HUGETLB   1 /* Reserved huge pages */
+#define KIND_THP       2 /* Normal pages advised as transparent huge pages */
+
+/* Every mapping is remembered, so it can be unmapped by address. There
+ * are only a few per table or pool segment. */
+typedef struct s_mapping
+{
+  void *p_addr;
+  size_t size;
+  int i_kind;
+  int i_placed;                /* A NUMA policy was applied */
+  struct s_mapping *p_next;
+} mapping_t;
+
+static mapping_t *p_mappings = NULL;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ght_page_stats_t page_stats;
+
+static int i_nodes = 0;
+static __thread int i_thread_node = -1;
+static __thread unsigned int i_thread_node_uses = 0;
+
+static void account(size_t size, int i_kind, int i_placed, int i_sign)
+{
+  page_stats.i_bytes += i_sign * size;
+  if (i_placed)
+    page_stats.i_numa_bytes += i_sign * size;
+  if (i_kind == KIND_HUGETLB)
+    page_stats.i_hugetlb_bytes += i_sign * size;
+  else if (i_kind == KIND_THP)
+    page_stats.i_thp_bytes += i_sign * size;
+}
+
+#ifdef __linux__
+/* Count the nodeN directories, the nodes are numbered without gaps */
+static int count_nodes(void)
+{
+  char path[64];
+  int n = 0;
+
+  do
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+  while (access(path, F_OK) == 0 && (unsigned) ++n < MAX_NODES);
+
+  return n > 0 ? n : 1;
+}
+
+/* Apply the memory policy before the pages are first touched */
+static int place(void *p, size_t size, int i_flags, int i_node)
+{
+  unsigned long mask;
+  int i_mode;
+
+  if (ght_numa_nodes() < 2)
+    return 0;
+  if (i_node >= 0)
+    {
+      i_mode = MPOL_PREFERRED;
+      mask = 1UL << (i_node % ght_numa_nodes());
+    }
+  else if (i_flags & GHT_PAGES_INTERLEAVE)
+    {
+      i_mode = MPOL_INTERLEAVE;
+      mask = ght_numa_nodes() == (int) MAX_NODES ? ~0UL : (1UL << ght_numa_nodes()) - 1;
+    }
+  else
+    return 0;
+
+  return syscall(SYS_mbind, p, size, i_mode, &mask, MAX_NODES + 1, 0) == 0;
+}
+
+static void *map_hugetlb(size_t size, int i_shift)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (i_shift << MAP_HUGE_SHIFT), -1, 0);
+
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/* Map size bytes aligned to 2MB, so the kernel can use transparent
+ * huge pages for all of it */
+static void *map_thp(size_t size, int *p_kind)
+{
+  size_t map_size = size + HUGE_2MB;
+  char *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *p_aligned;
+
+  if (p == MAP_FAILED)
+    return NULL;
+
+  p_aligned = (char *) (((uintptr_t) p + HUGE_2MB - 1) & ~(uintptr_t) (HUGE_2MB - 1));
+  if (p_aligned > p)
+    munmap(p, p_aligned - p);
+  if (p + map_size > p_aligned + size)
+    munmap(p_aligned + size, (p + map_size) - (p_aligned + size));
+
+  *p_kind = KIND_MMAP;
+#ifdef MADV_HUGEPAGE
+  if (madvise(p_aligned, size, MADV_HUGEPAGE) == 0)
+    *p_kind = KIND_THP;
+#endif
+  return p_aligned;
+}
+
+/* Map *p_size bytes as i_flags say, rounding *p_size up to whole huge
+ * pages if they are used */
+static void *map_pages(size_t *p_size, int i_flags, int *p_kind)
+{
+  size_t map_size;
+  void *p = NULL;
+
+  *p_kind = KIND_MMAP;
+  if (!(i_flags & (GHT_PAGES_HUGE | GHT_PAGES_HUGE_1GB)))
+    {
+      p = mmap(NULL, *p_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      return p == MAP_FAILED ? NULL : p;
+    }
+
+  /* Try the reserved huge pages first, then transparent ones */
+  if (i_flags & GHT_PAGES_HUGE_1GB)
+    {
+      map_size = (*p_size + HUGE_1GB - 1) & ~(HUGE_1GB - 1);
+      p = map_hugetlb(map_size, 30);
+    }
+  if (!p)
+    {
+      map_size = (*p_size + HUGE_2MB - 1) & ~(HUGE_2MB - 1);
+      p = map_hugetlb(map_size, 21);
+    }
+  if (p)
+    {
+      *p_size = map_size;
+      *p_kind = KIND_HUGETLB;
+      return p;
+    }
+  return map_thp(*p_size, p_kind);
+}
+#endif /* __linux__ */
+
+int ght_numa_nodes(void)
+{
+#ifdef __linux__
+  int n = __atomic_load_n(&i_nodes, __ATOMIC_RELAXED);
+
+  if (n == 0)
+    {
+      n = count_nodes();
+      __atomic_store_n(&i_nodes, n, __ATOMIC_RELAXED);
+    }
+  return n;
+#else
+  return 1;
+#endif
+}
+
+int ght_numa_node(void)
+{
+#ifdef __linux__
+  unsigned int i_cpu;
+  unsigned int i_node;
+
+  if (i_thread_node < 0 || ++i_thread_node_uses >= NODE_REFRESH)
+    {
+      i_thread_node_uses = 0;
+      if (syscall(SYS_getcpu, &i_cpu, &i_node, NULL) != 0)
+        i_node = 0;
+      i_thread_node = (int) i_node % ght_numa_nodes();
+    }
+  return i_thread_node;
+#else
+  return 0;
+#endif
+}
+
+void *ght_pages_alloc_node(size_t size, int i_flags, int i_node)
+{
+#ifdef __linux__
+  mapping_t *p_mapping;
+  void *p;
+  int i_kind;
+  int i_placed;
+
+  /* Small memory without huge pages or a policy is left to malloc */
+  if (size < MAP_MIN && !(i_flags & (GHT_PAGES_HUGE | GHT_PAGES_HUGE_1GB)) &&
+      (ght_numa_nodes() < 2 || (i_node < 0 && !(i_flags & GHT_PAGES_INTERLEAVE))))
+    return calloc(1, size);
+
+  if (!(p_mapping = (mapping_t *) malloc(sizeof(mapping_t))))
+    return NULL;
+  if (!(p = map_pages(&size, i_flags, &i_kind)))
+    {
+      free(p_mapping);
+      return NULL;
+    }
+  i_placed = place(p, size, i_flags, i_node);
+
+  p_mapping->p_addr = p;
+  p_mapping->size = size;
+  p_mapping->i_kind = i_kind;
+  p_mapping->i_placed = i_placed;
+
+  pthread_mutex_lock(&mappings_lock);
+  p_mapping->p_next = p_mappings;
+  p_mappings = p_mapping;
+  account(size, i_kind, i_placed, 1);
+  pthread_mutex_unlock(&mappings_lock);
+
+  return p;
+#else
+  return calloc(1, size);
+#endif
+}
+
+void *ght_pages_alloc(size_t size, int i_flags)
+{
+  return ght_pages_alloc_node(size, i_flags, -1);
+}
+
+void ght_pages_free(void *p)
+{
+#ifdef __linux__
+  mapping_t **pp_mapping;
+  mapping_t *p_mapping = NULL;
+
+  if (!p)
+    return;
+
+  pthread_mutex_lock(&mappings_lock);
+  for (pp_mapping = &p_mappings; *pp_mapping; pp_mapping = &(*pp_mapping)->p_next)
+    {
+      if ((*pp_mapping)->p_addr == p)
+        {
+          p_mapping = *pp_mapping;
+          *pp_mapping = p_mapping->p_next;
+          account(p_mapping->size, p_mapping->i_kind, p_mapping->i_placed, -1);
+          break;
+        }
+    }
+  pthread_mutex_unlock(&mappings_lock);
+
+  if (p_mapping)
+    {
+      munmap(p, p_mapping->size);
+      free(p_mapping);
+      return;
+    }
+#endif
+  /* Allocated without huge pages */
+  free(p);
+}
+
+void ght_pages_zero(void *p, size_t size)
+{
+#ifdef __linux__
+  mapping_t *p_mapping;
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t i_drop = 0;
+
+  pthread_mutex_lock(&mappings_lock);
+  for (p_mapping = p_mappings; p_mapping; p_mapping = p_mapping->p_next)
+    {
+      /* Reserved huge pages would be given back to the pool */
+      if (p_mapping->p_addr == p && p_mapping->i_kind != KIND_HUGETLB)
+        {
+          i_drop = size & ~(page - 1);
+          break;
+        }
+    }
+  pthread_mutex_unlock(&mappings_lock);
+
+  /* Dropped private pages read as zero again, without being resident */
+  if (i_drop > 0 && madvise(p, i_drop, MADV_DONTNEED) == 0)
+    {
+      memset((char *) p + i_drop, 0, size - i_drop);
+      return;
+    }
+#endif
+  memset(p, 0, size);
+}
+
+void ght_get_page_stats(ght_page_stats_t *p_stats)
+{
+  pthread_mutex_lock(&mappings_lock);
+  *p_stats = page_stats;
+  pthread_mutex_unlock(&mappings_lock);
+}